@@ -0,0 +1,563 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * A closed-loop HTTP load generator for benchmarking ht. Each
+ * thread drives its share of the connections from one epoll loop;
+ * every connection sends a request, reads the whole response and
+ * sends the next one. Results are printed as one JSON object.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LOAD_HEAD_SIZE    8192
+#define LOAD_READ_SIZE    (256 * 1024)
+#define LOAD_MAX_EVENTS   256
+
+typedef struct load_options {
+	const char* name;
+	const char* address;
+	int port;
+	const char* path;
+	int connections;
+	int threads;
+	double duration;  /* seconds */
+	bool keep_alive;
+} load_options_t;
+
+typedef enum client_state {
+	CLIENT_CONNECTING,
+	CLIENT_SENDING,
+	CLIENT_READING_HEAD,
+	CLIENT_READING_BODY,
+} client_state_t;
+
+typedef struct client {
+	int socket;
+	client_state_t state;
+	size_t request_sent;
+	char head[ LOAD_HEAD_SIZE ];
+	size_t head_length;
+	int64_t body_length;    /* -1 when the body runs until the peer closes */
+	int64_t body_received;
+	bool close_after;       /* the server said Connection: close */
+	int64_t started;        /* microseconds */
+} client_t;
+
+typedef struct load_thread {
+	pthread_t thread;
+	const load_options_t* options;
+	struct sockaddr_in address;
+	const char* request;
+	size_t request_length;
+	int connections;
+	int64_t deadline;
+	uint32_t* samples;      /* latencies in microseconds */
+	size_t samples_count;
+	size_t samples_capacity;
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t bytes;
+	char buffer[ LOAD_READ_SIZE ];
+} load_thread_t;
+
+static void*   load_run          ( void* data );
+static bool    client_connect    ( load_thread_t* thread, int poll, client_t* client );
+static void    client_close      ( client_t* client );
+static bool    client_handle     ( load_thread_t* thread, int poll, client_t* client );
+static bool    client_parse_head ( client_t* client, size_t* body_offset );
+static void    record_sample     ( load_thread_t* thread, int64_t latency );
+static int     compare_samples   ( const void* left, const void* right );
+static int64_t clock_us          ( void );
+static void    usage             ( const char* program );
+
+
+int main( int argc, char* argv[] )
+{
+	load_options_t options = {
+		.name        = "load",
+		.address     = "127.0.0.1",
+		.port        = 8080,
+		.path        = "/",
+		.connections = 64,
+		.threads     = 4,
+		.duration    = 5.0,
+		.keep_alive  = true,
+	};
+	int option;
+
+	while( (option = getopt( argc, argv, "n:a:p:u:c:t:d:Ch" )) != -1 )
+	{
+		switch( option )
+		{
+			case 'n': options.name        = optarg; break;
+			case 'a': options.address     = optarg; break;
+			case 'p': options.port        = atoi( optarg ); break;
+			case 'u': options.path        = optarg; break;
+			case 'c': options.connections = atoi( optarg ); break;
+			case 't': options.threads     = atoi( optarg ); break;
+			case 'd': options.duration    = atof( optarg ); break;
+			case 'C': options.keep_alive  = false; break;
+			case 'h':
+			default:
+				usage( argv[0] );
+				return option == 'h' ? 0 : 1;
+		}
+	}
+
+	if( options.connections < 1 || options.threads < 1 || options.duration <= 0 )
+	{
+		usage( argv[0] );
+		return 1;
+	}
+
+	if( options.threads > options.connections )
+	{
+		options.threads = options.connections;
+	}
+
+	struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons( options.port ) };
+
+	if( inet_pton( AF_INET, options.address, &address.sin_addr ) != 1 )
+	{
+		fprintf( stderr, "ERROR: '%s' is not an IPv4 address.\n", options.address );
+		return 1;
+	}
+
+	char request[ 2048 ];
+	int request_length = snprintf( request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: ht-load\r\nConnection: %s\r\n\r\n",
+	                               options.path, options.address, options.port, options.keep_alive ? "keep-alive" : "close" );
+
+	if( request_length < 0 || request_length >= (int) sizeof(request) )
+	{
+		fprintf( stderr, "ERROR: The request path is too long.\n" );
+		return 1;
+	}
+
+	load_thread_t* threads = calloc( options.threads, sizeof(load_thread_t) );
+
+	if( !threads )
+	{
+		return 1;
+	}
+
+	int64_t started  = clock_us( );
+	int64_t deadline = started + (int64_t) (options.duration * 1e6);
+
+	for( int i = 0; i < options.threads; i++ )
+	{
+		load_thread_t* thread = &threads[ i ];
+		thread->options        = &options;
+		thread->address        = address;
+		thread->request        = request;
+		thread->request_length = request_length;
+		thread->connections    = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+		thread->deadline       = deadline;
+
+		if( pthread_create( &thread->thread, NULL, load_run, thread ) != 0 )
+		{
+			fprintf( stderr, "ERROR: Unable to start a load thread.\n" );
+			return 1;
+		}
+	}
+
+	uint64_t requests = 0;
+	uint64_t errors = 0;
+	uint64_t bytes = 0;
+	size_t samples_count = 0;
+
+	for( int i = 0; i < options.threads; i++ )
+	{
+		pthread_join( threads[ i ].thread, NULL );
+		requests      += threads[ i ].requests;
+		errors        += threads[ i ].errors;
+		bytes         += threads[ i ].bytes;
+		samples_count += threads[ i ].samples_count;
+	}
+
+	double elapsed = (clock_us( ) - started) / 1e6;
+	uint32_t* samples = malloc( (samples_count + 1) * sizeof(uint32_t) );
+	size_t merged = 0;
+
+	for( int i = 0; i < options.threads; i++ )
+	{
+		if( samples )
+		{
+			memcpy( samples + merged, threads[ i ].samples, threads[ i ].samples_count * sizeof(uint32_t) );
+			merged += threads[ i ].samples_count;
+		}
+		free( threads[ i ].samples );
+	}
+
+	if( samples )
+	{
+		qsort( samples, merged, sizeof(uint32_t), compare_samples );
+	}
+
+	const double percentiles[] = { 0.50, 0.99, 0.999 };
+	uint32_t latencies[ 3 ] = { 0, 0, 0 };
+
+	for( int i = 0; i < 3 && merged > 0; i++ )
+	{
+		size_t index = (size_t) (percentiles[ i ] * merged);
+		latencies[ i ] = samples[ index < merged ? index : merged - 1 ];
+	}
+
+	printf( "{\"name\":\"%s\",\"path\":\"%s\",\"keep_alive\":%s,\"connections\":%d,\"threads\":%d,"
+	        "\"duration_s\":%.3f,\"requests\":%lu,\"errors\":%lu,\"bytes\":%lu,"
+	        "\"requests_per_sec\":%.1f,\"bytes_per_sec\":%.0f,"
+	        "\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+	        options.name, options.path, options.keep_alive ? "true" : "false", options.connections, options.threads,
+	        elapsed, (unsigned long) requests, (unsigned long) errors, (unsigned long) bytes,
+	        requests / elapsed, bytes / elapsed,
+	        latencies[ 0 ], latencies[ 1 ], latencies[ 2 ], merged > 0 ? samples[ merged - 1 ] : 0 );
+
+	free( samples );
+	free( threads );
+	return 0;
+}
+
+void usage( const char* program )
+{
+	fprintf( stderr, "Usage: %s [-n name] [-a address] [-p port] [-u path] [-c connections] [-t threads] [-d seconds] [-C]\n", program );
+	fprintf( stderr, "  -C  Closes the connection after every request instead of keeping it alive.\n" );
+}
+
+void* load_run( void* data )
+{
+	load_thread_t* thread = (load_thread_t*) data;
+	client_t* clients = calloc( thread->connections, sizeof(client_t) );
+	int poll = epoll_create1( EPOLL_CLOEXEC );
+	struct epoll_event events[ LOAD_MAX_EVENTS ];
+
+	if( !clients || poll < 0 )
+	{
+		fprintf( stderr, "ERROR: Unable to set up a load thread.\n" );
+		free( clients );
+		return NULL;
+	}
+
+	for( int i = 0; i < thread->connections; i++ )
+	{
+		clients[ i ].socket = -1;
+
+		if( !client_connect( thread, poll, &clients[ i ] ) )
+		{
+			thread->errors += 1;
+		}
+	}
+
+	while( clock_us( ) < thread->deadline )
+	{
+		int count = epoll_wait( poll, events, LOAD_MAX_EVENTS, 10 );
+
+		for( int i = 0; i < count; i++ )
+		{
+			client_t* client = (client_t*) events[ i ].data.ptr;
+
+			if( !client_handle( thread, poll, client ) )
+			{
+				/* Start over on a new connection. */
+				client_close( client );
+
+				if( clock_us( ) < thread->deadline && !client_connect( thread, poll, client ) )
+				{
+					thread->errors += 1;
+				}
+			}
+		}
+	}
+
+	for( int i = 0; i < thread->connections; i++ )
+	{
+		client_close( &clients[ i ] );
+	}
+
+	close( poll );
+	free( clients );
+	return NULL;
+}
+
+bool client_connect( load_thread_t* thread, int poll, client_t* client )
+{
+	client->socket = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+	if( client->socket < 0 )
+	{
+		return false;
+	}
+
+	int option_no_delay = 1;
+	setsockopt( client->socket, IPPROTO_TCP, TCP_NODELAY, &option_no_delay, sizeof(option_no_delay) );
+
+	client->state        = CLIENT_CONNECTING;
+	client->request_sent = 0;
+	client->head_length  = 0;
+	client->started      = clock_us( );
+
+	if( connect( client->socket, (struct sockaddr*) &thread->address, sizeof(thread->address) ) < 0 && errno != EINPROGRESS )
+	{
+		client_close( client );
+		return false;
+	}
+
+	struct epoll_event event = { .events = EPOLLOUT, .data.ptr = client };
+
+	if( epoll_ctl( poll, EPOLL_CTL_ADD, client->socket, &event ) < 0 )
+	{
+		client_close( client );
+		return false;
+	}
+
+	return true;
+}
+
+void client_close( client_t* client )
+{
+	if( client->socket >= 0 )
+	{
+		close( client->socket );
+		client->socket = -1;
+	}
+}
+
+/* Advances the client; returns false when its connection has to be replaced. */
+bool client_handle( load_thread_t* thread, int poll, client_t* client )
+{
+	if( client->state == CLIENT_CONNECTING )
+	{
+		int error = 0;
+		socklen_t error_size = sizeof(error);
+
+		if( getsockopt( client->socket, SOL_SOCKET, SO_ERROR, &error, &error_size ) < 0 || error != 0 )
+		{
+			thread->errors += 1;
+			return false;
+		}
+
+		client->state = CLIENT_SENDING;
+	}
+
+	if( client->state == CLIENT_SENDING )
+	{
+		while( client->request_sent < thread->request_length )
+		{
+			ssize_t sent = send( client->socket, thread->request + client->request_sent, thread->request_length - client->request_sent, MSG_NOSIGNAL );
+
+			if( sent < 0 )
+			{
+				if( errno == EAGAIN )
+				{
+					return true;
+				}
+
+				thread->errors += 1;
+				return false;
+			}
+
+			client->request_sent += sent;
+		}
+
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+		epoll_ctl( poll, EPOLL_CTL_MOD, client->socket, &event );
+		client->state = CLIENT_READING_HEAD;
+	}
+
+	for( ;; )
+	{
+		ssize_t received;
+
+		if( client->state == CLIENT_READING_HEAD )
+		{
+			received = recv( client->socket, client->head + client->head_length, sizeof(client->head) - client->head_length - 1, 0 );
+		}
+		else
+		{
+			int64_t remaining = client->body_length < 0 ? LOAD_READ_SIZE : client->body_length - client->body_received;
+			received = recv( client->socket, thread->buffer, remaining < LOAD_READ_SIZE ? remaining : LOAD_READ_SIZE, 0 );
+		}
+
+		if( received < 0 )
+		{
+			if( errno == EAGAIN )
+			{
+				return true;
+			}
+
+			thread->errors += 1;
+			return false;
+		}
+
+		if( received == 0 )
+		{
+			/* A body without a length ends when the server closes. */
+			if( client->state == CLIENT_READING_BODY && client->body_length < 0 )
+			{
+				record_sample( thread, clock_us( ) - client->started );
+				thread->requests += 1;
+				thread->bytes    += client->body_received;
+			}
+			else
+			{
+				thread->errors += 1;
+			}
+
+			return false;
+		}
+
+		if( client->state == CLIENT_READING_HEAD )
+		{
+			size_t body_offset = 0;
+			client->head_length += received;
+			client->head[ client->head_length ] = '\0';
+
+			if( !strstr( client->head, "\r\n\r\n" ) )
+			{
+				if( client->head_length + 1 >= sizeof(client->head) )
+				{
+					thread->errors += 1;
+					return false;
+				}
+				continue;
+			}
+
+			if( !client_parse_head( client, &body_offset ) )
+			{
+				thread->errors += 1;
+				return false;
+			}
+
+			client->state         = CLIENT_READING_BODY;
+			client->body_received = client->head_length - body_offset;
+		}
+		else
+		{
+			client->body_received += received;
+		}
+
+		if( client->body_length >= 0 && client->body_received >= client->body_length )
+		{
+			record_sample( thread, clock_us( ) - client->started );
+			thread->requests += 1;
+			thread->bytes    += client->body_received;
+
+			if( !thread->options->keep_alive || client->close_after || clock_us( ) >= thread->deadline )
+			{
+				return false;
+			}
+
+			/* Next request on the same connection. */
+			client->state        = CLIENT_SENDING;
+			client->request_sent = 0;
+			client->head_length  = 0;
+			client->started      = clock_us( );
+
+			struct epoll_event event = { .events = EPOLLOUT, .data.ptr = client };
+			epoll_ctl( poll, EPOLL_CTL_MOD, client->socket, &event );
+			return true;
+		}
+	}
+}
+
+/* Accepts only 2xx responses; finds the body length and whether the server will close. */
+bool client_parse_head( client_t* client, size_t* body_offset )
+{
+	char* end = strstr( client->head, "\r\n\r\n" );
+	int status = 0;
+
+	*body_offset        = end - client->head + 4;
+	client->body_length = -1;
+	client->close_after = false;
+
+	if( sscanf( client->head, "HTTP/%*d.%*d %d", &status ) != 1 || status < 200 || status > 299 )
+	{
+		return false;
+	}
+
+	for( char* line = strstr( client->head, "\r\n" ); line && line < end; line = strstr( line + 2, "\r\n" ) )
+	{
+		const char* header = line + 2;
+
+		if( strncasecmp( header, "Content-Length:", 15 ) == 0 )
+		{
+			client->body_length = strtoll( header + 15, NULL, 10 );
+		}
+		else if( strncasecmp( header, "Connection:", 11 ) == 0 )
+		{
+			const char* token = strcasestr( header, "close" );
+			client->close_after = token && token < strstr( header, "\r\n" );
+		}
+	}
+
+	/* Without a length the body has to run until the connection closes. */
+	if( client->body_length < 0 )
+	{
+		client->close_after = true;
+	}
+
+	return true;
+}
+
+void record_sample( load_thread_t* thread, int64_t latency )
+{
+	if( thread->samples_count == thread->samples_capacity )
+	{
+		size_t capacity = thread->samples_capacity ? thread->samples_capacity * 2 : 4096;
+		uint32_t* samples = realloc( thread->samples, capacity * sizeof(uint32_t) );
+
+		if( !samples )
+		{
+			return;
+		}
+
+		thread->samples          = samples;
+		thread->samples_capacity = capacity;
+	}
+
+	thread->samples[ thread->samples_count++ ] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t) latency;
+}
+
+int compare_samples( const void* left, const void* right )
+{
+	uint32_t l = *(const uint32_t*) left;
+	uint32_t r = *(const uint32_t*) right;
+	return (l > r) - (l < r);
+}
+
+int64_t clock_us( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
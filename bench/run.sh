@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Benchmarks ht over loopback and prints one JSON object per
+# scenario, so that runs of different versions can be compared.
+#
+#   usage: bench/run.sh [path/to/ht] [path/to/ht-load]
+#
+# Tunables: BENCH_DURATION (seconds per scenario, default 5),
+# BENCH_CONNECTIONS (default 64), BENCH_THREADS (load threads,
+# default 4), BENCH_WORKERS (ht workers, default 4) and
+# BENCH_PORT (default 18080).
+#
+set -e
+
+HT=${1:-bin/ht}
+LOAD=${2:-bin/ht-load}
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+THREADS=${BENCH_THREADS:-4}
+WORKERS=${BENCH_WORKERS:-4}
+PORT=${BENCH_PORT:-18080}
+
+ROOT=$(mktemp -d "${TMPDIR:-/tmp}/ht-bench.XXXXXX")
+SERVER=
+
+cleanup() {
+	if [ -n "$SERVER" ]; then
+		kill -INT "$SERVER" 2>/dev/null || true
+		wait "$SERVER" 2>/dev/null || true
+	fi
+	rm -rf "$ROOT"
+}
+trap cleanup EXIT INT TERM
+
+echo "Creating fixtures in $ROOT..." >&2
+head -c 1024 /dev/urandom > "$ROOT/small.bin"
+head -c 134217728 /dev/urandom > "$ROOT/large.bin"
+
+for entries in 10 1000 100000; do
+	mkdir "$ROOT/dir-$entries"
+	(cd "$ROOT/dir-$entries" && seq -f "file-%06g.txt" 1 "$entries" | xargs touch)
+done
+
+"$HT" -4 -H -p "$PORT" -w "$WORKERS" "$ROOT" > /dev/null 2>&1 &
+SERVER=$!
+
+# Wait for the listener.
+for attempt in $(seq 1 50); do
+	if "$LOAD" -p "$PORT" -u /small.bin -c 1 -t 1 -d 0.05 2>/dev/null | grep -q '"requests":[1-9]'; then
+		break
+	fi
+	sleep 0.1
+done
+
+run() {
+	name=$1
+	shift
+	echo "Running $name..." >&2
+	"$LOAD" -n "$name" -p "$PORT" -d "$DURATION" -c "$CONNECTIONS" -t "$THREADS" "$@"
+}
+
+run small-file           -u /small.bin
+run small-file-close     -u /small.bin -C
+run large-file           -u /large.bin -c 4 -t 4
+run listing-10           -u /dir-10
+run listing-1k           -u /dir-1000
+run listing-100k         -u /dir-100000 -c 4 -t 4
+run listing-100k-page    -u "/dir-100000?page=500"
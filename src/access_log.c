@@ -0,0 +1,363 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "access_log.h"
+
+#define ACCESS_LOG_RING_SIZE  (256 * 1024)  /* per worker; a power of two */
+#define ACCESS_LOG_LINE_MAX   4096
+#define ACCESS_LOG_FLUSH_MS   200
+
+/*
+ * A single-producer, single-consumer byte ring. Positions only
+ * grow; they are reduced modulo the size when indexing.
+ */
+typedef struct access_log_ring {
+	char* data;
+	_Atomic size_t head;      /* advanced by the worker */
+	_Atomic size_t tail;      /* advanced by the flusher */
+	_Atomic uint64_t dropped; /* lines that did not fit */
+} access_log_ring_t;
+
+struct access_log {
+	int file;
+	bool close_file;
+	access_log_format_t format;
+	access_log_ring_t* rings;
+	int rings_count;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t stop_signal;
+	bool stop;
+};
+
+/* A line being formatted; output past the end is cut off. */
+typedef struct access_log_line {
+	char text[ ACCESS_LOG_LINE_MAX ];
+	size_t length;
+} access_log_line_t;
+
+static void* access_log_run     ( void* data );
+static void  access_log_flush   ( access_log_t* log );
+static void  access_log_format  ( access_log_t* log, access_log_line_t* line, const access_log_entry_t* entry );
+static void  line_printf        ( access_log_line_t* line, const char* format, ... );
+static void  line_escape        ( access_log_line_t* line, http_slice_t text, bool json );
+
+
+access_log_t* access_log_create( const char* path, access_log_format_t format, int workers )
+{
+	access_log_t* log = calloc( 1, sizeof(access_log_t) );
+
+	if( !log )
+	{
+		return NULL;
+	}
+
+	log->format      = format;
+	log->rings_count = workers;
+	log->rings       = calloc( workers, sizeof(access_log_ring_t) );
+
+	if( strcmp( path, "-" ) == 0 )
+	{
+		log->file = STDOUT_FILENO;
+	}
+	else
+	{
+		log->file       = open( path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+		log->close_file = true;
+	}
+
+	if( log->file < 0 || !log->rings )
+	{
+		fprintf( stderr, "ERROR: Unable to open access log '%s'.\n", path );
+		perror( "Problem" );
+		free( log->rings );
+		free( log );
+		return NULL;
+	}
+
+	for( int i = 0; i < workers; i++ )
+	{
+		if( !(log->rings[ i ].data = malloc( ACCESS_LOG_RING_SIZE )) )
+		{
+			log->rings_count = i;
+			access_log_destroy( &log );
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init( &log->lock, NULL );
+	pthread_cond_init( &log->stop_signal, NULL );
+
+	if( pthread_create( &log->thread, NULL, access_log_run, log ) != 0 )
+	{
+		fprintf( stderr, "ERROR: Unable to start the access log writer.\n" );
+		pthread_cond_destroy( &log->stop_signal );
+		pthread_mutex_destroy( &log->lock );
+		log->thread = 0;
+		access_log_destroy( &log );
+	}
+
+	return log;
+}
+
+/* Stops the writer after it has drained every ring. */
+void access_log_destroy( access_log_t** log )
+{
+	if( log && *log )
+	{
+		access_log_t* l = *log;
+		uint64_t dropped = 0;
+
+		if( l->thread )
+		{
+			pthread_mutex_lock( &l->lock );
+			l->stop = true;
+			pthread_cond_signal( &l->stop_signal );
+			pthread_mutex_unlock( &l->lock );
+			pthread_join( l->thread, NULL );
+			pthread_cond_destroy( &l->stop_signal );
+			pthread_mutex_destroy( &l->lock );
+		}
+
+		for( int i = 0; i < l->rings_count; i++ )
+		{
+			dropped += atomic_load( &l->rings[ i ].dropped );
+			free( l->rings[ i ].data );
+		}
+
+		if( dropped > 0 )
+		{
+			fprintf( stderr, "WARNING: %lu access log entries were dropped.\n", (unsigned long) dropped );
+		}
+
+		if( l->close_file )
+		{
+			close( l->file );
+		}
+
+		free( l->rings );
+		free( l );
+		*log = NULL;
+	}
+}
+
+/* Called by a worker on its own ring only; never blocks. */
+void access_log_write( access_log_t* log, int worker, const access_log_entry_t* entry )
+{
+	access_log_line_t line;
+
+	if( !log || worker < 0 || worker >= log->rings_count )
+	{
+		return;
+	}
+
+	access_log_ring_t* ring = &log->rings[ worker ];
+	access_log_format( log, &line, entry );
+
+	size_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+	size_t tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+
+	if( ACCESS_LOG_RING_SIZE - (head - tail) < line.length )
+	{
+		atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+		return;
+	}
+
+	size_t start = head % ACCESS_LOG_RING_SIZE;
+	size_t first = ACCESS_LOG_RING_SIZE - start < line.length ? ACCESS_LOG_RING_SIZE - start : line.length;
+
+	memcpy( ring->data + start, line.text, first );
+	memcpy( ring->data, line.text + first, line.length - first );
+	atomic_store_explicit( &ring->head, head + line.length, memory_order_release );
+}
+
+void* access_log_run( void* data )
+{
+	access_log_t* log = (access_log_t*) data;
+	struct timespec deadline;
+
+	pthread_mutex_lock( &log->lock );
+
+	while( !log->stop )
+	{
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_nsec += ACCESS_LOG_FLUSH_MS * 1000000L;
+		deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while( !log->stop && pthread_cond_timedwait( &log->stop_signal, &log->lock, &deadline ) != ETIMEDOUT )
+		{
+		}
+
+		pthread_mutex_unlock( &log->lock );
+		access_log_flush( log );
+		pthread_mutex_lock( &log->lock );
+	}
+
+	pthread_mutex_unlock( &log->lock );
+	return NULL;
+}
+
+void access_log_flush( access_log_t* log )
+{
+	for( int i = 0; i < log->rings_count; i++ )
+	{
+		access_log_ring_t* ring = &log->rings[ i ];
+		size_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+		size_t head = atomic_load_explicit( &ring->head, memory_order_acquire );
+
+		while( tail < head )
+		{
+			size_t start  = tail % ACCESS_LOG_RING_SIZE;
+			size_t length = head - tail < ACCESS_LOG_RING_SIZE - start ? head - tail : ACCESS_LOG_RING_SIZE - start;
+			ssize_t result = write( log->file, ring->data + start, length );
+
+			if( result < 0 && errno == EINTR )
+			{
+				continue;
+			}
+			else if( result <= 0 )
+			{
+				/* Nowhere to write; drop what is buffered rather than fill up. */
+				tail = head;
+				break;
+			}
+
+			tail += result;
+		}
+
+		atomic_store_explicit( &ring->tail, tail, memory_order_release );
+	}
+}
+
+void access_log_format( access_log_t* log, access_log_line_t* line, const access_log_entry_t* entry )
+{
+	char date[ 64 ];
+	struct tm tm;
+
+	line->length = 0;
+	localtime_r( &entry->time, &tm );
+
+	if( log->format == ACCESS_LOG_JSON )
+	{
+		strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tm );
+
+		line_printf( line, "{\"time\":\"%s\",\"peer\":\"%s\",\"method\":\"", date, entry->peer );
+		line_escape( line, entry->method, true );
+		line_printf( line, "\",\"path\":\"" );
+		line_escape( line, entry->target, true );
+		line_printf( line, "\",\"protocol\":\"HTTP/%d.%d\",\"status\":%d,\"bytes\":%ld,\"ttfb_us\":%ld,\"duration_us\":%ld,\"referer\":\"",
+		             entry->version_major, entry->version_minor, entry->status, entry->bytes, entry->ttfb_us, entry->duration_us );
+		line_escape( line, entry->referer, true );
+		line_printf( line, "\",\"user_agent\":\"" );
+		line_escape( line, entry->user_agent, true );
+		line_printf( line, "\"}" );
+	}
+	else
+	{
+		strftime( date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm );
+
+		line_printf( line, "%s - - [%s] \"", entry->peer, date );
+
+		if( entry->method.length > 0 )
+		{
+			line_escape( line, entry->method, false );
+			line_printf( line, " " );
+			line_escape( line, entry->target, false );
+			line_printf( line, " HTTP/%d.%d\"", entry->version_major, entry->version_minor );
+		}
+		else
+		{
+			line_printf( line, "-\"" );
+		}
+
+		line_printf( line, " %d %ld", entry->status, entry->bytes );
+
+		if( log->format == ACCESS_LOG_COMBINED )
+		{
+			line_printf( line, " \"" );
+			line_escape( line, entry->referer, false );
+			line_printf( line, "\" \"" );
+			line_escape( line, entry->user_agent, false );
+			line_printf( line, "\"" );
+		}
+
+		/* Not part of the standard formats, so they go last. */
+		line_printf( line, " %ld %ld", entry->ttfb_us, entry->duration_us );
+	}
+
+	/* A cut off line still ends with a newline. */
+	if( line->length >= sizeof(line->text) )
+	{
+		line->length = sizeof(line->text) - 1;
+	}
+	line->text[ line->length++ ] = '\n';
+}
+
+void line_printf( access_log_line_t* line, const char* format, ... )
+{
+	if( line->length < sizeof(line->text) )
+	{
+		va_list args;
+		va_start( args, format );
+		int result = vsnprintf( line->text + line->length, sizeof(line->text) - line->length, format, args );
+		va_end( args );
+
+		if( result > 0 )
+		{
+			line->length += result;
+		}
+	}
+}
+
+/* Quotes, backslashes and control bytes are escaped so peers cannot forge lines. */
+void line_escape( access_log_line_t* line, http_slice_t text, bool json )
+{
+	for( size_t i = 0; i < text.length && line->length + 6 < sizeof(line->text); i++ )
+	{
+		unsigned char c = text.data[ i ];
+
+		if( c == '"' || c == '\\' )
+		{
+			line->text[ line->length++ ] = '\\';
+			line->text[ line->length++ ] = c;
+		}
+		else if( c < 0x20 || c == 0x7f )
+		{
+			line->length += snprintf( line->text + line->length, 7, json ? "\\u%04x" : "\\x%02x", c );
+		}
+		else
+		{
+			line->text[ line->length++ ] = c;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "http.h"
+
+/*
+ * An access log written through one ring buffer per worker. A
+ * worker only formats its line into its own ring; a background
+ * thread drains the rings to the file. When a ring is full the
+ * line is dropped, so logging never blocks the serving path.
+ */
+typedef enum access_log_format {
+	ACCESS_LOG_COMMON,    /* NCSA common log format */
+	ACCESS_LOG_COMBINED,  /* common plus referer and user agent */
+	ACCESS_LOG_JSON,      /* one JSON object per line */
+} access_log_format_t;
+
+typedef struct access_log_entry {
+	const char* peer;
+	http_slice_t method;   /* empty when the request could not be parsed */
+	http_slice_t target;
+	int version_major;
+	int version_minor;
+	http_slice_t referer;
+	http_slice_t user_agent;
+	int status;
+	int64_t bytes;         /* body bytes sent */
+	time_t time;           /* when the request arrived */
+	int64_t ttfb_us;       /* until the first byte of the response went out */
+	int64_t duration_us;   /* until the last byte went out */
+} access_log_entry_t;
+
+struct access_log;
+typedef struct access_log access_log_t;
+
+access_log_t* access_log_create  ( const char* path, access_log_format_t format, int workers );
+void          access_log_destroy ( access_log_t** log );
+void          access_log_write   ( access_log_t* log, int worker, const access_log_entry_t* entry );
+
+#endif /* __ACCESS_LOG_H__ */
@@ -0,0 +1,789 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "archive.h"
+
+#define ARCHIVE_MAX_DEPTH     32
+#define ARCHIVE_MAX_NAME      1024
+#define ARCHIVE_BATCH_FILES   64                  /* members opened per chunk */
+#define ARCHIVE_BATCH_BYTES   (8 * 1024 * 1024)   /* bytes queued per chunk */
+#define ARCHIVE_CRC_CHUNK     (64 * 1024)
+#define ARCHIVE_CRC_BUDGET    (1024 * 1024)       /* bytes checksummed per chunk */
+#define ARCHIVE_BLOCK         512                 /* tar record size */
+#define ARCHIVE_TAR_MAX_SIZE  077777777777ULL     /* above this the size goes in a pax record */
+#define ZIP_LIMIT_32          0xFFFFFFFFULL       /* above this a zip64 field is used */
+#define ZIP_LIMIT_16          0xFFFF
+
+typedef enum archive_phase {
+	ARCHIVE_WALKING,  /* emitting members */
+	ARCHIVE_CENTRAL,  /* emitting the zip central directory */
+	ARCHIVE_END,      /* emitting the trailer */
+	ARCHIVE_DONE,
+} archive_phase_t;
+
+typedef struct archive_directory {
+	DIR* handle;
+	size_t name_length; /* of the member name up to this directory */
+} archive_directory_t;
+
+/* What the zip central directory needs to know about a member. */
+typedef struct archive_zip_entry {
+	uint64_t offset;  /* of the local header */
+	uint64_t size;
+	uint32_t crc;
+	uint16_t time;
+	uint16_t date;
+	uint32_t mode;
+	size_t name;      /* offset into the names buffer */
+	uint16_t name_length;
+} archive_zip_entry_t;
+
+struct archive {
+	arena_t* arena;
+	archive_format_t format;
+	archive_phase_t phase;
+	archive_directory_t stack[ ARCHIVE_MAX_DEPTH ];
+	size_t depth;
+	char name[ ARCHIVE_MAX_NAME ]; /* of the current member */
+	int file;                      /* member whose data is being queued, or -1 */
+	int64_t file_offset;
+	int64_t file_remaining;
+	size_t padding;                /* zeros after the member data */
+	int batch[ ARCHIVE_BATCH_FILES ]; /* finished members to close once sent */
+	size_t batch_count;
+	uint64_t offset;               /* archive bytes produced so far */
+	/* zip only */
+	archive_zip_entry_t* entries;
+	size_t entries_count;
+	size_t entries_size;
+	char* names;
+	size_t names_length;
+	size_t names_size;
+	size_t central;                /* next entry for the central directory */
+	uint64_t central_offset;
+	unsigned char* crc_buffer;
+	int crc_file;                  /* member being checksummed, or -1 */
+	struct stat crc_stats;
+	uint64_t crc_size;             /* checksummed so far */
+	uint32_t crc;
+};
+
+static int     archive_next          ( archive_t* archive, struct stat* stats, int* file );
+static void    archive_close_batch   ( archive_t* archive );
+static bool    archive_begin         ( archive_t* archive, response_t* response, struct stat* stats, int file, int64_t* budget );
+static int     archive_zip_checksum  ( archive_t* archive, int64_t* budget );
+static size_t  archive_zip_local     ( archive_t* archive, response_t* response, const struct stat* stats, uint32_t crc );
+static size_t  archive_zip_central   ( archive_t* archive, response_t* response, const archive_zip_entry_t* entry );
+static size_t  archive_zip_end       ( archive_t* archive, response_t* response );
+static size_t  archive_tar_header    ( archive_t* archive, response_t* response, const struct stat* stats );
+static size_t  archive_tar_block     ( response_t* response, const char* name, const struct stat* stats, char type, uint64_t size );
+static bool    archive_tar_octal     ( char* field, size_t width, uint64_t value );
+static void    archive_dos_time      ( time_t time, uint16_t* dos_time, uint16_t* dos_date );
+static uint8_t* put16                ( uint8_t* p, uint16_t value );
+static uint8_t* put32                ( uint8_t* p, uint32_t value );
+static uint8_t* put64                ( uint8_t* p, uint64_t value );
+
+
+archive_t* archive_create( archive_format_t format, const char* path, const char* root_name, arena_t* arena )
+{
+	archive_t* archive = arena_alloc( arena, sizeof(archive_t) );
+
+	if( archive )
+	{
+		memset( archive, 0, sizeof(archive_t) );
+		archive->arena  = arena;
+		archive->format = format;
+		archive->phase  = ARCHIVE_WALKING;
+		archive->file   = -1;
+		archive->crc_file = -1;
+
+		DIR* root = opendir( path );
+		size_t length = snprintf( archive->name, sizeof(archive->name), "%s", root_name );
+
+		if( !root || length >= sizeof(archive->name) )
+		{
+			if( root ) closedir( root );
+			return NULL;
+		}
+
+		archive->stack[ 0 ].handle      = root;
+		archive->stack[ 0 ].name_length = length;
+		archive->depth = 1;
+	}
+
+	return archive;
+}
+
+void archive_destroy( archive_t** archive )
+{
+	if( archive && *archive )
+	{
+		archive_t* a = *archive;
+
+		while( a->depth > 0 )
+		{
+			closedir( a->stack[ --a->depth ].handle );
+		}
+
+		archive_close_batch( a );
+
+		if( a->file >= 0 )
+		{
+			close( a->file );
+		}
+
+		if( a->crc_file >= 0 )
+		{
+			close( a->crc_file );
+		}
+
+		*archive = NULL;
+	}
+}
+
+const char* archive_content_type( archive_format_t format )
+{
+	return format == ARCHIVE_ZIP ? "application/zip" : "application/x-tar";
+}
+
+const char* archive_extension( archive_format_t format )
+{
+	return format == ARCHIVE_ZIP ? ".zip" : ".tar";
+}
+
+/*
+ * A response producer. Each call queues headers as text and member
+ * data as file ranges until about a batch's worth is queued; large
+ * members are split across calls. Zip members are checksummed a
+ * bounded amount per call, so a large one doesn't stall the worker.
+ */
+response_produced_t archive_produce( response_t* response, void* user_data )
+{
+	archive_t* archive = (archive_t*) user_data;
+	int64_t budget = ARCHIVE_BATCH_BYTES;
+	int64_t checksum_budget = ARCHIVE_CRC_BUDGET;
+
+	/* Everything queued by the last call has been sent. */
+	archive_close_batch( archive );
+
+	while( budget > 0 && archive->batch_count < ARCHIVE_BATCH_FILES )
+	{
+		if( archive->file >= 0 )
+		{
+			int64_t length = archive->file_remaining < budget ? archive->file_remaining : budget;
+
+			response_add_file( response, archive->file, archive->file_offset, length );
+			archive->file_offset    += length;
+			archive->file_remaining -= length;
+			archive->offset         += length;
+			budget                  -= length;
+
+			if( archive->file_remaining == 0 )
+			{
+				static const char zeros[ ARCHIVE_BLOCK ] = { 0 };
+
+				response_write( response, zeros, archive->padding );
+				archive->offset += archive->padding;
+				archive->batch[ archive->batch_count++ ] = archive->file;
+				archive->file = -1;
+			}
+			continue;
+		}
+
+		if( archive->crc_file >= 0 )
+		{
+			int file = archive->crc_file;
+			int checksummed = archive_zip_checksum( archive, &checksum_budget );
+
+			if( checksummed < 0 )
+			{
+				return RESPONSE_PRODUCED_ERROR;
+			}
+			else if( checksummed == 0 )
+			{
+				/* Send what is queued; the rest is checksummed next call. */
+				break;
+			}
+
+			/* Send only what was checksummed, even if the file has since grown. */
+			archive->crc_file = -1;
+			archive->crc_stats.st_size = archive->crc_size;
+
+			if( !archive_begin( archive, response, &archive->crc_stats, file, &budget ) )
+			{
+				return RESPONSE_PRODUCED_ERROR;
+			}
+			continue;
+		}
+
+		switch( archive->phase )
+		{
+			case ARCHIVE_WALKING:
+			{
+				struct stat stats;
+				int file = -1;
+
+				int next = archive_next( archive, &stats, &file );
+
+				if( next < 0 )
+				{
+					/* Leaving it out would send a complete looking archive that is missing files. */
+					return RESPONSE_PRODUCED_ERROR;
+				}
+				else if( next == 0 )
+				{
+					archive->phase = archive->format == ARCHIVE_ZIP ? ARCHIVE_CENTRAL : ARCHIVE_END;
+					archive->central_offset = archive->offset;
+					break;
+				}
+
+				if( archive->format == ARCHIVE_ZIP && file >= 0 )
+				{
+					/* Zip needs the CRC before the data. */
+					archive->crc_file  = file;
+					archive->crc_stats = stats;
+					archive->crc_size  = 0;
+					archive->crc       = crc32( 0L, Z_NULL, 0 );
+				}
+				else if( !archive_begin( archive, response, &stats, file, &budget ) )
+				{
+					return RESPONSE_PRODUCED_ERROR;
+				}
+				break;
+			}
+			case ARCHIVE_CENTRAL:
+				if( archive->central < archive->entries_count )
+				{
+					size_t length = archive_zip_central( archive, response, &archive->entries[ archive->central++ ] );
+					archive->offset += length;
+					budget          -= length;
+				}
+				else
+				{
+					archive->phase = ARCHIVE_END;
+				}
+				break;
+			case ARCHIVE_END:
+				if( archive->format == ARCHIVE_ZIP )
+				{
+					archive->offset += archive_zip_end( archive, response );
+				}
+				else
+				{
+					/* Two empty records end a tar archive. */
+					static const char zeros[ 2 * ARCHIVE_BLOCK ] = { 0 };
+					response_write( response, zeros, sizeof(zeros) );
+				}
+				archive->phase = ARCHIVE_DONE;
+				return RESPONSE_PRODUCED_DONE;
+			case ARCHIVE_DONE:
+			default:
+				return RESPONSE_PRODUCED_DONE;
+		}
+	}
+
+	return RESPONSE_PRODUCED_MORE;
+}
+
+/*
+ * Queues the header of the member just walked to and makes its
+ * data the next thing queued. False when out of memory.
+ */
+bool archive_begin( archive_t* archive, response_t* response, struct stat* stats, int file, int64_t* budget )
+{
+	size_t length = archive->format == ARCHIVE_ZIP ? archive_zip_local( archive, response, stats, archive->crc )
+	                                               : archive_tar_header( archive, response, stats );
+
+	if( length == 0 )
+	{
+		/* Out of memory for the central directory. */
+		if( file >= 0 )
+		{
+			close( file );
+		}
+		return false;
+	}
+
+	archive->offset += length;
+	*budget         -= length;
+
+	if( file >= 0 )
+	{
+		archive->file           = file;
+		archive->file_offset    = 0;
+		archive->file_remaining = stats->st_size;
+		archive->padding        = archive->format == ARCHIVE_TAR ? (ARCHIVE_BLOCK - stats->st_size % ARCHIVE_BLOCK) % ARCHIVE_BLOCK : 0;
+
+		if( archive->file_remaining == 0 )
+		{
+			archive->batch[ archive->batch_count++ ] = file;
+			archive->file = -1;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Reads more of the member being checksummed, within the budget;
+ * the data is then sent from the page cache. 1 once the whole
+ * member is checksummed, 0 when the budget ran out, -1 when out
+ * of memory.
+ */
+int archive_zip_checksum( archive_t* archive, int64_t* budget )
+{
+	if( !archive->crc_buffer && !(archive->crc_buffer = arena_alloc( archive->arena, ARCHIVE_CRC_CHUNK )) )
+	{
+		close( archive->crc_file );
+		archive->crc_file = -1;
+		return -1;
+	}
+
+	while( archive->crc_size < (uint64_t) archive->crc_stats.st_size )
+	{
+		if( *budget <= 0 )
+		{
+			return 0;
+		}
+
+		ssize_t result = pread( archive->crc_file, archive->crc_buffer, ARCHIVE_CRC_CHUNK, archive->crc_size );
+
+		if( result <= 0 )
+		{
+			/* The file shrank; the member ends here. */
+			break;
+		}
+
+		archive->crc       = crc32( archive->crc, archive->crc_buffer, result );
+		archive->crc_size += result;
+		*budget           -= result;
+	}
+
+	return 1;
+}
+
+/*
+ * The next regular file or directory in the tree, depth first.
+ * Regular files are returned open. Symbolic links and special
+ * files are skipped, so links cannot make the walk loop. 1 for
+ * an entry, 0 once the walk is done, and -1 for an entry whose
+ * name is too long or that is nested too deep to be archived.
+ */
+int archive_next( archive_t* archive, struct stat* stats, int* file )
+{
+	while( archive->depth > 0 )
+	{
+		archive_directory_t* directory = &archive->stack[ archive->depth - 1 ];
+		struct dirent* entry = readdir( directory->handle );
+
+		if( !entry )
+		{
+			closedir( directory->handle );
+			archive->depth -= 1;
+			continue;
+		}
+
+		if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 )
+		{
+			continue;
+		}
+
+		size_t length = snprintf( archive->name + directory->name_length, sizeof(archive->name) - directory->name_length, "/%s", entry->d_name );
+		int parent = dirfd( directory->handle );
+
+		if( directory->name_length + length >= sizeof(archive->name) )
+		{
+			fprintf( stderr, "ERROR: A name under \"%.*s\" is too long to archive.\n", (int) directory->name_length, archive->name );
+			return -1;
+		}
+
+		if( fstatat( parent, entry->d_name, stats, AT_SYMLINK_NOFOLLOW ) < 0 )
+		{
+			continue;
+		}
+
+		if( S_ISREG(stats->st_mode) )
+		{
+			*file = openat( parent, entry->d_name, O_RDONLY | O_CLOEXEC );
+
+			if( *file >= 0 )
+			{
+				return 1;
+			}
+		}
+		else if( S_ISDIR(stats->st_mode) && archive->depth >= ARCHIVE_MAX_DEPTH )
+		{
+			fprintf( stderr, "ERROR: \"%s\" is nested too deep to archive.\n", archive->name );
+			return -1;
+		}
+		else if( S_ISDIR(stats->st_mode) )
+		{
+			int child = openat( parent, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+			DIR* handle = child >= 0 ? fdopendir( child ) : NULL;
+
+			if( handle )
+			{
+				archive->stack[ archive->depth ].handle      = handle;
+				archive->stack[ archive->depth ].name_length = directory->name_length + length;
+				archive->depth += 1;
+				*file = -1;
+				return 1;
+			}
+
+			if( child >= 0 )
+			{
+				close( child );
+			}
+		}
+	}
+
+	return 0;
+}
+
+void archive_close_batch( archive_t* archive )
+{
+	for( size_t i = 0; i < archive->batch_count; i++ )
+	{
+		close( archive->batch[ i ] );
+	}
+
+	archive->batch_count = 0;
+}
+
+/* The crc is of the member data, already read by archive_zip_checksum(). */
+size_t archive_zip_local( archive_t* archive, response_t* response, const struct stat* stats, uint32_t crc )
+{
+	bool directory = S_ISDIR(stats->st_mode);
+	char name[ ARCHIVE_MAX_NAME + 1 ];
+	size_t name_length = snprintf( name, sizeof(name), directory ? "%s/" : "%s", archive->name );
+	uint64_t size = directory ? 0 : (uint64_t) stats->st_size;
+
+	if( directory )
+	{
+		crc = crc32( 0L, Z_NULL, 0 );
+	}
+
+	if( archive->entries_count == archive->entries_size )
+	{
+		size_t entries_size = archive->entries_size ? 2 * archive->entries_size : 64;
+		archive_zip_entry_t* entries = arena_grow( archive->arena, archive->entries,
+		                                            archive->entries_size * sizeof(archive_zip_entry_t),
+		                                            entries_size * sizeof(archive_zip_entry_t) );
+
+		if( !entries )
+		{
+			return 0;
+		}
+
+		archive->entries      = entries;
+		archive->entries_size = entries_size;
+	}
+
+	if( archive->names_length + name_length > archive->names_size )
+	{
+		size_t names_size = 2 * (archive->names_size + name_length);
+		char* names = arena_grow( archive->arena, archive->names, archive->names_length, names_size );
+
+		if( !names )
+		{
+			return 0;
+		}
+
+		archive->names      = names;
+		archive->names_size = names_size;
+	}
+
+	archive_zip_entry_t* entry = &archive->entries[ archive->entries_count++ ];
+	entry->offset      = archive->offset;
+	entry->size        = size;
+	entry->crc         = crc;
+	entry->mode        = stats->st_mode;
+	entry->name        = archive->names_length;
+	entry->name_length = name_length;
+	archive_dos_time( stats->st_mtime, &entry->time, &entry->date );
+
+	memcpy( archive->names + archive->names_length, name, name_length );
+	archive->names_length += name_length;
+
+	bool zip64 = size >= ZIP_LIMIT_32;
+	uint8_t header[ 30 + 20 ];
+	uint8_t* p = header;
+
+	p = put32( p, 0x04034b50 );
+	p = put16( p, zip64 ? 45 : 20 );  /* version needed */
+	p = put16( p, 0x0800 );           /* names are UTF-8 */
+	p = put16( p, 0 );                /* stored */
+	p = put16( p, entry->time );
+	p = put16( p, entry->date );
+	p = put32( p, crc );
+	p = put32( p, zip64 ? ZIP_LIMIT_32 : size );
+	p = put32( p, zip64 ? ZIP_LIMIT_32 : size );
+	p = put16( p, name_length );
+	p = put16( p, zip64 ? 20 : 0 );
+
+	if( zip64 )
+	{
+		p = put16( p, 0x0001 );
+		p = put16( p, 16 );
+		p = put64( p, size );
+		p = put64( p, size );
+	}
+
+	response_write( response, header, 30 );
+	response_write( response, name, name_length );
+	response_write( response, header + 30, p - header - 30 );
+
+	return (p - header) + name_length;
+}
+
+size_t archive_zip_central( archive_t* archive, response_t* response, const archive_zip_entry_t* entry )
+{
+	bool size64   = entry->size >= ZIP_LIMIT_32;
+	bool offset64 = entry->offset >= ZIP_LIMIT_32;
+	uint8_t header[ 46 + 28 ];
+	uint8_t* p = header;
+
+	p = put32( p, 0x02014b50 );
+	p = put16( p, (3 << 8) | 45 );    /* made by Unix, zip 4.5 */
+	p = put16( p, size64 || offset64 ? 45 : 20 );
+	p = put16( p, 0x0800 );
+	p = put16( p, 0 );
+	p = put16( p, entry->time );
+	p = put16( p, entry->date );
+	p = put32( p, entry->crc );
+	p = put32( p, size64 ? ZIP_LIMIT_32 : entry->size );
+	p = put32( p, size64 ? ZIP_LIMIT_32 : entry->size );
+	p = put16( p, entry->name_length );
+	p = put16( p, (size64 ? 16 : 0) + (offset64 ? 8 : 0) + (size64 || offset64 ? 4 : 0) );
+	p = put16( p, 0 );                /* comment */
+	p = put16( p, 0 );                /* disk */
+	p = put16( p, 0 );                /* internal attributes */
+	p = put32( p, (entry->mode << 16) | (S_ISDIR(entry->mode) ? 0x10 : 0) );
+	p = put32( p, offset64 ? ZIP_LIMIT_32 : entry->offset );
+
+	if( size64 || offset64 )
+	{
+		p = put16( p, 0x0001 );
+		p = put16( p, (size64 ? 16 : 0) + (offset64 ? 8 : 0) );
+
+		if( size64 )
+		{
+			p = put64( p, entry->size );
+			p = put64( p, entry->size );
+		}
+
+		if( offset64 )
+		{
+			p = put64( p, entry->offset );
+		}
+	}
+
+	response_write( response, header, 46 );
+	response_write( response, archive->names + entry->name, entry->name_length );
+	response_write( response, header + 46, p - header - 46 );
+
+	return (p - header) + entry->name_length;
+}
+
+size_t archive_zip_end( archive_t* archive, response_t* response )
+{
+	uint64_t central_size = archive->offset - archive->central_offset;
+	uint64_t count = archive->entries_count;
+	bool zip64 = count >= ZIP_LIMIT_16 || central_size >= ZIP_LIMIT_32 || archive->central_offset >= ZIP_LIMIT_32;
+	uint8_t trailer[ 56 + 20 + 22 ];
+	uint8_t* p = trailer;
+
+	if( zip64 )
+	{
+		uint64_t end_offset = archive->offset;
+
+		p = put32( p, 0x06064b50 );
+		p = put64( p, 44 );
+		p = put16( p, (3 << 8) | 45 );
+		p = put16( p, 45 );
+		p = put32( p, 0 );
+		p = put32( p, 0 );
+		p = put64( p, count );
+		p = put64( p, count );
+		p = put64( p, central_size );
+		p = put64( p, archive->central_offset );
+
+		/* locator */
+		p = put32( p, 0x07064b50 );
+		p = put32( p, 0 );
+		p = put64( p, end_offset );
+		p = put32( p, 1 );
+	}
+
+	p = put32( p, 0x06054b50 );
+	p = put16( p, 0 );
+	p = put16( p, 0 );
+	p = put16( p, count < ZIP_LIMIT_16 ? count : ZIP_LIMIT_16 );
+	p = put16( p, count < ZIP_LIMIT_16 ? count : ZIP_LIMIT_16 );
+	p = put32( p, central_size < ZIP_LIMIT_32 ? central_size : ZIP_LIMIT_32 );
+	p = put32( p, archive->central_offset < ZIP_LIMIT_32 ? archive->central_offset : ZIP_LIMIT_32 );
+	p = put16( p, 0 );
+
+	response_write( response, trailer, p - trailer );
+	return p - trailer;
+}
+
+/*
+ * A ustar header, preceded by a pax extended header when the
+ * name or the size does not fit in the ustar fields.
+ */
+size_t archive_tar_header( archive_t* archive, response_t* response, const struct stat* stats )
+{
+	bool directory = S_ISDIR(stats->st_mode);
+	uint64_t size = directory ? 0 : stats->st_size;
+	char name[ ARCHIVE_MAX_NAME + 1 ];
+	size_t name_length = snprintf( name, sizeof(name), directory ? "%s/" : "%s", archive->name );
+	size_t length = 0;
+	char records[ 2 * ARCHIVE_MAX_NAME ];
+	size_t records_length = 0;
+
+	if( name_length >= 100 )
+	{
+		/* A record's length counts its own digits. */
+		size_t record = name_length + 8;
+		size_t digits = snprintf( NULL, 0, "%zu", record );
+		record = name_length + 7 + digits;
+		if( snprintf( NULL, 0, "%zu", record ) != digits ) record += 1;
+		records_length += snprintf( records + records_length, sizeof(records) - records_length, "%zu path=%s\n", record, name );
+	}
+
+	if( size > ARCHIVE_TAR_MAX_SIZE )
+	{
+		char value[ 24 ];
+		size_t value_length = snprintf( value, sizeof(value), "%lu", (unsigned long) size );
+		size_t record = value_length + 7;
+		size_t digits = snprintf( NULL, 0, "%zu", record );
+		record += digits;
+		if( snprintf( NULL, 0, "%zu", record ) != digits ) record += 1;
+		records_length += snprintf( records + records_length, sizeof(records) - records_length, "%zu size=%s\n", record, value );
+	}
+
+	if( records_length > 0 )
+	{
+		static const char zeros[ ARCHIVE_BLOCK ] = { 0 };
+		size_t padding = (ARCHIVE_BLOCK - records_length % ARCHIVE_BLOCK) % ARCHIVE_BLOCK;
+
+		length += archive_tar_block( response, "././@PaxHeader", stats, 'x', records_length );
+		response_write( response, records, records_length );
+		response_write( response, zeros, padding );
+		length += records_length + padding;
+	}
+
+	length += archive_tar_block( response, name, stats, directory ? '5' : '0', size > ARCHIVE_TAR_MAX_SIZE ? 0 : size );
+	return length;
+}
+
+size_t archive_tar_block( response_t* response, const char* name, const struct stat* stats, char type, uint64_t size )
+{
+	char block[ ARCHIVE_BLOCK ] = { 0 };
+	unsigned int checksum = 0;
+
+	strncpy( block, name, 100 );  /* not terminated at exactly 100 */
+	snprintf( block + 100, 8, "%07o", (unsigned int) (stats->st_mode & 07777) );
+	snprintf( block + 108, 8, "%07o", 0 );
+	snprintf( block + 116, 8, "%07o", 0 );
+	archive_tar_octal( block + 124, 12, size );
+
+	if( !archive_tar_octal( block + 136, 12, stats->st_mtime > 0 ? (uint64_t) stats->st_mtime : 0 ) )
+	{
+		archive_tar_octal( block + 136, 12, 0 );
+	}
+	memset( block + 148, ' ', 8 );
+	block[ 156 ] = type;
+	memcpy( block + 257, "ustar", 6 );
+	memcpy( block + 263, "00", 2 );
+
+	for( size_t i = 0; i < sizeof(block); i++ )
+	{
+		checksum += (unsigned char) block[ i ];
+	}
+
+	snprintf( block + 148, 8, "%06o", checksum );
+	block[ 155 ] = ' ';
+
+	response_write( response, block, sizeof(block) );
+	return sizeof(block);
+}
+
+/* Fills a numeric field with zero-padded octal and a NUL; false if the value does not fit. */
+bool archive_tar_octal( char* field, size_t width, uint64_t value )
+{
+	for( size_t i = width - 1; i-- > 0; )
+	{
+		field[ i ] = '0' + (value & 7);
+		value >>= 3;
+	}
+
+	field[ width - 1 ] = '\0';
+	return value == 0;
+}
+
+void archive_dos_time( time_t time, uint16_t* dos_time, uint16_t* dos_date )
+{
+	struct tm tm;
+
+	localtime_r( &time, &tm );
+
+	if( tm.tm_year < 80 )
+	{
+		*dos_time = 0;
+		*dos_date = (1 << 5) | 1; /* 1980-01-01 */
+		return;
+	}
+
+	*dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	*dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+uint8_t* put16( uint8_t* p, uint16_t value )
+{
+	p[ 0 ] = value;
+	p[ 1 ] = value >> 8;
+	return p + 2;
+}
+
+uint8_t* put32( uint8_t* p, uint32_t value )
+{
+	p = put16( p, value );
+	return put16( p, value >> 16 );
+}
+
+uint8_t* put64( uint8_t* p, uint64_t value )
+{
+	p = put32( p, value );
+	return put32( p, value >> 32 );
+}
@@ -0,0 +1,49 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdbool.h>
+#include "arena.h"
+#include "response.h"
+
+/*
+ * Streams a directory tree as a zip or tar archive while walking
+ * it. Members are stored uncompressed so their data goes out with
+ * sendfile(); only a small header per member is built in memory
+ * (plus, for zip, a central directory record per member). The
+ * walker's memory comes from the arena, which must outlive it.
+ */
+typedef enum archive_format {
+	ARCHIVE_ZIP,
+	ARCHIVE_TAR,
+} archive_format_t;
+
+struct archive;
+typedef struct archive archive_t;
+
+archive_t*          archive_create       ( archive_format_t format, const char* path, const char* root_name, arena_t* arena );
+void                archive_destroy      ( archive_t** archive );
+response_produced_t archive_produce      ( response_t* response, void* user_data );
+const char*         archive_content_type ( archive_format_t format );
+const char*         archive_extension    ( archive_format_t format );
+
+#endif /* __ARCHIVE_H__ */
@@ -0,0 +1,169 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_CHUNK      (16 * 1024)
+#define ARENA_ALIGNMENT  16
+
+struct arena_chunk {
+	arena_chunk_t* next;
+	size_t size; /* usable bytes after the header */
+	char _Alignas(ARENA_ALIGNMENT) data[];
+};
+
+static size_t arena_align     ( size_t size );
+static bool   arena_add_chunk ( arena_t* arena, size_t size );
+
+
+void arena_create( arena_t* arena, size_t retain )
+{
+	arena->chunks = NULL;
+	arena->top    = NULL;
+	arena->end    = NULL;
+	arena->last   = NULL;
+	arena->retain = retain;
+}
+
+void arena_destroy( arena_t* arena )
+{
+	if( arena )
+	{
+		while( arena->chunks )
+		{
+			arena_chunk_t* chunk = arena->chunks;
+			arena->chunks = chunk->next;
+			free( chunk );
+		}
+
+		arena->top  = NULL;
+		arena->end  = NULL;
+		arena->last = NULL;
+	}
+}
+
+void* arena_alloc( arena_t* arena, size_t size )
+{
+	size = arena_align( size );
+
+	if( (size_t) (arena->end - arena->top) < size && !arena_add_chunk( arena, size ) )
+	{
+		return NULL;
+	}
+
+	arena->last = arena->top;
+	arena->top += size;
+	return arena->last;
+}
+
+/*
+ * Resizes a block of size bytes. The most recent allocation is
+ * extended where it is when the chunk has room; anything else
+ * is copied to a new block and the old one is left until reset.
+ */
+void* arena_grow( arena_t* arena, void* block, size_t size, size_t new_size )
+{
+	if( !block )
+	{
+		return arena_alloc( arena, new_size );
+	}
+
+	if( block == arena->last && (size_t) (arena->end - arena->last) >= arena_align( new_size ) )
+	{
+		arena->top = arena->last + arena_align( new_size );
+		return block;
+	}
+
+	void* grown = arena_alloc( arena, new_size );
+
+	if( grown )
+	{
+		memcpy( grown, block, size < new_size ? size : new_size );
+	}
+
+	return grown;
+}
+
+/*
+ * Forgets every allocation. The largest chunk within the retain
+ * limit is kept so requests like the last one fit without a
+ * malloc(); the rest are freed so that one large request does
+ * not pin its memory afterwards.
+ */
+void arena_reset( arena_t* arena )
+{
+	arena_chunk_t* kept = NULL;
+
+	while( arena->chunks )
+	{
+		arena_chunk_t* chunk = arena->chunks;
+		arena->chunks = chunk->next;
+
+		if( chunk->size <= arena->retain && (!kept || chunk->size > kept->size) )
+		{
+			free( kept );
+			kept = chunk;
+		}
+		else
+		{
+			free( chunk );
+		}
+	}
+
+	if( kept )
+	{
+		kept->next = NULL;
+	}
+
+	arena->chunks = kept;
+	arena->top    = kept ? kept->data : NULL;
+	arena->end    = kept ? kept->data + kept->size : NULL;
+	arena->last   = NULL;
+}
+
+size_t arena_align( size_t size )
+{
+	return (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+/* Leaves room for growth so a growing block is not copied every time. */
+bool arena_add_chunk( arena_t* arena, size_t size )
+{
+	size = size < ARENA_CHUNK / 2 ? ARENA_CHUNK : 2 * size;
+
+	arena_chunk_t* chunk = malloc( sizeof(arena_chunk_t) + size );
+
+	if( !chunk )
+	{
+		fprintf( stderr, "ERROR: Unable to allocate %zu bytes.\n", size );
+		return false;
+	}
+
+	chunk->size   = size;
+	chunk->next   = arena->chunks;
+	arena->chunks = chunk;
+	arena->top    = chunk->data;
+	arena->end    = chunk->data + size;
+	return true;
+}
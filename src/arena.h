@@ -0,0 +1,49 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bump allocator for memory that lives as long as one request.
+ * Allocations are carved from chunks and never freed one by
+ * one; arena_reset() drops them all at once and keeps a chunk
+ * of up to retain bytes so the next request needs no malloc().
+ */
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct arena {
+	arena_chunk_t* chunks; /* newest first */
+	char* top;             /* next free byte of the newest chunk */
+	char* end;
+	char* last;            /* most recent allocation, can grow in place */
+	size_t retain;
+} arena_t;
+
+void  arena_create  ( arena_t* arena, size_t retain );
+void  arena_destroy ( arena_t* arena );
+void* arena_alloc   ( arena_t* arena, size_t size );
+void* arena_grow    ( arena_t* arena, void* block, size_t size, size_t new_size );
+void  arena_reset   ( arena_t* arena );
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,409 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <xtd/string.h>
+#include "content_cache.h"
+
+#define CONTENT_CACHE_BUCKETS  256
+
+struct content_cache {
+	pthread_mutex_t lock;
+	content_entry_t** buckets;
+	size_t buckets_count;
+	size_t entries_count;
+	size_t size;          /* bytes of headers, bodies and paths held */
+	size_t budget;
+	content_entry_t* hand; /* CLOCK hand; entries form a ring */
+	watcher_t* watcher;
+};
+
+static content_entry_t* content_cache_find      ( content_cache_t* cache, const char* path, size_t hash );
+static void             content_cache_on_change ( const char* directory, const char* name, uint32_t mask, void* user_data );
+static void             content_cache_unlink    ( content_cache_t* cache, content_entry_t* entry );
+static void             content_cache_grow      ( content_cache_t* cache );
+static bool             content_entry_matches   ( const content_entry_t* entry, const struct stat* file_stat );
+static size_t           content_entry_size      ( const content_entry_t* entry );
+static void             content_entry_free      ( content_entry_t* entry );
+
+
+content_cache_t* content_cache_create( size_t budget, watcher_t* watcher )
+{
+	content_cache_t* cache = malloc( sizeof(content_cache_t) );
+
+	if( cache )
+	{
+		cache->buckets_count = CONTENT_CACHE_BUCKETS;
+		cache->buckets       = calloc( cache->buckets_count, sizeof(content_entry_t*) );
+		cache->entries_count = 0;
+		cache->size          = 0;
+		cache->budget        = budget;
+		cache->hand          = NULL;
+		cache->watcher       = watcher;
+
+		if( !cache->buckets )
+		{
+			free( cache );
+			return NULL;
+		}
+
+		pthread_mutex_init( &cache->lock, NULL );
+
+		if( watcher )
+		{
+			watcher_subscribe( watcher, content_cache_on_change, cache );
+		}
+	}
+
+	return cache;
+}
+
+void content_cache_destroy( content_cache_t** cache )
+{
+	if( cache && *cache )
+	{
+		content_cache_invalidate( *cache, NULL );
+		pthread_mutex_destroy( &(*cache)->lock );
+		free( (*cache)->buckets );
+		free( *cache );
+		*cache = NULL;
+	}
+}
+
+/* Returns a referenced entry if the file as described by file_stat is cached. */
+content_entry_t* content_cache_acquire( content_cache_t* cache, const char* path, const struct stat* file_stat )
+{
+	if( !cache )
+	{
+		return NULL;
+	}
+
+	pthread_mutex_lock( &cache->lock );
+	content_entry_t* entry = content_cache_find( cache, path, string_hash( path ) );
+
+	if( entry && content_entry_matches( entry, file_stat ) )
+	{
+		entry->references += 1;
+		entry->used = true;
+	}
+	else
+	{
+		entry = NULL;
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	return entry;
+}
+
+/*
+ * Reads the whole file into a new entry that follows a copy of
+ * the headers. Returns the entry referenced, or NULL if it does
+ * not fit or the file changed from what file_stat describes.
+ */
+content_entry_t* content_cache_insert( content_cache_t* cache, const char* path, const struct stat* file_stat, int fd, const char* headers, size_t headers_length )
+{
+	size_t body_length = file_stat->st_size;
+	content_entry_t* entry = malloc( sizeof(content_entry_t) );
+	char* data = malloc( headers_length + body_length + 1 );
+	char* entry_path = strdup( path );
+	size_t read_length = 0;
+	struct stat after;
+
+	if( !entry || !data || !entry_path )
+	{
+		goto failed;
+	}
+
+	memcpy( data, headers, headers_length );
+
+	while( read_length < body_length )
+	{
+		ssize_t result = pread( fd, data + headers_length + read_length, body_length - read_length, read_length );
+
+		if( result <= 0 )
+		{
+			goto failed;
+		}
+
+		read_length += result;
+	}
+
+	if( fstat( fd, &after ) < 0 || after.st_size != file_stat->st_size ||
+	    after.st_mtim.tv_sec != file_stat->st_mtim.tv_sec || after.st_mtim.tv_nsec != file_stat->st_mtim.tv_nsec )
+	{
+		/* Written to while it was read. */
+		goto failed;
+	}
+
+	entry->headers        = data;
+	entry->headers_length = headers_length;
+	entry->body           = data + headers_length;
+	entry->body_length    = body_length;
+	entry->path           = entry_path;
+	entry->hash           = string_hash( path );
+	entry->device         = file_stat->st_dev;
+	entry->inode          = file_stat->st_ino;
+	entry->modified       = file_stat->st_mtim;
+	entry->references     = 1;
+	entry->cached         = false;
+	entry->used           = true;
+
+	size_t size = content_entry_size( entry );
+
+	if( size > cache->budget )
+	{
+		return entry; /* served once, never cached */
+	}
+
+	pthread_mutex_lock( &cache->lock );
+
+	/* Replace a stale entry, or one another worker just inserted. */
+	content_entry_t* existing = content_cache_find( cache, path, entry->hash );
+
+	if( existing )
+	{
+		content_cache_unlink( cache, existing );
+
+		if( existing->references == 0 )
+		{
+			content_entry_free( existing );
+		}
+	}
+
+	/* Sweep the hand, sparing entries used since its last pass. */
+	while( cache->size + size > cache->budget && cache->hand )
+	{
+		content_entry_t* victim = cache->hand;
+
+		if( victim->used )
+		{
+			victim->used = false;
+			cache->hand  = victim->clock_next;
+			continue;
+		}
+
+		content_cache_unlink( cache, victim );
+
+		if( victim->references == 0 )
+		{
+			content_entry_free( victim );
+		}
+	}
+
+	content_entry_t** link = &cache->buckets[ entry->hash & (cache->buckets_count - 1) ];
+	entry->next = *link;
+	*link = entry;
+
+	/* New entries go just behind the hand, so they get a full turn. */
+	if( cache->hand )
+	{
+		entry->clock_next = cache->hand;
+		entry->clock_prev = cache->hand->clock_prev;
+		entry->clock_prev->clock_next = entry;
+		cache->hand->clock_prev = entry;
+	}
+	else
+	{
+		entry->clock_next = entry;
+		entry->clock_prev = entry;
+		cache->hand = entry;
+	}
+
+	entry->cached = true;
+	cache->size          += size;
+	cache->entries_count += 1;
+
+	if( cache->entries_count > cache->buckets_count )
+	{
+		content_cache_grow( cache );
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	return entry;
+
+failed:
+	free( entry );
+	free( data );
+	free( entry_path );
+	return NULL;
+}
+
+void content_cache_release( content_cache_t* cache, content_entry_t* entry )
+{
+	bool free_entry = false;
+
+	pthread_mutex_lock( &cache->lock );
+	entry->references -= 1;
+	free_entry = entry->references == 0 && !entry->cached;
+	pthread_mutex_unlock( &cache->lock );
+
+	if( free_entry )
+	{
+		content_entry_free( entry );
+	}
+}
+
+/* Drops the entry for a path, or every entry when path is NULL. */
+void content_cache_invalidate( content_cache_t* cache, const char* path )
+{
+	pthread_mutex_lock( &cache->lock );
+
+	while( cache->hand )
+	{
+		content_entry_t* entry = path ? content_cache_find( cache, path, string_hash( path ) ) : cache->hand;
+
+		if( !entry )
+		{
+			break;
+		}
+
+		content_cache_unlink( cache, entry );
+
+		if( entry->references == 0 )
+		{
+			content_entry_free( entry );
+		}
+
+		if( path )
+		{
+			break;
+		}
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+}
+
+content_entry_t* content_cache_find( content_cache_t* cache, const char* path, size_t hash )
+{
+	for( content_entry_t* entry = cache->buckets[ hash & (cache->buckets_count - 1) ]; entry; entry = entry->next )
+	{
+		if( entry->hash == hash && strcmp( entry->path, path ) == 0 )
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+void content_cache_on_change( const char* directory, const char* name, uint32_t mask, void* user_data )
+{
+	content_cache_t* cache = (content_cache_t*) user_data;
+	char path[ 4096 ];
+
+	/* Events about a directory itself are rare; just start over. */
+	if( !directory || !name || snprintf( path, sizeof(path), "%s/%s", directory, name ) >= (int) sizeof(path) )
+	{
+		content_cache_invalidate( cache, NULL );
+		return;
+	}
+
+	content_cache_invalidate( cache, path );
+}
+
+/* Removes an entry from the table and the ring; the caller frees it if unreferenced. */
+void content_cache_unlink( content_cache_t* cache, content_entry_t* entry )
+{
+	content_entry_t** link = &cache->buckets[ entry->hash & (cache->buckets_count - 1) ];
+
+	while( *link != entry )
+	{
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+
+	if( entry->clock_next == entry )
+	{
+		cache->hand = NULL;
+	}
+	else
+	{
+		entry->clock_prev->clock_next = entry->clock_next;
+		entry->clock_next->clock_prev = entry->clock_prev;
+
+		if( cache->hand == entry )
+		{
+			cache->hand = entry->clock_next;
+		}
+	}
+
+	entry->cached = false;
+	cache->size          -= content_entry_size( entry );
+	cache->entries_count -= 1;
+}
+
+void content_cache_grow( content_cache_t* cache )
+{
+	size_t buckets_count = cache->buckets_count * 2;
+	content_entry_t** buckets = calloc( buckets_count, sizeof(content_entry_t*) );
+
+	if( !buckets )
+	{
+		return; /* chains just get longer */
+	}
+
+	for( size_t i = 0; i < cache->buckets_count; i++ )
+	{
+		content_entry_t* entry = cache->buckets[ i ];
+
+		while( entry )
+		{
+			content_entry_t* next = entry->next;
+			content_entry_t** link = &buckets[ entry->hash & (buckets_count - 1) ];
+			entry->next = *link;
+			*link = entry;
+			entry = next;
+		}
+	}
+
+	free( cache->buckets );
+	cache->buckets       = buckets;
+	cache->buckets_count = buckets_count;
+}
+
+bool content_entry_matches( const content_entry_t* entry, const struct stat* file_stat )
+{
+	return entry->device == file_stat->st_dev &&
+	       entry->inode == file_stat->st_ino &&
+	       entry->body_length == (size_t) file_stat->st_size &&
+	       entry->modified.tv_sec == file_stat->st_mtim.tv_sec &&
+	       entry->modified.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+/* What an entry counts against the budget. */
+size_t content_entry_size( const content_entry_t* entry )
+{
+	return sizeof(content_entry_t) + entry->headers_length + entry->body_length + strlen( entry->path ) + 1;
+}
+
+void content_entry_free( content_entry_t* entry )
+{
+	free( (char*) entry->headers );
+	free( entry->path );
+	free( entry );
+}
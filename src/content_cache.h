@@ -0,0 +1,68 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __CONTENT_CACHE_H__
+#define __CONTENT_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "watcher.h"
+
+/*
+ * The bytes of small files together with the headers of their
+ * full 200 response, so a hit is answered from memory with one
+ * gathering write. Entries are keyed by path and only match while
+ * the file's identity, size and modification time are unchanged;
+ * inotify drops them sooner. The cache stays within a byte budget
+ * using CLOCK eviction, so a hit only sets a bit and never
+ * reorders a list.
+ */
+struct content_cache;
+typedef struct content_cache content_cache_t;
+
+typedef struct content_entry {
+	const char* headers;   /* status line and headers, without the final blank line */
+	size_t headers_length;
+	const char* body;
+	size_t body_length;
+	/* private */
+	char* path;
+	size_t hash;
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	int references;
+	bool cached;
+	bool used;                     /* CLOCK reference bit */
+	struct content_entry* next;    /* hash chain */
+	struct content_entry* clock_next;
+	struct content_entry* clock_prev;
+} content_entry_t;
+
+content_cache_t* content_cache_create     ( size_t budget, watcher_t* watcher );
+void             content_cache_destroy    ( content_cache_t** cache );
+content_entry_t* content_cache_acquire    ( content_cache_t* cache, const char* path, const struct stat* file_stat );
+content_entry_t* content_cache_insert     ( content_cache_t* cache, const char* path, const struct stat* file_stat, int fd, const char* headers, size_t headers_length );
+void             content_cache_release    ( content_cache_t* cache, content_entry_t* entry );
+void             content_cache_invalidate ( content_cache_t* cache, const char* path );
+
+#endif /* __CONTENT_CACHE_H__ */
@@ -0,0 +1,401 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+#ifdef HAVE_BROTLI
+# include <brotli/encode.h>
+#endif
+#include "encoder.h"
+
+/*
+ * Levels that favour speed, since every byte is compressed
+ * per request. Precompressed siblings can use the best ones.
+ */
+#define ENCODER_GZIP_LEVEL      6
+#define ENCODER_ZSTD_LEVEL      3
+#define ENCODER_BROTLI_QUALITY  5
+#define ENCODER_MIN_ROOM        (16 * 1024)
+
+struct encoder {
+	encoding_t encoding;
+	char* output;
+	size_t output_size;
+	size_t output_length;
+	bool finished;
+	union {
+		z_stream gzip;
+	#ifdef HAVE_ZSTD
+		ZSTD_CCtx* zstd;
+	#endif
+	#ifdef HAVE_BROTLI
+		BrotliEncoderState* brotli;
+	#endif
+	} state;
+};
+
+static bool encoder_reserve ( encoder_t* encoder );
+static bool encoder_gzip    ( encoder_t* encoder, const void* data, size_t length, bool finish );
+#ifdef HAVE_ZSTD
+static bool encoder_zstd    ( encoder_t* encoder, const void* data, size_t length, bool finish );
+#endif
+#ifdef HAVE_BROTLI
+static bool encoder_brotli  ( encoder_t* encoder, const void* data, size_t length, bool finish );
+#endif
+
+
+/* Encodings this build can produce on the fly. */
+unsigned int encoding_available( void )
+{
+	unsigned int mask = ENCODING_MASK(ENCODING_GZIP);
+#ifdef HAVE_ZSTD
+	mask |= ENCODING_MASK(ENCODING_ZSTD);
+#endif
+#ifdef HAVE_BROTLI
+	mask |= ENCODING_MASK(ENCODING_BROTLI);
+#endif
+	return mask;
+}
+
+/*
+ * Picks the allowed coding with the highest q-value, preferring
+ * zstd, then brotli, then gzip on ties. Identity is the fallback.
+ */
+encoding_t encoding_negotiate( const http_slice_t* accept_encoding, unsigned int allowed )
+{
+	static const encoding_t preference[] = { ENCODING_ZSTD, ENCODING_BROTLI, ENCODING_GZIP };
+	encoding_t best = ENCODING_IDENTITY;
+	int best_quality = 0;
+
+	if( !accept_encoding )
+	{
+		return ENCODING_IDENTITY;
+	}
+
+	for( size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++ )
+	{
+		encoding_t encoding = preference[ i ];
+
+		if( allowed & ENCODING_MASK(encoding) )
+		{
+			int quality = http_accept_quality( *accept_encoding, encoding_name( encoding ) );
+
+			if( quality > best_quality )
+			{
+				best = encoding;
+				best_quality = quality;
+			}
+		}
+	}
+
+	return best;
+}
+
+const char* encoding_name( encoding_t encoding )
+{
+	switch( encoding )
+	{
+		case ENCODING_GZIP:   return "gzip";
+		case ENCODING_ZSTD:   return "zstd";
+		case ENCODING_BROTLI: return "br";
+		default:              return "identity";
+	}
+}
+
+/* Suffix of a precompressed sibling, e.g. "foo.txt.gz". */
+const char* encoding_extension( encoding_t encoding )
+{
+	switch( encoding )
+	{
+		case ENCODING_GZIP:   return ".gz";
+		case ENCODING_ZSTD:   return ".zst";
+		case ENCODING_BROTLI: return ".br";
+		default:              return "";
+	}
+}
+
+encoder_t* encoder_create( encoding_t encoding )
+{
+	encoder_t* encoder = NULL;
+
+	if( !(encoding_available( ) & ENCODING_MASK(encoding)) )
+	{
+		return NULL;
+	}
+
+	encoder = calloc( 1, sizeof(encoder_t) );
+
+	if( encoder )
+	{
+		bool created = false;
+		encoder->encoding = encoding;
+
+		switch( encoding )
+		{
+			case ENCODING_GZIP:
+				/* 16 + window bits asks for a gzip wrapper */
+				created = deflateInit2( &encoder->state.gzip, ENCODER_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY ) == Z_OK;
+				break;
+		#ifdef HAVE_ZSTD
+			case ENCODING_ZSTD:
+				encoder->state.zstd = ZSTD_createCCtx( );
+				created = encoder->state.zstd && !ZSTD_isError( ZSTD_CCtx_setParameter( encoder->state.zstd, ZSTD_c_compressionLevel, ENCODER_ZSTD_LEVEL ) );
+				break;
+		#endif
+		#ifdef HAVE_BROTLI
+			case ENCODING_BROTLI:
+				encoder->state.brotli = BrotliEncoderCreateInstance( NULL, NULL, NULL );
+				created = encoder->state.brotli && BrotliEncoderSetParameter( encoder->state.brotli, BROTLI_PARAM_QUALITY, ENCODER_BROTLI_QUALITY );
+				break;
+		#endif
+			default:
+				break;
+		}
+
+		if( !created )
+		{
+			encoder_destroy( &encoder );
+		}
+	}
+
+	return encoder;
+}
+
+void encoder_destroy( encoder_t** encoder )
+{
+	if( encoder && *encoder )
+	{
+		encoder_t* e = *encoder;
+
+		switch( e->encoding )
+		{
+			case ENCODING_GZIP:
+				deflateEnd( &e->state.gzip );
+				break;
+		#ifdef HAVE_ZSTD
+			case ENCODING_ZSTD:
+				ZSTD_freeCCtx( e->state.zstd );
+				break;
+		#endif
+		#ifdef HAVE_BROTLI
+			case ENCODING_BROTLI:
+				if( e->state.brotli ) BrotliEncoderDestroyInstance( e->state.brotli );
+				break;
+		#endif
+			default:
+				break;
+		}
+
+		free( e->output );
+		free( e );
+		*encoder = NULL;
+	}
+}
+
+encoding_t encoder_encoding( const encoder_t* encoder )
+{
+	return encoder->encoding;
+}
+
+/* Starts a new stream, keeping the allocated state for reuse. */
+bool encoder_reset( encoder_t* encoder )
+{
+	encoder->finished      = false;
+	encoder->output_length = 0;
+
+	switch( encoder->encoding )
+	{
+		case ENCODING_GZIP:
+			return deflateReset( &encoder->state.gzip ) == Z_OK;
+	#ifdef HAVE_ZSTD
+		case ENCODING_ZSTD:
+			return !ZSTD_isError( ZSTD_CCtx_reset( encoder->state.zstd, ZSTD_reset_session_only ) );
+	#endif
+	#ifdef HAVE_BROTLI
+		case ENCODING_BROTLI:
+			/* Brotli has no reset. */
+			BrotliEncoderDestroyInstance( encoder->state.brotli );
+			encoder->state.brotli = BrotliEncoderCreateInstance( NULL, NULL, NULL );
+			return encoder->state.brotli && BrotliEncoderSetParameter( encoder->state.brotli, BROTLI_PARAM_QUALITY, ENCODER_BROTLI_QUALITY );
+	#endif
+		default:
+			return false;
+	}
+}
+
+/*
+ * Compresses the next piece of the body and appends it to the
+ * output. Everything given is flushed, so each piece can be
+ * decoded as soon as it arrives.
+ */
+bool encoder_encode( encoder_t* encoder, const void* data, size_t length, bool finish )
+{
+	bool result = false;
+
+	if( !encoder->finished )
+	{
+		switch( encoder->encoding )
+		{
+			case ENCODING_GZIP:
+				result = encoder_gzip( encoder, data, length, finish );
+				break;
+		#ifdef HAVE_ZSTD
+			case ENCODING_ZSTD:
+				result = encoder_zstd( encoder, data, length, finish );
+				break;
+		#endif
+		#ifdef HAVE_BROTLI
+			case ENCODING_BROTLI:
+				result = encoder_brotli( encoder, data, length, finish );
+				break;
+		#endif
+			default:
+				break;
+		}
+
+		encoder->finished = finish;
+	}
+
+	return result;
+}
+
+/* Valid until the next call to encoder_encode() or encoder_discard(). */
+const char* encoder_output( const encoder_t* encoder, size_t* length )
+{
+	*length = encoder->output_length;
+	return encoder->output;
+}
+
+/* Drops output that has been sent. */
+void encoder_discard( encoder_t* encoder )
+{
+	encoder->output_length = 0;
+}
+
+bool encoder_reserve( encoder_t* encoder )
+{
+	if( encoder->output_size - encoder->output_length < ENCODER_MIN_ROOM )
+	{
+		size_t size = encoder->output_size ? 2 * encoder->output_size : 4 * ENCODER_MIN_ROOM;
+		char* output = realloc( encoder->output, size );
+
+		if( !output )
+		{
+			return false;
+		}
+
+		encoder->output      = output;
+		encoder->output_size = size;
+	}
+
+	return true;
+}
+
+bool encoder_gzip( encoder_t* encoder, const void* data, size_t length, bool finish )
+{
+	z_stream* z = &encoder->state.gzip;
+	int status;
+
+	z->next_in  = (Bytef*) data;
+	z->avail_in = length;
+
+	do {
+		if( !encoder_reserve( encoder ) )
+		{
+			return false;
+		}
+
+		z->next_out  = (Bytef*) encoder->output + encoder->output_length;
+		z->avail_out = encoder->output_size - encoder->output_length;
+
+		status = deflate( z, finish ? Z_FINISH : Z_SYNC_FLUSH );
+
+		if( status == Z_STREAM_ERROR )
+		{
+			return false;
+		}
+
+		encoder->output_length = encoder->output_size - z->avail_out;
+	} while( z->avail_out == 0 || (finish && status != Z_STREAM_END) );
+
+	return true;
+}
+
+#ifdef HAVE_ZSTD
+bool encoder_zstd( encoder_t* encoder, const void* data, size_t length, bool finish )
+{
+	ZSTD_inBuffer in = { .src = data, .size = length, .pos = 0 };
+	size_t remaining;
+
+	do {
+		if( !encoder_reserve( encoder ) )
+		{
+			return false;
+		}
+
+		ZSTD_outBuffer out = { .dst = encoder->output, .size = encoder->output_size, .pos = encoder->output_length };
+		remaining = ZSTD_compressStream2( encoder->state.zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_flush );
+
+		if( ZSTD_isError( remaining ) )
+		{
+			return false;
+		}
+
+		encoder->output_length = out.pos;
+	} while( remaining > 0 || in.pos < in.size );
+
+	return true;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+bool encoder_brotli( encoder_t* encoder, const void* data, size_t length, bool finish )
+{
+	const uint8_t* next_in = data;
+	size_t available_in = length;
+
+	do {
+		if( !encoder_reserve( encoder ) )
+		{
+			return false;
+		}
+
+		uint8_t* next_out = (uint8_t*) encoder->output + encoder->output_length;
+		size_t available_out = encoder->output_size - encoder->output_length;
+
+		if( !BrotliEncoderCompressStream( encoder->state.brotli, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH,
+		                                  &available_in, &next_in, &available_out, &next_out, NULL ) )
+		{
+			return false;
+		}
+
+		encoder->output_length = encoder->output_size - available_out;
+	} while( available_in > 0 || BrotliEncoderHasMoreOutput( encoder->state.brotli ) ||
+	         (finish && !BrotliEncoderIsFinished( encoder->state.brotli )) );
+
+	return true;
+}
+#endif
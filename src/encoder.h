@@ -0,0 +1,59 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ENCODER_H__
+#define __ENCODER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "http.h"
+
+/*
+ * Content codings for Accept-Encoding negotiation. Encoders
+ * compress a body a chunk at a time so that it can be sent
+ * while the rest is still being read.
+ */
+typedef enum encoding {
+	ENCODING_IDENTITY = 0,
+	ENCODING_GZIP,
+	ENCODING_ZSTD,
+	ENCODING_BROTLI,
+	ENCODING_COUNT
+} encoding_t;
+
+#define ENCODING_MASK(encoding)  (1u << (encoding))
+
+struct encoder;
+typedef struct encoder encoder_t;
+
+unsigned int encoding_available  ( void );
+encoding_t   encoding_negotiate  ( const http_slice_t* accept_encoding, unsigned int allowed );
+const char*  encoding_name       ( encoding_t encoding );
+const char*  encoding_extension  ( encoding_t encoding );
+
+encoder_t*   encoder_create      ( encoding_t encoding );
+void         encoder_destroy     ( encoder_t** encoder );
+encoding_t   encoder_encoding    ( const encoder_t* encoder );
+bool         encoder_reset       ( encoder_t* encoder );
+bool         encoder_encode      ( encoder_t* encoder, const void* data, size_t length, bool finish );
+const char*  encoder_output      ( const encoder_t* encoder, size_t* length );
+void         encoder_discard     ( encoder_t* encoder );
+
+#endif /* __ENCODER_H__ */
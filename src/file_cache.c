@@ -0,0 +1,462 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <xtd/string.h>
+#include "file_cache.h"
+
+#define FILE_CACHE_REVALIDATE  1000 /* milliseconds between stat() checks of an entry */
+#define FILE_CACHE_GENERATIONS 256  /* invalidation counters, by path hash */
+
+struct file_cache {
+	pthread_mutex_t lock;
+	file_entry_t** buckets;
+	size_t buckets_count;
+	size_t entries_count;
+	size_t capacity;
+	uint64_t generations[ FILE_CACHE_GENERATIONS ]; /* bumped by invalidations of the paths hashed there */
+	file_entry_t* newest;
+	file_entry_t* oldest;
+	watcher_t* watcher;
+};
+
+static file_entry_t* file_cache_get       ( file_cache_t* cache, const char* path );
+static file_entry_t* file_cache_load      ( file_cache_t* cache, const char* path, bool remember_missing );
+static file_entry_t* file_cache_find      ( file_cache_t* cache, const char* path, size_t hash );
+static void          file_cache_on_change ( const char* directory, const char* name, uint32_t mask, void* user_data );
+static void          file_cache_unlink    ( file_cache_t* cache, file_entry_t* entry );
+static bool          file_entry_is_stale  ( const file_entry_t* entry );
+static void          file_entry_free      ( file_entry_t* entry );
+static int64_t       file_cache_now       ( void );
+
+
+file_cache_t* file_cache_create( size_t capacity, watcher_t* watcher )
+{
+	file_cache_t* cache = malloc( sizeof(file_cache_t) );
+
+	if( cache )
+	{
+		cache->buckets_count = 16;
+		while( cache->buckets_count < capacity )
+		{
+			cache->buckets_count *= 2;
+		}
+
+		cache->buckets       = calloc( cache->buckets_count, sizeof(file_entry_t*) );
+		cache->entries_count = 0;
+		cache->capacity      = capacity;
+		memset( cache->generations, 0, sizeof(cache->generations) );
+		cache->newest        = NULL;
+		cache->oldest        = NULL;
+		cache->watcher       = watcher;
+
+		if( !cache->buckets )
+		{
+			free( cache );
+			return NULL;
+		}
+
+		pthread_mutex_init( &cache->lock, NULL );
+
+		if( watcher )
+		{
+			watcher_subscribe( watcher, file_cache_on_change, cache );
+		}
+	}
+
+	return cache;
+}
+
+void file_cache_destroy( file_cache_t** cache )
+{
+	if( cache && *cache )
+	{
+		file_cache_invalidate( *cache, NULL );
+		pthread_mutex_destroy( &(*cache)->lock );
+		free( (*cache)->buckets );
+		free( *cache );
+		*cache = NULL;
+	}
+}
+
+/*
+ * Returns a referenced entry for the path, or NULL when it is not
+ * cached. Only an entry that is due to be checked costs a stat().
+ */
+file_entry_t* file_cache_lookup( file_cache_t* cache, const char* path )
+{
+	file_entry_t* entry = file_cache_get( cache, path );
+
+	if( entry && entry->fd < 0 )
+	{
+		file_cache_release( cache, entry );
+		entry = NULL;
+	}
+
+	return entry;
+}
+
+/*
+ * Returns a referenced entry for the regular file at path, opening
+ * it on a miss. A NULL cache just opens the file.
+ */
+file_entry_t* file_cache_open( file_cache_t* cache, const char* path )
+{
+	return file_cache_load( cache, path, false );
+}
+
+/*
+ * Like file_cache_open() for paths that usually don't exist: the
+ * miss is cached too, so asking again costs no open().
+ */
+file_entry_t* file_cache_probe( file_cache_t* cache, const char* path )
+{
+	return file_cache_load( cache, path, true );
+}
+
+/* The cached entry for the path, remembered misses included. */
+file_entry_t* file_cache_get( file_cache_t* cache, const char* path )
+{
+	if( !cache )
+	{
+		return NULL;
+	}
+
+	size_t hash  = string_hash( path );
+	int64_t now  = file_cache_now( );
+	bool due     = false;
+
+	pthread_mutex_lock( &cache->lock );
+	file_entry_t* entry = file_cache_find( cache, path, hash );
+
+	if( entry )
+	{
+		entry->references += 1;
+
+		/* Move to the front of the LRU list. */
+		if( cache->newest != entry )
+		{
+			if( entry->older ) entry->older->newer = entry->newer;
+			if( entry->newer ) entry->newer->older = entry->older;
+			if( cache->oldest == entry ) cache->oldest = entry->newer;
+			entry->older = cache->newest;
+			entry->newer = NULL;
+			cache->newest->newer = entry;
+			cache->newest = entry;
+		}
+
+		due = now - entry->checked >= FILE_CACHE_REVALIDATE;
+
+		if( due )
+		{
+			/* Only one worker needs to do the check. */
+			entry->checked = now;
+		}
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	if( entry && due && file_entry_is_stale( entry ) )
+	{
+		file_cache_invalidate( cache, path );
+		file_cache_release( cache, entry );
+		entry = NULL;
+	}
+
+	return entry;
+}
+
+file_entry_t* file_cache_load( file_cache_t* cache, const char* path, bool remember_missing )
+{
+	file_entry_t* entry = file_cache_get( cache, path );
+
+	if( entry && entry->fd < 0 )
+	{
+		file_cache_release( cache, entry );
+		return NULL;
+	}
+	else if( entry )
+	{
+		return entry;
+	}
+
+	uint64_t generation = 0;
+	size_t hash = string_hash( path );
+
+	if( cache )
+	{
+		pthread_mutex_lock( &cache->lock );
+		generation = cache->generations[ hash % FILE_CACHE_GENERATIONS ];
+		pthread_mutex_unlock( &cache->lock );
+	}
+
+	/* Non-blocking so that a FIFO swapped in for the file cannot stall the worker. */
+	int fd = open( path, O_RDONLY | O_CLOEXEC | O_NONBLOCK );
+	struct stat stats;
+
+	if( fd < 0 && (!remember_missing || errno != ENOENT || !cache) )
+	{
+		return NULL;
+	}
+
+	if( fd < 0 )
+	{
+		memset( &stats, 0, sizeof(stats) );
+	}
+
+	if( (fd >= 0 && (fstat( fd, &stats ) < 0 || !S_ISREG(stats.st_mode))) || !(entry = malloc( sizeof(file_entry_t) )) )
+	{
+		if( fd >= 0 ) close( fd );
+		return NULL;
+	}
+
+	entry->fd         = fd;
+	entry->stat       = stats;
+	entry->path       = NULL;
+	entry->hash       = hash;
+	entry->references = 1;
+	entry->cached     = false;
+	entry->checked    = file_cache_now( );
+
+	if( !cache || !(entry->path = strdup( path )) )
+	{
+		if( fd < 0 )
+		{
+			file_entry_free( entry );
+			return NULL;
+		}
+		return entry;
+	}
+
+	/* Watch the directory, so the entry is dropped as soon as the file changes. */
+	if( cache->watcher )
+	{
+		char* slash = strrchr( entry->path, '/' );
+
+		if( slash )
+		{
+			*slash = '\0';
+			watcher_add( cache->watcher, entry->path );
+			*slash = '/';
+		}
+	}
+
+	pthread_mutex_lock( &cache->lock );
+
+	/* Skip caching if the path changed since the open, or another worker got here first. */
+	if( generation == cache->generations[ hash % FILE_CACHE_GENERATIONS ] && !file_cache_find( cache, path, hash ) )
+	{
+		while( cache->entries_count >= cache->capacity && cache->oldest )
+		{
+			file_entry_t* victim = cache->oldest;
+			file_cache_unlink( cache, victim );
+
+			if( victim->references == 0 )
+			{
+				file_entry_free( victim );
+			}
+		}
+
+		file_entry_t** link = &cache->buckets[ entry->hash & (cache->buckets_count - 1) ];
+		entry->next = *link;
+		*link = entry;
+		entry->newer = NULL;
+		entry->older = cache->newest;
+		if( cache->newest ) cache->newest->newer = entry;
+		cache->newest = entry;
+		if( !cache->oldest ) cache->oldest = entry;
+
+		entry->cached = true;
+		cache->entries_count += 1;
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	if( fd < 0 )
+	{
+		/* Only the miss is kept. */
+		file_cache_release( cache, entry );
+		return NULL;
+	}
+
+	return entry;
+}
+
+void file_cache_release( file_cache_t* cache, file_entry_t* entry )
+{
+	bool free_entry = false;
+
+	if( cache )
+	{
+		pthread_mutex_lock( &cache->lock );
+	}
+
+	entry->references -= 1;
+	free_entry = entry->references == 0 && !entry->cached;
+
+	if( cache )
+	{
+		pthread_mutex_unlock( &cache->lock );
+	}
+
+	if( free_entry )
+	{
+		file_entry_free( entry );
+	}
+}
+
+/* Drops the entry for a path, or every entry when path is NULL. */
+void file_cache_invalidate( file_cache_t* cache, const char* path )
+{
+	pthread_mutex_lock( &cache->lock );
+
+	if( path )
+	{
+		size_t hash = string_hash( path );
+		file_entry_t* entry = file_cache_find( cache, path, hash );
+
+		cache->generations[ hash % FILE_CACHE_GENERATIONS ] += 1;
+
+		if( entry )
+		{
+			file_cache_unlink( cache, entry );
+
+			if( entry->references == 0 )
+			{
+				file_entry_free( entry );
+			}
+		}
+	}
+	else
+	{
+		for( size_t i = 0; i < FILE_CACHE_GENERATIONS; i++ )
+		{
+			cache->generations[ i ] += 1;
+		}
+
+		while( cache->oldest )
+		{
+			file_entry_t* entry = cache->oldest;
+			file_cache_unlink( cache, entry );
+
+			if( entry->references == 0 )
+			{
+				file_entry_free( entry );
+			}
+		}
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+}
+
+file_entry_t* file_cache_find( file_cache_t* cache, const char* path, size_t hash )
+{
+	for( file_entry_t* entry = cache->buckets[ hash & (cache->buckets_count - 1) ]; entry; entry = entry->next )
+	{
+		if( entry->hash == hash && strcmp( entry->path, path ) == 0 )
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+void file_cache_on_change( const char* directory, const char* name, uint32_t mask, void* user_data )
+{
+	file_cache_t* cache = (file_cache_t*) user_data;
+	char path[ 4096 ];
+
+	/* Events about a directory itself are rare; just start over. */
+	if( !directory || !name || snprintf( path, sizeof(path), "%s/%s", directory, name ) >= (int) sizeof(path) )
+	{
+		file_cache_invalidate( cache, NULL );
+		return;
+	}
+
+	file_cache_invalidate( cache, path );
+}
+
+/* Removes an entry from the table and the LRU list; the caller frees it if unreferenced. */
+void file_cache_unlink( file_cache_t* cache, file_entry_t* entry )
+{
+	file_entry_t** link = &cache->buckets[ entry->hash & (cache->buckets_count - 1) ];
+
+	while( *link != entry )
+	{
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+
+	if( entry->older ) entry->older->newer = entry->newer;
+	if( entry->newer ) entry->newer->older = entry->older;
+	if( cache->newest == entry ) cache->newest = entry->older;
+	if( cache->oldest == entry ) cache->oldest = entry->newer;
+
+	entry->cached = false;
+	cache->entries_count -= 1;
+}
+
+/* Whether the path now names another file, or the file has changed or appeared. */
+bool file_entry_is_stale( const file_entry_t* entry )
+{
+	struct stat stats;
+
+	if( stat( entry->path, &stats ) < 0 )
+	{
+		return entry->fd >= 0;
+	}
+	else if( entry->fd < 0 )
+	{
+		return true;
+	}
+
+	return stats.st_dev != entry->stat.st_dev ||
+	       stats.st_ino != entry->stat.st_ino ||
+	       stats.st_size != entry->stat.st_size ||
+	       stats.st_mtim.tv_sec != entry->stat.st_mtim.tv_sec ||
+	       stats.st_mtim.tv_nsec != entry->stat.st_mtim.tv_nsec;
+}
+
+void file_entry_free( file_entry_t* entry )
+{
+	if( entry->fd >= 0 )
+	{
+		close( entry->fd );
+	}
+	free( entry->path );
+	free( entry );
+}
+
+int64_t file_cache_now( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "watcher.h"
+
+/*
+ * Open descriptors of regular files, with their metadata, keyed
+ * by path and shared by the workers. A hit costs one hash lookup
+ * and no system calls. Entries are dropped when inotify reports a
+ * change to the file, and are checked against the file system
+ * with stat() at most once per interval in case an event was
+ * missed. The least recently used entries are closed once the
+ * cache is full. Every reader uses offsets (sendfile, pread), so
+ * one descriptor can be shared by any number of responses. Probes
+ * also remember files that don't exist, until one is created.
+ */
+struct file_cache;
+typedef struct file_cache file_cache_t;
+
+typedef struct file_entry {
+	int fd;                     /* -1 for a remembered miss, never returned */
+	struct stat stat;
+	/* private */
+	char* path;
+	size_t hash;
+	int references;
+	bool cached;
+	int64_t checked;            /* monotonic milliseconds of the last stat() */
+	struct file_entry* next;    /* hash chain */
+	struct file_entry* newer;   /* LRU list */
+	struct file_entry* older;
+} file_entry_t;
+
+file_cache_t* file_cache_create     ( size_t capacity, watcher_t* watcher );
+void          file_cache_destroy    ( file_cache_t** cache );
+file_entry_t* file_cache_lookup     ( file_cache_t* cache, const char* path );
+file_entry_t* file_cache_open       ( file_cache_t* cache, const char* path );
+file_entry_t* file_cache_probe      ( file_cache_t* cache, const char* path );
+void          file_cache_release    ( file_cache_t* cache, file_entry_t* entry );
+void          file_cache_invalidate ( file_cache_t* cache, const char* path );
+
+#endif /* __FILE_CACHE_H__ */
@@ -0,0 +1,668 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "http.h"
+
+static http_parse_result_t http_parse_request_line ( http_request_t* request, const char* line, const char* end );
+static http_parse_result_t http_parse_header_line  ( http_request_t* request, const char* line, const char* end );
+static bool                http_is_token           ( char c );
+static const char*         http_skip_spaces        ( const char* s, const char* end );
+static bool                http_parse_int64        ( const char** s, const char* end, int64_t* value );
+static size_t              http_coalesce_ranges    ( http_range_t* ranges, size_t count );
+
+
+void http_request_reset( http_request_t* request )
+{
+	request->method.data    = NULL;
+	request->method.length  = 0;
+	request->target.data    = NULL;
+	request->target.length  = 0;
+	request->version_major  = 0;
+	request->version_minor  = 0;
+	request->headers_count  = 0;
+	request->head_length    = 0;
+	request->parsed         = 0;
+	request->request_line   = false;
+}
+
+/*
+ * Parses as much of the request head as the buffer holds. Only
+ * complete lines are consumed, so calling it again after more
+ * bytes arrive picks up at the first line that was cut short.
+ */
+http_parse_result_t http_parse_request( http_request_t* request, const char* buffer, size_t length )
+{
+	while( request->parsed < length )
+	{
+		const char* line = buffer + request->parsed;
+		const char* newline = memchr( line, '\n', length - request->parsed );
+
+		if( !newline )
+		{
+			return HTTP_PARSE_INCOMPLETE;
+		}
+
+		const char* end = newline > line && newline[ -1 ] == '\r' ? newline - 1 : newline;
+		request->parsed = newline + 1 - buffer;
+
+		if( !request->request_line )
+		{
+			if( end == line )
+			{
+				continue; /* tolerate blank lines before the request line */
+			}
+
+			http_parse_result_t result = http_parse_request_line( request, line, end );
+
+			if( result != HTTP_PARSE_INCOMPLETE )
+			{
+				return result;
+			}
+
+			request->request_line = true;
+		}
+		else if( end == line )
+		{
+			request->head_length = request->parsed;
+			return HTTP_PARSE_COMPLETE;
+		}
+		else
+		{
+			http_parse_result_t result = http_parse_header_line( request, line, end );
+
+			if( result != HTTP_PARSE_INCOMPLETE )
+			{
+				return result;
+			}
+		}
+	}
+
+	return HTTP_PARSE_INCOMPLETE;
+}
+
+/* method SP request-target SP HTTP-version */
+http_parse_result_t http_parse_request_line( http_request_t* request, const char* line, const char* end )
+{
+	const char* s = line;
+
+	while( s < end && http_is_token( *s ) ) s++;
+
+	if( s == line || s >= end || *s != ' ' )
+	{
+		return HTTP_PARSE_INVALID;
+	}
+
+	request->method.data   = line;
+	request->method.length = s - line;
+
+	const char* target = ++s;
+
+	while( s < end && *s != ' ' && (unsigned char) *s > 0x20 && *s != 0x7f ) s++;
+
+	if( s == target || s >= end || *s != ' ' )
+	{
+		return HTTP_PARSE_INVALID;
+	}
+
+	request->target.data   = target;
+	request->target.length = s - target;
+
+	s++;
+
+	if( end - s != 8 || strncmp( s, "HTTP/", 5 ) != 0 ||
+	    !isdigit( (unsigned char) s[5] ) || s[6] != '.' || !isdigit( (unsigned char) s[7] ) )
+	{
+		return HTTP_PARSE_INVALID;
+	}
+
+	request->version_major = s[5] - '0';
+	request->version_minor = s[7] - '0';
+
+	return HTTP_PARSE_INCOMPLETE;
+}
+
+/* field-name ":" OWS field-value OWS */
+http_parse_result_t http_parse_header_line( http_request_t* request, const char* line, const char* end )
+{
+	const char* s = line;
+
+	while( s < end && http_is_token( *s ) ) s++;
+
+	if( s == line || s >= end || *s != ':' )
+	{
+		/* also rejects obsolete line folding */
+		return HTTP_PARSE_INVALID;
+	}
+
+	if( request->headers_count >= HTTP_MAX_HEADERS )
+	{
+		return HTTP_PARSE_TOO_LARGE;
+	}
+
+	http_header_t* header = &request->headers[ request->headers_count++ ];
+	header->name.data   = line;
+	header->name.length = s - line;
+
+	const char* value = http_skip_spaces( s + 1, end );
+	const char* value_end = end;
+
+	while( value_end > value && (value_end[ -1 ] == ' ' || value_end[ -1 ] == '\t') )
+	{
+		value_end--;
+	}
+
+	header->value.data   = value;
+	header->value.length = value_end - value;
+
+	return HTTP_PARSE_INCOMPLETE;
+}
+
+const http_slice_t* http_request_header( const http_request_t* request, const char* name )
+{
+	for( size_t i = 0; i < request->headers_count; i++ )
+	{
+		if( http_slice_equals( request->headers[ i ].name, name ) )
+		{
+			return &request->headers[ i ].value;
+		}
+	}
+
+	return NULL;
+}
+
+/* Case-insensitive, as header names and most tokens are. */
+bool http_slice_equals( http_slice_t slice, const char* text )
+{
+	size_t length = strlen( text );
+	return slice.length == length && strncasecmp( slice.data, text, length ) == 0;
+}
+
+/* Looks for a token in a comma separated list, e.g. "keep-alive, Upgrade". */
+bool http_slice_contains( http_slice_t slice, const char* token )
+{
+	const char* s   = slice.data;
+	const char* end = slice.data + slice.length;
+
+	while( s < end )
+	{
+		const char* item_end = memchr( s, ',', end - s );
+
+		if( !item_end )
+		{
+			item_end = end;
+		}
+
+		const char* item = http_skip_spaces( s, item_end );
+		const char* last = item_end;
+
+		while( last > item && (last[ -1 ] == ' ' || last[ -1 ] == '\t') )
+		{
+			last--;
+		}
+
+		http_slice_t candidate = { .data = item, .length = last - item };
+
+		if( http_slice_equals( candidate, token ) )
+		{
+			return true;
+		}
+
+		s = item_end + 1;
+	}
+
+	return false;
+}
+
+bool http_slice_copy( http_slice_t slice, char* buffer, size_t buffer_size )
+{
+	if( slice.length >= buffer_size )
+	{
+		return false;
+	}
+
+	memcpy( buffer, slice.data, slice.length );
+	buffer[ slice.length ] = '\0';
+	return true;
+}
+
+/*
+ * Parses a "bytes=" Range header value (RFC 7233). Syntax errors,
+ * other units and requests for too many ranges are ignored so the
+ * full representation is sent, as the RFC allows. Overlapping and
+ * adjacent ranges are merged, so no byte is sent twice.
+ */
+http_range_result_t http_parse_range( http_slice_t value, int64_t size, http_range_t* ranges, size_t max_ranges, size_t* count )
+{
+	const char* end = value.data + value.length;
+	const char* s = http_skip_spaces( value.data, end );
+	size_t specs = 0;
+
+	*count = 0;
+
+	if( end - s < 6 || strncasecmp( s, "bytes=", 6 ) != 0 )
+	{
+		return HTTP_RANGE_NONE;
+	}
+
+	s += 6;
+
+	for( ;; )
+	{
+		int64_t first = -1;
+		int64_t last  = -1;
+
+		s = http_skip_spaces( s, end );
+
+		if( s < end && *s == '-' )
+		{
+			/* suffix range: the final N bytes */
+			int64_t suffix;
+			s++;
+
+			if( !http_parse_int64( &s, end, &suffix ) )
+			{
+				return HTTP_RANGE_NONE;
+			}
+
+			if( suffix > 0 && size > 0 )
+			{
+				first = suffix < size ? size - suffix : 0;
+				last  = size - 1;
+			}
+		}
+		else
+		{
+			if( !http_parse_int64( &s, end, &first ) || s >= end || *s != '-' )
+			{
+				return HTTP_RANGE_NONE;
+			}
+			s++;
+
+			if( s < end && isdigit( (unsigned char) *s ) )
+			{
+				if( !http_parse_int64( &s, end, &last ) || last < first )
+				{
+					return HTTP_RANGE_NONE;
+				}
+			}
+			else
+			{
+				last = size - 1;
+			}
+
+			if( first >= size )
+			{
+				first = -1; /* not satisfiable, but the others may be */
+			}
+			else if( last >= size )
+			{
+				last = size - 1;
+			}
+		}
+
+		specs++;
+
+		if( first >= 0 )
+		{
+			if( *count >= max_ranges )
+			{
+				*count = 0;
+				return HTTP_RANGE_NONE;
+			}
+
+			ranges[ *count ].first = first;
+			ranges[ *count ].last  = last;
+			*count += 1;
+		}
+
+		s = http_skip_spaces( s, end );
+
+		if( s < end && *s == ',' )
+		{
+			s++;
+		}
+		else if( s >= end )
+		{
+			break;
+		}
+		else
+		{
+			*count = 0;
+			return HTTP_RANGE_NONE;
+		}
+	}
+
+	if( specs == 0 )
+	{
+		return HTTP_RANGE_NONE;
+	}
+
+	*count = http_coalesce_ranges( ranges, *count );
+
+	return *count > 0 ? HTTP_RANGE_SATISFIABLE : HTTP_RANGE_UNSATISFIABLE;
+}
+
+/*
+ * Sorts the ranges by their start and merges the ones that
+ * overlap or touch (RFC 7233, section 6.1). Returns the count
+ * left.
+ */
+size_t http_coalesce_ranges( http_range_t* ranges, size_t count )
+{
+	/* There are only a few, so an insertion sort will do. */
+	for( size_t i = 1; i < count; i++ )
+	{
+		http_range_t range = ranges[ i ];
+		size_t j = i;
+
+		while( j > 0 && ranges[ j - 1 ].first > range.first )
+		{
+			ranges[ j ] = ranges[ j - 1 ];
+			j--;
+		}
+
+		ranges[ j ] = range;
+	}
+
+	size_t merged = 0;
+
+	for( size_t i = 0; i < count; i++ )
+	{
+		if( merged > 0 && ranges[ i ].first <= ranges[ merged - 1 ].last + 1 )
+		{
+			if( ranges[ i ].last > ranges[ merged - 1 ].last )
+			{
+				ranges[ merged - 1 ].last = ranges[ i ].last;
+			}
+		}
+		else
+		{
+			ranges[ merged++ ] = ranges[ i ];
+		}
+	}
+
+	return merged;
+}
+
+/*
+ * Finds a parameter in the query of a request target. The
+ * value is left percent-encoded; parameters without an '='
+ * have an empty value.
+ */
+bool http_query_param( http_slice_t target, const char* name, http_slice_t* value )
+{
+	const char* end   = target.data + target.length;
+	const char* query = memchr( target.data, '?', target.length );
+	size_t name_length = strlen( name );
+
+	if( !query )
+	{
+		return false;
+	}
+
+	for( const char* s = query + 1; s < end; )
+	{
+		const char* param_end = memchr( s, '&', end - s );
+
+		if( !param_end )
+		{
+			param_end = end;
+		}
+
+		const char* equals = memchr( s, '=', param_end - s );
+		const char* key_end = equals ? equals : param_end;
+
+		if( (size_t) (key_end - s) == name_length && memcmp( s, name, name_length ) == 0 )
+		{
+			value->data   = equals ? equals + 1 : param_end;
+			value->length = param_end - value->data;
+			return true;
+		}
+
+		s = param_end + 1;
+	}
+
+	return false;
+}
+
+/* Like http_query_param() but the whole value must be a non-negative integer. */
+bool http_query_int64( http_slice_t target, const char* name, int64_t* value )
+{
+	http_slice_t param;
+
+	if( http_query_param( target, name, &param ) )
+	{
+		const char* s = param.data;
+		const char* end = param.data + param.length;
+
+		return http_parse_int64( &s, end, value ) && s == end;
+	}
+
+	return false;
+}
+
+/*
+ * The q-value of a token in an Accept-style list, in thousandths.
+ * A "*" entry covers tokens that are not listed; tokens that are
+ * neither listed nor covered get 0.
+ */
+int http_accept_quality( http_slice_t value, const char* token )
+{
+	const char* s   = value.data;
+	const char* end = value.data + value.length;
+	int wildcard = 0;
+
+	while( s < end )
+	{
+		const char* item_end = memchr( s, ',', end - s );
+
+		if( !item_end )
+		{
+			item_end = end;
+		}
+
+		const char* item = http_skip_spaces( s, item_end );
+		const char* name_end = item;
+		int quality = 1000;
+
+		while( name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t' )
+		{
+			name_end++;
+		}
+
+		/* Parameters; only q matters. */
+		for( const char* p = memchr( name_end, ';', item_end - name_end ); p; p = memchr( p, ';', item_end - p ) )
+		{
+			p = http_skip_spaces( p + 1, item_end );
+
+			if( item_end - p >= 2 && (p[ 0 ] == 'q' || p[ 0 ] == 'Q') && p[ 1 ] == '=' )
+			{
+				p += 2;
+				quality = 0;
+
+				if( p < item_end && *p == '1' )
+				{
+					quality = 1000;
+				}
+				else if( p + 1 < item_end && p[ 0 ] == '0' && p[ 1 ] == '.' )
+				{
+					int scale = 100;
+
+					for( p += 2; p < item_end && isdigit( (unsigned char) *p ) && scale > 0; p++, scale /= 10 )
+					{
+						quality += (*p - '0') * scale;
+					}
+				}
+			}
+		}
+
+		http_slice_t name = { .data = item, .length = name_end - item };
+
+		if( http_slice_equals( name, token ) )
+		{
+			return quality;
+		}
+		else if( http_slice_equals( name, "*" ) )
+		{
+			wildcard = quality;
+		}
+
+		s = item_end + 1;
+	}
+
+	return wildcard;
+}
+
+/*
+ * Checks an If-None-Match or If-Range list of entity tags
+ * against a quoted tag. The weak comparison ignores a "W/"
+ * prefix; the strong one never matches a weak tag.
+ */
+bool http_etag_matches( http_slice_t value, const char* etag, bool strong )
+{
+	const char* s   = value.data;
+	const char* end = value.data + value.length;
+	size_t etag_length = strlen( etag );
+
+	while( s < end )
+	{
+		const char* item_end = memchr( s, ',', end - s );
+
+		if( !item_end )
+		{
+			item_end = end;
+		}
+
+		const char* item = http_skip_spaces( s, item_end );
+		const char* last = item_end;
+
+		while( last > item && (last[ -1 ] == ' ' || last[ -1 ] == '\t') )
+		{
+			last--;
+		}
+
+		if( last - item == 1 && *item == '*' )
+		{
+			return true;
+		}
+
+		if( last - item > 2 && item[ 0 ] == 'W' && item[ 1 ] == '/' )
+		{
+			if( strong )
+			{
+				s = item_end + 1;
+				continue;
+			}
+
+			item += 2;
+		}
+
+		if( (size_t) (last - item) == etag_length && memcmp( item, etag, etag_length ) == 0 )
+		{
+			return true;
+		}
+
+		s = item_end + 1;
+	}
+
+	return false;
+}
+
+/* Formats an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT". */
+const char* http_format_date( time_t time, char* buffer, size_t buffer_size )
+{
+	struct tm tm;
+
+	gmtime_r( &time, &tm );
+	strftime( buffer, buffer_size, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+	return buffer;
+}
+
+/* Only IMF-fixdate is accepted; the obsolete formats are ignored. */
+bool http_parse_date( http_slice_t value, time_t* time )
+{
+	char buffer[ HTTP_DATE_SIZE ];
+	struct tm tm = { 0 };
+
+	if( !http_slice_copy( value, buffer, sizeof(buffer) ) )
+	{
+		return false;
+	}
+
+	const char* end = strptime( buffer, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+
+	if( !end || *end != '\0' )
+	{
+		return false;
+	}
+
+	*time = timegm( &tm );
+	return true;
+}
+
+/* tchar from RFC 7230 */
+bool http_is_token( char c )
+{
+	return isalnum( (unsigned char) c ) || (c != '\0' && strchr( "!#$%&'*+-.^_`|~", c ) != NULL);
+}
+
+const char* http_skip_spaces( const char* s, const char* end )
+{
+	while( s < end && (*s == ' ' || *s == '\t') )
+	{
+		s++;
+	}
+	return s;
+}
+
+bool http_parse_int64( const char** s, const char* end, int64_t* value )
+{
+	const char* p = *s;
+	int64_t result = 0;
+
+	if( p >= end || !isdigit( (unsigned char) *p ) )
+	{
+		return false;
+	}
+
+	while( p < end && isdigit( (unsigned char) *p ) )
+	{
+		int digit = *p - '0';
+
+		if( result > (INT64_MAX - digit) / 10 )
+		{
+			return false; /* overflow */
+		}
+
+		result = result * 10 + digit;
+		p++;
+	}
+
+	*value = result;
+	*s = p;
+	return true;
+}
@@ -0,0 +1,96 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HTTP_MAX_RANGES   16
+#define HTTP_MAX_HEADERS  64
+#define HTTP_DATE_SIZE    32
+
+/*
+ * Slices point into the connection's read buffer; nothing
+ * is copied and they stay valid until the buffer is compacted.
+ */
+typedef struct http_slice {
+	const char* data;
+	size_t length;
+} http_slice_t;
+
+typedef struct http_header {
+	http_slice_t name;
+	http_slice_t value;
+} http_header_t;
+
+typedef enum http_parse_result {
+	HTTP_PARSE_INCOMPLETE = 0, /* need more bytes */
+	HTTP_PARSE_COMPLETE,       /* the whole request head was parsed */
+	HTTP_PARSE_INVALID,        /* malformed request (400) */
+	HTTP_PARSE_TOO_LARGE,      /* too many headers (431) */
+} http_parse_result_t;
+
+typedef struct http_request {
+	http_slice_t method;
+	http_slice_t target;
+	int version_major;
+	int version_minor;
+	http_header_t headers[ HTTP_MAX_HEADERS ];
+	size_t headers_count;
+	size_t head_length;  /* bytes consumed by the request head */
+	/* parser state, so parsing resumes after a partial read */
+	size_t parsed;       /* start of the first unparsed line */
+	bool request_line;   /* the request line has been parsed */
+} http_request_t;
+
+/*
+ * A byte range with inclusive bounds, already
+ * resolved against the size of the representation.
+ */
+typedef struct http_range {
+	int64_t first;
+	int64_t last;
+} http_range_t;
+
+typedef enum http_range_result {
+	HTTP_RANGE_NONE = 0,       /* no usable Range header; send everything */
+	HTTP_RANGE_SATISFIABLE,    /* ranges were parsed and clamped to the size */
+	HTTP_RANGE_UNSATISFIABLE,  /* every range lies beyond the end */
+} http_range_result_t;
+
+void                http_request_reset   ( http_request_t* request );
+http_parse_result_t http_parse_request   ( http_request_t* request, const char* buffer, size_t length );
+const http_slice_t* http_request_header  ( const http_request_t* request, const char* name );
+bool                http_slice_equals    ( http_slice_t slice, const char* text );
+bool                http_slice_contains  ( http_slice_t slice, const char* token );
+bool                http_slice_copy      ( http_slice_t slice, char* buffer, size_t buffer_size );
+http_range_result_t http_parse_range     ( http_slice_t value, int64_t size, http_range_t* ranges, size_t max_ranges, size_t* count );
+bool                http_query_param     ( http_slice_t target, const char* name, http_slice_t* value );
+bool                http_query_int64     ( http_slice_t target, const char* name, int64_t* value );
+int                 http_accept_quality  ( http_slice_t value, const char* token );
+bool                http_etag_matches    ( http_slice_t value, const char* etag, bool strong );
+const char*         http_format_date     ( time_t time, char* buffer, size_t buffer_size );
+bool                http_parse_date      ( http_slice_t value, time_t* time );
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,517 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <xtd/string.h>
+#include "listing_cache.h"
+
+#define LISTING_CACHE_BUCKETS      256
+#define LISTING_CACHE_GENERATIONS  256 /* invalidation counters, by directory hash */
+
+/* Seek marks of one directory; position i is after entry (i + 1) * LISTING_MARK_INTERVAL. */
+typedef struct listing_marks {
+	char* directory;
+	size_t hash;
+	long* positions;
+	size_t count;
+	size_t size;
+	struct listing_marks* next;
+} listing_marks_t;
+
+struct listing_cache {
+	pthread_mutex_t lock;
+	listing_page_t** buckets;
+	size_t buckets_count;
+	size_t pages_count;
+	size_t size;        /* bytes of page data held */
+	size_t budget;
+	uint64_t generations[ LISTING_CACHE_GENERATIONS ]; /* bumped by invalidations of the directories hashed there */
+	listing_page_t* newest;
+	listing_page_t* oldest;
+	listing_marks_t* marks[ LISTING_CACHE_BUCKETS ];
+	watcher_t* watcher;
+};
+
+static void              listing_cache_on_change  ( const char* directory, const char* name, uint32_t mask, void* user_data );
+static void              listing_cache_unlink     ( listing_cache_t* cache, listing_page_t* page );
+static void              listing_cache_grow       ( listing_cache_t* cache );
+static listing_marks_t** listing_cache_find_marks ( listing_cache_t* cache, const char* directory, size_t hash );
+static void              listing_page_free        ( listing_page_t* page );
+static void              listing_marks_free       ( listing_marks_t* marks );
+
+
+listing_cache_t* listing_cache_create( size_t budget, watcher_t* watcher )
+{
+	listing_cache_t* cache = malloc( sizeof(listing_cache_t) );
+
+	if( cache )
+	{
+		cache->buckets_count = LISTING_CACHE_BUCKETS;
+		cache->buckets       = calloc( cache->buckets_count, sizeof(listing_page_t*) );
+		cache->pages_count   = 0;
+		cache->size          = 0;
+		cache->budget        = budget;
+		memset( cache->generations, 0, sizeof(cache->generations) );
+		memset( cache->marks, 0, sizeof(cache->marks) );
+		cache->newest        = NULL;
+		cache->oldest        = NULL;
+		cache->watcher       = watcher;
+
+		if( !cache->buckets )
+		{
+			free( cache );
+			return NULL;
+		}
+
+		pthread_mutex_init( &cache->lock, NULL );
+
+		if( watcher )
+		{
+			watcher_subscribe( watcher, listing_cache_on_change, cache );
+		}
+	}
+
+	return cache;
+}
+
+void listing_cache_destroy( listing_cache_t** cache )
+{
+	if( cache && *cache )
+	{
+		listing_cache_invalidate( *cache, NULL );
+		pthread_mutex_destroy( &(*cache)->lock );
+		free( (*cache)->buckets );
+		free( *cache );
+		*cache = NULL;
+	}
+}
+
+/*
+ * Returns a referenced page or NULL. On a miss, the generation
+ * returned must be passed to listing_cache_insert() so a page
+ * rendered while its directory changed is not cached.
+ */
+listing_page_t* listing_cache_acquire( listing_cache_t* cache, const char* directory, uint64_t* generation )
+{
+	size_t hash = string_hash( directory );
+	listing_page_t* page = NULL;
+
+	pthread_mutex_lock( &cache->lock );
+
+	for( page = cache->buckets[ hash & (cache->buckets_count - 1) ]; page; page = page->next )
+	{
+		if( page->hash == hash && strcmp( page->directory, directory ) == 0 )
+		{
+			break;
+		}
+	}
+
+	if( page )
+	{
+		page->references += 1;
+
+		/* Move to the front of the LRU list. */
+		if( cache->newest != page )
+		{
+			if( page->older ) page->older->newer = page->newer;
+			if( page->newer ) page->newer->older = page->older;
+			if( cache->oldest == page ) cache->oldest = page->newer;
+			page->older = cache->newest;
+			page->newer = NULL;
+			cache->newest->newer = page;
+			cache->newest = page;
+		}
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	if( page )
+	{
+		return page;
+	}
+
+	/* A cached page's directory is already watched. */
+	*generation = listing_cache_generation( cache, directory );
+
+	return NULL;
+}
+
+/*
+ * Watches the directory and returns what to pass along with what
+ * is read from it next, so that it is not kept if the directory
+ * changes meanwhile.
+ */
+uint64_t listing_cache_generation( listing_cache_t* cache, const char* directory )
+{
+	uint64_t generation;
+
+	/* Watch first, so changes made while reading are not missed. */
+	bool watched = cache->watcher && watcher_add( cache->watcher, directory );
+
+	pthread_mutex_lock( &cache->lock );
+	/* An unwatched directory can never be invalidated, so never cache it. */
+	generation = watched ? cache->generations[ string_hash( directory ) % LISTING_CACHE_GENERATIONS ] : UINT64_MAX;
+	pthread_mutex_unlock( &cache->lock );
+
+	return generation;
+}
+
+/*
+ * The last mark at or before the entry: returns the count of
+ * entries it skips, with the telldir() position to seekdir() to,
+ * or 0 when there is none.
+ */
+int64_t listing_cache_seek( listing_cache_t* cache, const char* directory, int64_t entry, long* position )
+{
+	int64_t skipped = 0;
+
+	pthread_mutex_lock( &cache->lock );
+
+	listing_marks_t* marks = *listing_cache_find_marks( cache, directory, string_hash( directory ) );
+
+	if( marks && marks->count > 0 && entry >= LISTING_MARK_INTERVAL )
+	{
+		size_t index = (size_t) (entry / LISTING_MARK_INTERVAL);
+
+		if( index > marks->count )
+		{
+			index = marks->count;
+		}
+
+		*position = marks->positions[ index - 1 ];
+		skipped   = (int64_t) index * LISTING_MARK_INTERVAL;
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	return skipped;
+}
+
+/* Records where the directory was after reading a multiple of LISTING_MARK_INTERVAL entries. */
+void listing_cache_mark( listing_cache_t* cache, const char* directory, int64_t entry, long position, uint64_t generation )
+{
+	size_t hash = string_hash( directory );
+
+	if( entry <= 0 || entry % LISTING_MARK_INTERVAL != 0 || generation == UINT64_MAX )
+	{
+		return;
+	}
+
+	pthread_mutex_lock( &cache->lock );
+
+	listing_marks_t** link = listing_cache_find_marks( cache, directory, hash );
+	listing_marks_t* marks = *link;
+
+	if( generation != cache->generations[ hash % LISTING_CACHE_GENERATIONS ] )
+	{
+		pthread_mutex_unlock( &cache->lock );
+		return;
+	}
+
+	if( !marks && (marks = calloc( 1, sizeof(listing_marks_t) )) )
+	{
+		marks->directory = strdup( directory );
+		marks->hash      = hash;
+
+		if( !marks->directory )
+		{
+			free( marks );
+			marks = NULL;
+		}
+		else
+		{
+			*link = marks;
+		}
+	}
+
+	/* Only the next mark is added, so the positions stay in step with the entries. */
+	if( marks && (size_t) (entry / LISTING_MARK_INTERVAL) == marks->count + 1 )
+	{
+		if( marks->count == marks->size )
+		{
+			size_t size = marks->size ? 2 * marks->size : 16;
+			long* positions = realloc( marks->positions, size * sizeof(long) );
+
+			if( positions )
+			{
+				marks->positions = positions;
+				marks->size      = size;
+			}
+		}
+
+		if( marks->count < marks->size )
+		{
+			marks->positions[ marks->count++ ] = position;
+		}
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+}
+
+void listing_cache_release( listing_cache_t* cache, listing_page_t* page )
+{
+	bool free_page = false;
+
+	pthread_mutex_lock( &cache->lock );
+	page->references -= 1;
+	free_page = page->references == 0 && !page->cached;
+	pthread_mutex_unlock( &cache->lock );
+
+	if( free_page )
+	{
+		listing_page_free( page );
+	}
+}
+
+bool listing_cache_insert( listing_cache_t* cache, const char* directory, const char* data, size_t length, uint64_t etag, time_t last_modified, uint64_t generation )
+{
+	if( length > cache->budget || generation == UINT64_MAX )
+	{
+		return false;
+	}
+
+	listing_page_t* page = malloc( sizeof(listing_page_t) );
+	char* page_data      = malloc( length );
+	char* page_directory = strdup( directory );
+
+	if( !page || !page_data || !page_directory )
+	{
+		free( page );
+		free( page_data );
+		free( page_directory );
+		return false;
+	}
+
+	memcpy( page_data, data, length );
+	page->data       = page_data;
+	page->length     = length;
+	page->etag       = etag;
+	page->last_modified = last_modified;
+	page->directory  = page_directory;
+	page->hash       = string_hash( directory );
+	page->references = 0;
+	page->cached     = true;
+
+	pthread_mutex_lock( &cache->lock );
+
+	if( generation != cache->generations[ page->hash % LISTING_CACHE_GENERATIONS ] )
+	{
+		/* The directory, or one sharing its counter, changed while the page was rendered. */
+		pthread_mutex_unlock( &cache->lock );
+		listing_page_free( page );
+		return false;
+	}
+
+	/* Another worker may have cached the same directory meanwhile. */
+	listing_page_t** link = &cache->buckets[ page->hash & (cache->buckets_count - 1) ];
+	for( listing_page_t* existing = *link; existing; existing = existing->next )
+	{
+		if( existing->hash == page->hash && strcmp( existing->directory, directory ) == 0 )
+		{
+			pthread_mutex_unlock( &cache->lock );
+			listing_page_free( page );
+			return false;
+		}
+	}
+
+	while( cache->size + length > cache->budget && cache->oldest )
+	{
+		listing_page_t* victim = cache->oldest;
+		listing_cache_unlink( cache, victim );
+
+		if( victim->references == 0 )
+		{
+			listing_page_free( victim );
+		}
+	}
+
+	page->next = *link;
+	*link = page;
+	page->newer = NULL;
+	page->older = cache->newest;
+	if( cache->newest ) cache->newest->newer = page;
+	cache->newest = page;
+	if( !cache->oldest ) cache->oldest = page;
+
+	cache->size        += length;
+	cache->pages_count += 1;
+
+	if( cache->pages_count > cache->buckets_count )
+	{
+		listing_cache_grow( cache );
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+
+	return true;
+}
+
+/* Drops the page for a directory, or every page when directory is NULL. */
+void listing_cache_invalidate( listing_cache_t* cache, const char* directory )
+{
+	pthread_mutex_lock( &cache->lock );
+
+	if( directory )
+	{
+		size_t hash = string_hash( directory );
+
+		cache->generations[ hash % LISTING_CACHE_GENERATIONS ] += 1;
+
+		listing_marks_t** link = listing_cache_find_marks( cache, directory, hash );
+		listing_marks_t* marks = *link;
+
+		if( marks )
+		{
+			*link = marks->next;
+			listing_marks_free( marks );
+		}
+
+		for( listing_page_t* page = cache->buckets[ hash & (cache->buckets_count - 1) ]; page; page = page->next )
+		{
+			if( page->hash == hash && strcmp( page->directory, directory ) == 0 )
+			{
+				listing_cache_unlink( cache, page );
+
+				if( page->references == 0 )
+				{
+					listing_page_free( page );
+				}
+				break;
+			}
+		}
+	}
+	else
+	{
+		for( size_t i = 0; i < LISTING_CACHE_GENERATIONS; i++ )
+		{
+			cache->generations[ i ] += 1;
+		}
+
+		for( size_t i = 0; i < LISTING_CACHE_BUCKETS; i++ )
+		{
+			while( cache->marks[ i ] )
+			{
+				listing_marks_t* marks = cache->marks[ i ];
+				cache->marks[ i ] = marks->next;
+				listing_marks_free( marks );
+			}
+		}
+
+		while( cache->oldest )
+		{
+			listing_page_t* page = cache->oldest;
+			listing_cache_unlink( cache, page );
+
+			if( page->references == 0 )
+			{
+				listing_page_free( page );
+			}
+		}
+	}
+
+	pthread_mutex_unlock( &cache->lock );
+}
+
+void listing_cache_on_change( const char* directory, const char* name, uint32_t mask, void* user_data )
+{
+	listing_cache_invalidate( (listing_cache_t*) user_data, directory );
+}
+
+/* Removes a page from the table and the LRU list; the caller frees it if unreferenced. */
+void listing_cache_unlink( listing_cache_t* cache, listing_page_t* page )
+{
+	listing_page_t** link = &cache->buckets[ page->hash & (cache->buckets_count - 1) ];
+
+	while( *link != page )
+	{
+		link = &(*link)->next;
+	}
+	*link = page->next;
+
+	if( page->older ) page->older->newer = page->newer;
+	if( page->newer ) page->newer->older = page->older;
+	if( cache->newest == page ) cache->newest = page->older;
+	if( cache->oldest == page ) cache->oldest = page->newer;
+
+	page->cached = false;
+	cache->size        -= page->length;
+	cache->pages_count -= 1;
+}
+
+void listing_cache_grow( listing_cache_t* cache )
+{
+	size_t buckets_count = cache->buckets_count * 2;
+	listing_page_t** buckets = calloc( buckets_count, sizeof(listing_page_t*) );
+
+	if( !buckets )
+	{
+		return; /* chains just get longer */
+	}
+
+	for( size_t i = 0; i < cache->buckets_count; i++ )
+	{
+		listing_page_t* page = cache->buckets[ i ];
+
+		while( page )
+		{
+			listing_page_t* next = page->next;
+			listing_page_t** link = &buckets[ page->hash & (buckets_count - 1) ];
+			page->next = *link;
+			*link = page;
+			page = next;
+		}
+	}
+
+	free( cache->buckets );
+	cache->buckets       = buckets;
+	cache->buckets_count = buckets_count;
+}
+
+/* The link to the directory's marks, or the empty link at the end of their chain. */
+listing_marks_t** listing_cache_find_marks( listing_cache_t* cache, const char* directory, size_t hash )
+{
+	listing_marks_t** link = &cache->marks[ hash % LISTING_CACHE_BUCKETS ];
+
+	while( *link && ((*link)->hash != hash || strcmp( (*link)->directory, directory ) != 0) )
+	{
+		link = &(*link)->next;
+	}
+
+	return link;
+}
+
+void listing_page_free( listing_page_t* page )
+{
+	free( (char*) page->data );
+	free( page->directory );
+	free( page );
+}
+
+void listing_marks_free( listing_marks_t* marks )
+{
+	free( marks->directory );
+	free( marks->positions );
+	free( marks );
+}
@@ -0,0 +1,69 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __LISTING_CACHE_H__
+#define __LISTING_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "watcher.h"
+
+/*
+ * Rendered directory listing pages keyed by directory path. Pages
+ * are dropped when inotify reports a change in their directory and
+ * least recently used pages are evicted to stay within the budget.
+ * Large directories also get seek marks, telldir() positions every
+ * LISTING_MARK_INTERVAL entries, so a page deep into one is reached
+ * without reading every entry before it; they are dropped with the
+ * directory's page.
+ */
+#define LISTING_MARK_INTERVAL 1024
+
+struct listing_cache;
+typedef struct listing_cache listing_cache_t;
+
+typedef struct listing_page {
+	const char* data;
+	size_t length;
+	uint64_t etag;         /* hash of the data */
+	time_t last_modified;  /* newest of the directory and its entries */
+	/* private */
+	char* directory;
+	size_t hash;
+	int references;
+	bool cached;
+	struct listing_page* next;  /* hash chain */
+	struct listing_page* newer; /* LRU list */
+	struct listing_page* older;
+} listing_page_t;
+
+listing_cache_t* listing_cache_create     ( size_t budget, watcher_t* watcher );
+void             listing_cache_destroy    ( listing_cache_t** cache );
+listing_page_t*  listing_cache_acquire    ( listing_cache_t* cache, const char* directory, uint64_t* generation );
+void             listing_cache_release    ( listing_cache_t* cache, listing_page_t* page );
+bool             listing_cache_insert     ( listing_cache_t* cache, const char* directory, const char* data, size_t length, uint64_t etag, time_t last_modified, uint64_t generation );
+void             listing_cache_invalidate ( listing_cache_t* cache, const char* directory );
+uint64_t         listing_cache_generation ( listing_cache_t* cache, const char* directory );
+int64_t          listing_cache_seek       ( listing_cache_t* cache, const char* directory, int64_t entry, long* position );
+void             listing_cache_mark       ( listing_cache_t* cache, const char* directory, int64_t entry, long position, uint64_t generation );
+
+#endif /* __LISTING_CACHE_H__ */
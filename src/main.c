@@ -21,15 +21,21 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <wchar.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <math.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <ifaddrs.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -42,48 +48,223 @@
 #include <xtd/memory.h>
 #include <xtd/string.h>
 #include "server.h"
+#include "access_log.h"
+#include "arena.h"
+#include "archive.h"
+#include "content_cache.h"
+#include "encoder.h"
+#include "file_cache.h"
+#include "http.h"
+#include "listing_cache.h"
+#include "metrics.h"
+#include "progress.h"
+#include "ratelimit.h"
+#include "response.h"
+#include "search_index.h"
 #include "textbuffer.h"
+#include "watcher.h"
 
-#define CONNECTION_QUEUE 10
+#define CONNECTION_QUEUE SOMAXCONN /* default listen() backlog */
+#define OVERLOAD_RETRY_AFTER 1      /* seconds suggested to clients turned away */
 #ifndef MAX_PATH
-#define MAX_PATH   8
+#define MAX_PATH   1024
 #endif
+#define REQUEST_BUFFER_SIZE  8192
+#define CONNECTION_ARENA_RETAIN (256 * 1024) /* kept between requests */
+#define KEEP_ALIVE_TIMEOUT   5   /* seconds */
+#define KEEP_ALIVE_REQUESTS  100
+#define HEADER_TIMEOUT       10  /* seconds to send a request's headers */
+#define SEND_TIMEOUT         30  /* seconds a response may take beyond SEND_MIN_RATE */
+#define SEND_MIN_RATE        1024 /* bytes per second a client must take */
+#define LISTING_CACHE_SIZE   (32 * 1024 * 1024)
+#define FILE_CACHE_ENTRIES   256 /* open descriptors kept for hot files */
+#define CONTENT_CACHE_MAX_FILE (1024 * 1024) /* larger files are always sent with sendfile() */
+#define LISTING_CHUNK_SIZE   (16 * 1024) /* rows queued per streamed chunk */
+#define LISTING_PER_PAGE     100
+#define LISTING_MAX_PER_PAGE 10000
+#define LISTING_SKIP_BUDGET  4096 /* entries before the page skipped per streamed chunk */
+#define SEARCH_MAX_RESULTS   500
+#define SEARCH_MAX_QUERY     256
+#define CACHE_CONTROL        "no-cache" /* caches may store but must revalidate */
+#define ENCODE_CHUNK_SIZE    (64 * 1024) /* file bytes compressed per chunk */
+#define COMPRESS_MIN_SIZE    256         /* smaller files are not worth it */
+#define PROGRESS_REFRESH_MS  250
 
 #define VERSION "1.0"
 
 typedef struct host_this_state {
 	server_t* server;
+	watcher_t* watcher;
+	listing_cache_t* listing_cache;
+	file_cache_t* file_cache;
+	content_cache_t* content_cache;
+	size_t content_cache_size; /* bytes; 0 disables the content cache */
+	search_index_t* search_index;
+	bool search;               /* index file names and answer ?q= */
+	progress_t* progress;
+	access_log_t* access_log;
+	const char* access_log_path;
+	access_log_format_t access_log_format;
+	metrics_t* metrics;
+	bool serve_metrics;       /* answer /__metrics */
+	ratelimit_t* ratelimit;   /* NULL when no rate limit is set */
+	int64_t rate_limit;       /* bytes per second for the server, 0 for none */
+	int64_t client_rate_limit;
+	int64_t connection_rate_limit;
 	bool verbose;
+	bool headless;
 	const char* title;
 	const char* path;
 	bool use_ip4;
 	short port;
+	int workers;
+	int backlog;              /* of each listening socket */
+	int max_connections;      /* served at once, 0 for no limit */
+	int max_per_address;
+	int keep_alive_timeout;   /* seconds; 0 disables keep-alive */
+	int header_timeout;       /* seconds; 0 for no limit */
+	int send_timeout;         /* seconds; 0 for no limit */
+	int keep_alive_requests;  /* requests served per connection */
+	bool nagle;               /* leave Nagle's algorithm on for peers */
+	server_io_backend_t io_backend;
+	bool stream_listing;      /* send listings chunked as they are read */
+	const char* cache_control;
+	bool compress;            /* compress listings and text files on the fly */
+	bool precompressed;       /* serve foo.gz, foo.zst or foo.br for foo */
 } host_this_state_t;
 
-
-typedef struct file_entry {
-	const char* path;
-	int64_t size;
-} file_entry_t;
-
-typedef struct {
-	FILE* file;
-	int socket;
-	int64_t file_size;
-	unsigned char* buf;
-	size_t buf_size;
-	ssize_t bytes_remaining;
-} send_file_task_args_t;
+/*
+ * What a conditional request is checked against. The
+ * entity tag is quoted, or empty when there is none.
+ */
+typedef struct validators {
+	char etag[ 64 ];
+	time_t last_modified;
+	bool vary; /* the representation depends on Accept-Encoding */
+} validators_t;
+
+/*
+ * Walks a directory with readdir() so that a listing can be
+ * produced a chunk at a time, optionally only one page of it.
+ */
+typedef struct listing_stream {
+	host_this_state_t* app_state;
+	const char* path;     /* of the directory */
+	const char* url_path; /* of the directory under the root, prefixes the links */
+	size_t url_path_length;
+	DIR* directory;
+	bool started;         /* the page head has been queued */
+	int64_t entries;      /* entries read so far */
+	int64_t first;        /* index of the first entry shown */
+	int64_t last;         /* index past the last entry shown */
+	int64_t page;         /* 1-based, or 0 when not paginated */
+	int64_t per_page;
+	uint64_t generation;  /* of the directory in the listing cache, for seek marks */
+	time_t last_modified; /* newest of the directory and the entries read */
+	int worker;           /* for metrics */
+	int64_t enumerate_time; /* microseconds spent in readdir() and stat() */
+	int64_t render_time;    /* microseconds spent formatting */
+} listing_stream_t;
+
+/* Search results being rendered into a response. */
+typedef struct search_render {
+	response_t* response;
+	size_t rows;
+} search_render_t;
+
+typedef enum connection_state {
+	CONNECTION_READING_REQUEST,
+	CONNECTION_SENDING_RESPONSE,
+} connection_state_t;
+
+typedef enum request_status {
+	REQUEST_INCOMPLETE,
+	REQUEST_COMPLETE,
+	REQUEST_INVALID,  /* answered with an error, then closed */
+	REQUEST_FAILED,   /* the peer went away */
+} request_status_t;
+
+/*
+ * Everything needed to resume a connection when
+ * its socket becomes readable or writable again.
+ */
+typedef struct connection {
+	connection_state_t state;
+	int worker;
+	char peer_address_str[ 46 ];
+	char buffer[ REQUEST_BUFFER_SIZE ]; /* may hold pipelined requests */
+	size_t buffer_length;
+	http_request_t request;             /* slices into the buffer */
+	http_parse_result_t parse_result;
+	int requests_served;
+	bool keep_alive;
+	bool overloaded;  /* over a connection limit; answered with 503 */
+	char absolute_path[ MAX_PATH ];
+	int file; /* descriptor of the file being sent or -1 */
+	file_entry_t* file_entry; /* owns the descriptor, or NULL */
+	content_entry_t* content; /* cached response being sent, or NULL */
+	listing_page_t* page; /* cached listing being sent or NULL */
+	listing_stream_t listing; /* listing being streamed, if its directory is open */
+	archive_t* archive;   /* archive being streamed or NULL */
+	progress_transfer_t* transfer; /* shown on the dashboard, or NULL */
+	int64_t file_offset;  /* next byte of the file to compress */
+	int64_t file_end;
+	time_t request_time;     /* when the first byte of the request arrived */
+	int64_t request_start;   /* microseconds, or 0 until the request arrives */
+	int64_t first_byte_sent; /* microseconds, or 0 until the response starts */
+	int64_t waiting_since;   /* microseconds, since the connection or last response ended */
+	int64_t send_start;      /* microseconds, when the response was ready */
+	int64_t throttled;       /* microseconds the response was held back by rate limits */
+	int64_t last_progress;   /* microseconds, when the client last took part of the response */
+	int64_t progress_bytes;  /* bytes sent as of last_progress */
+	ratelimit_client_t* client;   /* shared with the address's other connections */
+	ratelimit_bucket_t bucket;    /* this connection's own limit */
+	arena_t arena;           /* memory for the request, reset after each one */
+	response_t response;
+} connection_t;
 
 
 static void about( int argc, const char* argv[] );
-static void on_connection( server_t* server, int peer_socket, struct sockaddr_storage* peer_address, void* user_data );
-static void process_directory_content( const char* path, void* args );
-static bool send_file_task( int* percent, void* data );
-static char* get_requested_file( int peer_socket, char* buffer, size_t buffer_sz );
+static server_connection_status_t on_connection( server_t* server, server_connection_t* peer, void* user_data );
+static void on_close( server_t* server, server_connection_t* peer, void* user_data );
+static void release_response( host_this_state_t* app_state, connection_t* connection );
+static request_status_t receive_request( connection_t* connection, int peer_socket );
+static void next_request( host_this_state_t* app_state, connection_t* connection );
+static void record_request( host_this_state_t* app_state, connection_t* connection );
+static int64_t clock_us( void );
+static server_connection_status_t wait_for_request( host_this_state_t* app_state, connection_t* connection, server_connection_t* peer );
+static server_connection_status_t wait_for_send( host_this_state_t* app_state, connection_t* connection, server_connection_t* peer );
+static server_connection_status_t wait_until( server_connection_t* peer, int64_t deadline, server_connection_status_t status );
+static bool prepare_response( host_this_state_t* app_state, connection_t* connection );
+static void prepare_metrics( host_this_state_t* app_state, connection_t* connection );
+static bool request_keep_alive( host_this_state_t* app_state, connection_t* connection );
+static void prepare_error( connection_t* connection, int status, const char* reason );
+static bool request_not_modified( const http_request_t* request, const validators_t* validators );
+static bool request_range_applies( const http_request_t* request, const validators_t* validators );
+static void prepare_validators( host_this_state_t* app_state, connection_t* connection, const validators_t* validators );
+static void prepare_not_modified( host_this_state_t* app_state, connection_t* connection, const validators_t* validators );
+static encoding_t request_encoding( host_this_state_t* app_state, const http_request_t* request );
+static void validators_encoded( validators_t* validators, encoding_t encoding );
+static void prepare_directory_listing( host_this_state_t* app_state, connection_t* connection );
+static void prepare_archive( host_this_state_t* app_state, connection_t* connection, http_slice_t format_name );
+static bool listing_open( listing_stream_t* stream, host_this_state_t* app_state, int worker, const char* path, const http_request_t* request, uint64_t generation );
+static void listing_close( listing_stream_t* stream );
+static response_produced_t produce_directory_listing( response_t* response, void* user_data );
+static void render_listing_head( listing_stream_t* stream, response_t* response );
+static void render_listing_foot( listing_stream_t* stream, response_t* response, bool has_next );
+static void render_page_foot( response_t* response );
+static void prepare_search( host_this_state_t* app_state, connection_t* connection, http_slice_t query_param );
+static bool render_search_result( const char* path, bool directory, void* user_data );
+static bool prepare_file( host_this_state_t* app_state, connection_t* connection );
+static file_entry_t* open_precompressed( host_this_state_t* app_state, connection_t* connection, encoding_t* encoding );
+static response_produced_t produce_file( response_t* response, void* user_data );
+static bool is_compressible( const char* path );
+static char* get_requested_file( const http_request_t* request, char* buffer, size_t buffer_sz );
 static void print_verbose_prefix(const char* peer_address_str);
 static void print_verbosef(const char* peer_address_str, const char* format, ...);
 static void url_decode( char *s );
+static char* size_to_string( char* buffer, size_t size, int64_t bytes );
+static uint64_t hash_bytes( const char* data, size_t length );
 
 
 static bool cmd_opt_verbose( const cmd_opt_ctx_t* ctx, void* user_data )
@@ -93,6 +274,13 @@ static bool cmd_opt_verbose( const cmd_opt_ctx_t* ctx, void* user_data )
 	return true;
 }
 
+static bool cmd_opt_metrics( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->serve_metrics = true;
+	return true;
+}
+
 static bool cmd_opt_ip4( const cmd_opt_ctx_t* ctx, void* user_data )
 {
 	host_this_state_t* app_state = (host_this_state_t*) user_data;
@@ -109,6 +297,333 @@ static bool cmd_opt_port( const cmd_opt_ctx_t* ctx, void* user_data )
 	return true;
 }
 
+static bool cmd_opt_workers( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int workers = atoi( arguments[0] );
+
+	if( workers <= 0 )
+	{
+		fprintf( stderr, "ERROR: The number of workers must be at least 1.\n" );
+		return false;
+	}
+
+	app_state->workers = workers;
+	return true;
+}
+
+static bool cmd_opt_backlog( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int backlog = atoi( arguments[0] );
+
+	if( backlog <= 0 )
+	{
+		fprintf( stderr, "ERROR: The backlog must be at least 1.\n" );
+		return false;
+	}
+
+	app_state->backlog = backlog;
+	return true;
+}
+
+static bool cmd_opt_max_connections( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int max_connections = atoi( arguments[0] );
+
+	if( max_connections < 0 )
+	{
+		fprintf( stderr, "ERROR: The maximum number of connections cannot be negative.\n" );
+		return false;
+	}
+
+	app_state->max_connections = max_connections;
+	return true;
+}
+
+static bool cmd_opt_max_per_ip( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int max_per_address = atoi( arguments[0] );
+
+	if( max_per_address < 0 )
+	{
+		fprintf( stderr, "ERROR: The maximum number of connections per address cannot be negative.\n" );
+		return false;
+	}
+
+	app_state->max_per_address = max_per_address;
+	return true;
+}
+
+static bool cmd_opt_keep_alive( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int timeout = atoi( arguments[0] );
+
+	if( timeout < 0 )
+	{
+		fprintf( stderr, "ERROR: The keep-alive timeout cannot be negative.\n" );
+		return false;
+	}
+
+	app_state->keep_alive_timeout = timeout;
+	return true;
+}
+
+static bool cmd_opt_header_timeout( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int timeout = atoi( arguments[0] );
+
+	if( timeout < 0 )
+	{
+		fprintf( stderr, "ERROR: The header timeout cannot be negative.\n" );
+		return false;
+	}
+
+	app_state->header_timeout = timeout;
+	return true;
+}
+
+static bool cmd_opt_send_timeout( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int timeout = atoi( arguments[0] );
+
+	if( timeout < 0 )
+	{
+		fprintf( stderr, "ERROR: The send timeout cannot be negative.\n" );
+		return false;
+	}
+
+	app_state->send_timeout = timeout;
+	return true;
+}
+
+static bool cmd_opt_max_requests( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	int requests = atoi( arguments[0] );
+
+	if( requests <= 0 )
+	{
+		fprintf( stderr, "ERROR: The maximum number of requests must be at least 1.\n" );
+		return false;
+	}
+
+	app_state->keep_alive_requests = requests;
+	return true;
+}
+
+static bool cmd_opt_nagle( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->nagle = true;
+	return true;
+}
+
+static bool cmd_opt_io_backend( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+
+	if( strcmp( arguments[0], "epoll" ) == 0 )
+	{
+		app_state->io_backend = SERVER_IO_EPOLL;
+	}
+	else if( strcmp( arguments[0], "uring" ) == 0 )
+	{
+		app_state->io_backend = SERVER_IO_URING;
+	}
+	else
+	{
+		fprintf( stderr, "ERROR: '%s' is not an I/O backend; use epoll or uring.\n", arguments[0] );
+		return false;
+	}
+
+	return true;
+}
+
+static bool cmd_opt_stream_listing( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->stream_listing = true;
+	return true;
+}
+
+static bool cmd_opt_search( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->search = true;
+	return true;
+}
+
+static bool cmd_opt_cache_control( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+
+	if( strpbrk( arguments[0], "\r\n" ) )
+	{
+		fprintf( stderr, "ERROR: '%s' is not a valid Cache-Control value.\n", arguments[0] );
+		return false;
+	}
+
+	app_state->cache_control = arguments[0];
+	return true;
+}
+
+static bool cmd_opt_compress( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->compress = true;
+	return true;
+}
+
+static bool cmd_opt_precompressed( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->precompressed = true;
+	return true;
+}
+
+static bool cmd_opt_headless( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	app_state->headless = true;
+	return true;
+}
+
+/* Accepts a byte count with an optional K, M or G suffix, e.g. "256M". */
+static bool parse_size( const char* text, unsigned long long* size )
+{
+	char* suffix = NULL;
+	unsigned int shift = 0;
+
+	/* strtoull() skips spaces and negates a '-', so insist on a digit. */
+	if( !isdigit( (unsigned char) text[0] ) )
+	{
+		return false;
+	}
+
+	errno = 0;
+	*size = strtoull( text, &suffix, 10 );
+
+	if( errno == ERANGE )
+	{
+		return false;
+	}
+
+	switch( *suffix )
+	{
+		case 'g': case 'G': shift = 30; suffix++; break;
+		case 'm': case 'M': shift = 20; suffix++; break;
+		case 'k': case 'K': shift = 10; suffix++; break;
+		default: break;
+	}
+
+	if( *size > (ULLONG_MAX >> shift) )
+	{
+		return false;
+	}
+
+	*size <<= shift;
+	return *suffix == '\0' || strcmp( suffix, "B" ) == 0;
+}
+
+static bool cmd_opt_cache_size( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	unsigned long long size = 0;
+
+	if( !parse_size( arguments[0], &size ) )
+	{
+		fprintf( stderr, "ERROR: '%s' is not a valid cache size.\n", arguments[0] );
+		return false;
+	}
+
+	app_state->content_cache_size = size;
+	return true;
+}
+
+/* Rates are bytes per second, with the same suffixes as sizes. */
+static bool parse_rate( const char* text, int64_t* rate )
+{
+	unsigned long long size = 0;
+
+	if( !parse_size( text, &size ) || size > INT64_MAX )
+	{
+		fprintf( stderr, "ERROR: '%s' is not a valid rate.\n", text );
+		return false;
+	}
+
+	*rate = size;
+	return true;
+}
+
+static bool cmd_opt_rate_limit( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	return parse_rate( cmd_opt_args( ctx )[0], &app_state->rate_limit );
+}
+
+static bool cmd_opt_client_rate_limit( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	return parse_rate( cmd_opt_args( ctx )[0], &app_state->client_rate_limit );
+}
+
+static bool cmd_opt_connection_rate_limit( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	return parse_rate( cmd_opt_args( ctx )[0], &app_state->connection_rate_limit );
+}
+
+static bool cmd_opt_access_log( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+	app_state->access_log_path = arguments[0];
+	return true;
+}
+
+static bool cmd_opt_log_format( const cmd_opt_ctx_t* ctx, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	const char** arguments = cmd_opt_args( ctx );
+
+	if( strcmp( arguments[0], "common" ) == 0 )
+	{
+		app_state->access_log_format = ACCESS_LOG_COMMON;
+	}
+	else if( strcmp( arguments[0], "combined" ) == 0 )
+	{
+		app_state->access_log_format = ACCESS_LOG_COMBINED;
+	}
+	else if( strcmp( arguments[0], "json" ) == 0 )
+	{
+		app_state->access_log_format = ACCESS_LOG_JSON;
+	}
+	else
+	{
+		fprintf( stderr, "ERROR: '%s' is not a log format; use common, combined or json.\n", arguments[0] );
+		return false;
+	}
+
+	return true;
+}
+
 static bool cmd_opt_title( const cmd_opt_ctx_t* ctx, void* user_data )
 {
 	host_this_state_t* app_state = (host_this_state_t*) user_data;
@@ -157,9 +672,32 @@ static bool cmd_opt_help( const cmd_opt_ctx_t* ctx, void* user_data )
 
 const cmd_opt_t OPTIONS[] = {
 	{ "-v", "--verbose", 0, "Toggles verbose mode.", cmd_opt_verbose },
+	{ "-M", "--metrics", 0, "Serves Prometheus metrics at /__metrics.", cmd_opt_metrics },
 	{ "-4", "--ip4", 0, "Toggles IPv4 mode.", cmd_opt_ip4 },
 	{ "-p", "--port", 1, "Sets the port that the web server listens on (default is 8080).", cmd_opt_port },
 	{ "-t", "--title", 1, "Sets the title on the web server.", cmd_opt_title },
+	{ "-w", "--workers", 1, "Sets the number of worker threads serving connections (default is 1).", cmd_opt_workers },
+	{ "-b", "--backlog", 1, "Sets how many connections may wait to be accepted (default is the system's maximum).", cmd_opt_backlog },
+	{ "-x", "--max-connections", 1, "Answers 503 once this many connections are being served, 0 for no limit (default is 0).", cmd_opt_max_connections },
+	{ "-a", "--max-per-ip", 1, "Answers 503 once this many connections from one address are being served, 0 for no limit (default is 0).", cmd_opt_max_per_ip },
+	{ "-k", "--keep-alive", 1, "Sets the idle keep-alive timeout in seconds, 0 disables keep-alive (default is 5).", cmd_opt_keep_alive },
+	{ "-T", "--header-timeout", 1, "Sets the seconds a client has to send a request's headers, 0 for no limit (default is 10).", cmd_opt_header_timeout },
+	{ "-S", "--send-timeout", 1, "Sets the seconds a response may take beyond one for every KB sent, 0 for no limit (default is 30).", cmd_opt_send_timeout },
+	{ "-m", "--max-requests", 1, "Sets the maximum number of requests per connection (default is 100).", cmd_opt_max_requests },
+	{ "-N", "--nagle", 0, "Leaves Nagle's algorithm on for connections instead of setting TCP_NODELAY.", cmd_opt_nagle },
+	{ "-i", "--io-backend", 1, "Sets how connections are waited on, epoll or uring (default is epoll).", cmd_opt_io_backend },
+	{ "-s", "--stream-listing", 0, "Streams directory listings as they are read instead of buffering them.", cmd_opt_stream_listing },
+	{ "-q", "--search", 0, "Indexes file names in the background and answers searches at ?q= on any directory.", cmd_opt_search },
+	{ "-c", "--cache-control", 1, "Sets the Cache-Control header sent with files and listings (default is \"no-cache\").", cmd_opt_cache_control },
+	{ "-z", "--compress", 0, "Compresses listings and text files on the fly for clients that accept it.", cmd_opt_compress },
+	{ "-Z", "--precompressed", 0, "Serves a .gz, .zst or .br sibling of a file instead of the file when the client accepts it.", cmd_opt_precompressed },
+	{ "-H", "--headless", 0, "Disables the transfer progress dashboard.", cmd_opt_headless },
+	{ "-R", "--rate-limit", 1, "Caps the bytes per second sent to all clients together, e.g. 10M (default is no limit).", cmd_opt_rate_limit },
+	{ "-P", "--client-rate-limit", 1, "Caps the bytes per second sent to each client address (default is no limit).", cmd_opt_client_rate_limit },
+	{ "-L", "--connection-rate-limit", 1, "Caps the bytes per second sent on each connection (default is no limit).", cmd_opt_connection_rate_limit },
+	{ "-C", "--cache-size", 1, "Keeps small files in memory, up to this many bytes in all, e.g. 256M (default is off).", cmd_opt_cache_size },
+	{ "-l", "--access-log", 1, "Appends an entry for every request to a file, or to stdout for \"-\".", cmd_opt_access_log },
+	{ "-f", "--log-format", 1, "Sets the access log format to common, combined or json (default is combined).", cmd_opt_log_format },
 	{ "-h", "--help", 0, "Show all of the possible options.", cmd_opt_help },
 };
 size_t OPTIONS_COUNT = sizeof(OPTIONS) / sizeof(OPTIONS[0]);
@@ -191,15 +729,13 @@ static void cmd_opt_on_error( cmd_opt_result_t error, const char* opt, void* use
 
 
 server_t* global_server_instance = NULL;
+progress_t* global_progress = NULL;
 
+/* Runs in a signal handler, so it only does what is async-signal-safe. */
 static void quit(void)
 {
-	if (server_is_running(global_server_instance) )
+	if (global_server_instance)
 	{
-		console_reset(stdout);
-		printf("\n");
-		console_text_faderf(stdout, TEXT_FADER_TO_ORANGE, "Stopping server...");
-		printf("\n");
 		server_stop(global_server_instance);
 	}
 }
@@ -218,14 +754,41 @@ int main( int argc, char* argv[] )
 {
 	signal( SIGINT, signal_interrupt_handler );
 	signal( SIGQUIT, signal_quit_handler );
+	signal( SIGPIPE, SIG_IGN );
 
 	host_this_state_t app_state = {
 		.server  = NULL,
+		.watcher = NULL,
+		.listing_cache = NULL,
+		.file_cache = NULL,
+		.content_cache = NULL,
+		.content_cache_size = 0,
+		.search_index = NULL,
+		.search = false,
+		.progress = NULL,
+		.access_log = NULL,
+		.access_log_path   = NULL,
+		.access_log_format = ACCESS_LOG_COMBINED,
+		.metrics = NULL,
+		.serve_metrics = false,
 		.verbose = false,
+		.headless = false,
 		.title   = "Hosting Files",
 		.path    = ".",
 		.use_ip4 = false,
 		.port    = 8080,
+		.workers = 1,
+		.backlog = CONNECTION_QUEUE,
+		.keep_alive_timeout  = KEEP_ALIVE_TIMEOUT,
+		.header_timeout      = HEADER_TIMEOUT,
+		.send_timeout        = SEND_TIMEOUT,
+		.keep_alive_requests = KEEP_ALIVE_REQUESTS,
+		.nagle               = false,
+		.io_backend          = SERVER_IO_EPOLL,
+		.stream_listing      = false,
+		.cache_control       = CACHE_CONTROL,
+		.compress            = false,
+		.precompressed       = false,
 	};
 
 
@@ -316,8 +879,55 @@ int main( int argc, char* argv[] )
 	}
 	printf("\n");
 
-	app_state.server = server_create( app_state.use_ip4, CONNECTION_QUEUE, &app_state );
+	/*
+	 * Rendered listings are cached until inotify
+	 * reports a change in their directory.
+	 */
+	app_state.watcher       = watcher_create( );
+	app_state.listing_cache = listing_cache_create( LISTING_CACHE_SIZE, app_state.watcher );
+	app_state.file_cache    = file_cache_create( FILE_CACHE_ENTRIES, app_state.watcher );
+
+	if( app_state.content_cache_size > 0 )
+	{
+		app_state.content_cache = content_cache_create( app_state.content_cache_size, app_state.watcher );
+	}
+
+	if( app_state.search )
+	{
+		app_state.search_index = search_index_create( app_state.path, app_state.watcher );
+
+		if( !app_state.search_index )
+		{
+			fprintf( stderr, "ERROR: Unable to create the search index.\n" );
+			return -3;
+		}
+	}
+
+	app_state.server = server_create( app_state.use_ip4, app_state.backlog, app_state.workers, &app_state );
 	global_server_instance = app_state.server;
+	server_set_no_delay( app_state.server, !app_state.nagle );
+	server_set_io_backend( app_state.server, app_state.io_backend );
+	server_set_limits( app_state.server, app_state.max_connections, app_state.max_per_address );
+
+	if( app_state.serve_metrics )
+	{
+		app_state.metrics = metrics_create( server_workers( app_state.server ) );
+	}
+
+	if( app_state.rate_limit > 0 || app_state.client_rate_limit > 0 || app_state.connection_rate_limit > 0 )
+	{
+		app_state.ratelimit = ratelimit_create( app_state.rate_limit, app_state.client_rate_limit, app_state.connection_rate_limit );
+	}
+
+	if( app_state.access_log_path )
+	{
+		app_state.access_log = access_log_create( app_state.access_log_path, app_state.access_log_format, server_workers( app_state.server ) );
+
+		if( !app_state.access_log )
+		{
+			return -3;
+		}
+	}
 
 	/*
 	 * Start server and bind to the address passed in
@@ -328,8 +938,32 @@ int main( int argc, char* argv[] )
 		return -3;
 	}
 
-	server_run( app_state.server, on_connection );
+	/* Transfers are drawn by a reporter thread, unless headless. */
+	if( !app_state.headless )
+	{
+		app_state.progress = progress_create( PROGRESS_REFRESH_MS );
+		global_progress    = app_state.progress;
+	}
+
+	server_run( app_state.server, on_connection, on_close );
+
+	console_reset(stdout);
+	printf("\n");
+	console_text_faderf(stdout, TEXT_FADER_TO_ORANGE, "Stopping server...");
+	printf("\n");
+
 	server_destroy( &app_state.server );
+	global_progress = NULL;
+	progress_destroy( &app_state.progress );
+	access_log_destroy( &app_state.access_log );
+	metrics_destroy( &app_state.metrics );
+	ratelimit_destroy( &app_state.ratelimit );
+	search_index_stop( app_state.search_index );
+	watcher_destroy( &app_state.watcher );
+	search_index_destroy( &app_state.search_index );
+	listing_cache_destroy( &app_state.listing_cache );
+	file_cache_destroy( &app_state.file_cache );
+	content_cache_destroy( &app_state.content_cache );
 
 	console_show_cursor(stdout);
 
@@ -361,11 +995,17 @@ void print_verbose_prefix(const char* peer_address_str)
 	console_set_column(stdout, len + 3 + 1);
 }
 
+/*
+ * Workers log concurrently, so each message (including
+ * its newline) is written while holding the stdout lock.
+ */
 void print_verbosef(const char* peer_address_str, const char* format, ...)
 {
+	flockfile(stdout);
+	progress_erase( global_progress );
 	print_verbose_prefix(peer_address_str);
 
-	char fmtbuf[ 8 ];
+	char fmtbuf[ 256 ];
 	va_list args;
 	va_start( args, format );
 	vsnprintf( fmtbuf, sizeof(fmtbuf), format, args );
@@ -374,302 +1014,1756 @@ void print_verbosef(const char* peer_address_str, const char* format, ...)
 
 	console_text_fader( stdout, TEXT_FADER_TO_WHITE, fmtbuf );
 	console_reset(stdout);
+	printf("\n");
+	funlockfile(stdout);
 }
 
-char* get_requested_file( int peer_socket, char* buffer, size_t buffer_sz )
+/*
+ * Decodes the path of the request target into the buffer. Returns
+ * NULL for targets that are too long or try to climb out of the
+ * shared directory with "..".
+ */
+char* get_requested_file( const http_request_t* request, char* buffer, size_t buffer_sz )
 {
-	char* requested_file = NULL;
-	// Stream is closed by the server so we don't need to close this.
-	FILE* request_stream = fdopen( peer_socket, "rb" );
+	http_slice_t target = request->target;
 
-	if( request_stream )
+	/* absolute-form, e.g. "http://host:8080/path" */
+	if( target.length > 7 && strncasecmp( target.data, "http://", 7 ) == 0 )
 	{
-		setvbuf( request_stream, NULL, _IONBF, 0 );
-#if 1
-		file_readline( request_stream, buffer, buffer_sz );
+		const char* path = memchr( target.data + 7, '/', target.length - 7 );
+		size_t skipped = path ? (size_t)(path - target.data) : target.length;
+		target.data   += skipped;
+		target.length -= skipped;
+	}
 
-		char* position_of_space = strchr( buffer, ' ' );
+	const char* query = memchr( target.data, '?', target.length );
 
-		if (!position_of_space)
-		{
-			// peer closed the connection.
+	if( query )
+	{
+		target.length = query - target.data;
+	}
+
+	if( target.length == 0 || *target.data != '/' || !http_slice_copy( target, buffer, buffer_sz ) )
+	{
+		return NULL;
+	}
+
+	url_decode( buffer );
+
+	/*
+	 * Collapse repeated slashes and drop a trailing one so each
+	 * directory has a single spelling (it keys the listing cache).
+	 */
+	char* out = buffer;
+	for( const char* in = buffer; *in; in++ )
+	{
+		if( *in != '/' || out == buffer || out[ -1 ] != '/' )
+		{
+			*out++ = *in;
+		}
+	}
+	if( out > buffer + 1 && out[ -1 ] == '/' )
+	{
+		out--;
+	}
+	*out = '\0';
+
+	for( const char* segment = buffer; segment; segment = strchr( segment + 1, '/' ) )
+	{
+		if( strncmp( segment, "/..", 3 ) == 0 && (segment[3] == '/' || segment[3] == '\0') )
+		{
 			return NULL;
 		}
+	}
+
+	return buffer;
+}
+
+static char* get_peer_address(char* buffer, size_t sz, struct sockaddr_storage* peer_address)
+{
+	const void* address = peer_address->ss_family == AF_INET ? (const void*) &((struct sockaddr_in*) peer_address)->sin_addr
+	                                                         : (const void*) &((struct sockaddr_in6*) peer_address)->sin6_addr;
+	if( !inet_ntop(peer_address->ss_family, address, buffer, sz) )
+	{
+		snprintf( buffer, sz, "unknown" );
+	}
+	buffer[ sz - 1 ] = '\0';
+	return buffer;
+}
+
+server_connection_status_t on_connection( server_t* server, server_connection_t* peer, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	connection_t* connection = (connection_t*) peer->data;
+
+	if( server_socket(server) <= 0 )
+	{
+		return SERVER_CONNECTION_CLOSE;
+	}
+
+	if( !connection )
+	{
+		connection = malloc( sizeof(connection_t) );
+
+		if( !connection )
+		{
+			return SERVER_CONNECTION_CLOSE;
+		}
+
+		connection->state           = CONNECTION_READING_REQUEST;
+		connection->worker          = peer->worker;
+		connection->buffer_length   = 0;
+		connection->parse_result    = HTTP_PARSE_INCOMPLETE;
+		connection->requests_served = 0;
+		connection->keep_alive      = false;
+		connection->overloaded      = peer->overloaded;
+		connection->file            = -1;
+		connection->file_entry      = NULL;
+		connection->content         = NULL;
+		connection->page            = NULL;
+		connection->listing.directory = NULL;
+		connection->archive         = NULL;
+		connection->transfer        = NULL;
+		connection->request_start   = 0;
+		connection->first_byte_sent = 0;
+		connection->waiting_since   = clock_us( );
+		arena_create( &connection->arena, CONNECTION_ARENA_RETAIN );
+		response_create( &connection->response, &connection->arena );
+		http_request_reset( &connection->request );
+		get_peer_address(connection->peer_address_str, sizeof(connection->peer_address_str), &peer->address);
+		connection->client = app_state->ratelimit ? ratelimit_open( app_state->ratelimit, connection->peer_address_str, &connection->bucket ) : NULL;
+		peer->data = connection;
+		metrics_connection_opened( app_state->metrics, peer->worker );
+
+		if( app_state->verbose )
+		{
+			print_verbosef(connection->peer_address_str, "Accepted connection.");
+		}
+	}
+
+	/*
+	 * Keep serving requests until the handler has to wait on the
+	 * socket; pipelined requests may already be in the buffer.
+	 */
+	for( ;; )
+	{
+		if( connection->state == CONNECTION_READING_REQUEST )
+		{
+			request_status_t request_status = receive_request( connection, peer->socket );
+
+			if( connection->request_start == 0 && connection->buffer_length > 0 )
+			{
+				connection->request_start = clock_us( );
+				connection->request_time  = time( NULL );
+			}
+
+			switch( request_status )
+			{
+				case REQUEST_INCOMPLETE:
+					return wait_for_request( app_state, connection, peer );
+				case REQUEST_FAILED:
+					return SERVER_CONNECTION_CLOSE;
+				case REQUEST_INVALID:
+					connection->requests_served += 1;
+					connection->keep_alive = false;
+					break;
+				case REQUEST_COMPLETE:
+				default:
+					metrics_observe( app_state->metrics, connection->worker, METRICS_PHASE_PARSE, clock_us( ) - connection->request_start );
+					connection->requests_served += 1;
+					connection->keep_alive = request_keep_alive( app_state, connection );
+					break;
+			}
+
+			if( !prepare_response( app_state, connection ) )
+			{
+				return SERVER_CONNECTION_CLOSE;
+			}
+
+			/* Downloads go on the dashboard; listings and errors are too quick to matter. */
+			if( (connection->file >= 0 || connection->archive) &&
+			    (connection->response.producer || response_length( &connection->response ) > 0) )
+			{
+				int64_t total = connection->response.producer ? -1 : response_length( &connection->response );
+				const char* name = file_basename( connection->absolute_path );
+				char archive_name[ 64 ];
+
+				if( connection->archive )
+				{
+					snprintf( archive_name, sizeof(archive_name), "%s/", strcmp( name, "." ) == 0 ? "" : name );
+					name = archive_name;
+				}
+
+				connection->transfer = progress_begin( app_state->progress, connection->peer_address_str, name, total );
+			}
+
+			connection->state      = CONNECTION_SENDING_RESPONSE;
+			connection->send_start = clock_us( );
+			connection->throttled  = 0;
+			connection->last_progress  = connection->send_start;
+			connection->progress_bytes = 0;
+		}
+
+		/*
+		 * Under a rate limit the response only gets what the buckets
+		 * allow and the connection sleeps on a timer in between, so
+		 * the zero-copy path is kept and the worker never blocks.
+		 */
+		int64_t budget = -1;
+
+		if( app_state->ratelimit )
+		{
+			budget = ratelimit_allow( app_state->ratelimit, connection->client, &connection->bucket, &peer->delay );
+
+			if( budget == 0 )
+			{
+				/* Held back by us, not the client; its clocks start again afterwards. */
+				connection->throttled    += (int64_t) peer->delay * 1000;
+				connection->last_progress = clock_us( ) + (int64_t) peer->delay * 1000;
+				return SERVER_CONNECTION_DELAY;
+			}
+		}
+
+		connection->response.budget = budget;
+		response_status_t send_status = response_send( &connection->response, peer->socket );
+
+		if( app_state->ratelimit )
+		{
+			ratelimit_spend( app_state->ratelimit, connection->client, &connection->bucket, budget - connection->response.budget );
+		}
+
+		progress_update( connection->transfer, connection->response.bytes_sent );
+
+		if( connection->first_byte_sent == 0 && connection->response.headers_sent > 0 )
+		{
+			connection->first_byte_sent = clock_us( );
+		}
+
+		switch( send_status )
+		{
+			case RESPONSE_PENDING:
+				return wait_for_send( app_state, connection, peer );
+			case RESPONSE_LIMITED:
+				/* Let the other connections have their turn first; the client isn't stalling. */
+				connection->last_progress = clock_us( );
+				peer->delay = 0;
+				return SERVER_CONNECTION_DELAY;
+			case RESPONSE_DONE:
+				record_request( app_state, connection );
+				break;
+			case RESPONSE_ERROR:
+			default:
+				record_request( app_state, connection );
+				return SERVER_CONNECTION_CLOSE;
+		}
+
+		if( app_state->verbose && connection->file >= 0 )
+		{
+			print_verbosef(connection->peer_address_str, "Sent \"%s\"", connection->absolute_path );
+		}
+
+		if( !connection->keep_alive )
+		{
+			return SERVER_CONNECTION_CLOSE;
+		}
+
+		next_request( app_state, connection );
+	}
+}
+
+void on_close( server_t* server, server_connection_t* peer, void* user_data )
+{
+	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	connection_t* connection = (connection_t*) peer->data;
+
+	if( connection )
+	{
+		if( app_state->verbose )
+		{
+			print_verbosef(connection->peer_address_str, "Closing connection." );
+		}
+
+		release_response( app_state, connection );
+		response_destroy( &connection->response );
+		arena_destroy( &connection->arena );
+		ratelimit_close( app_state->ratelimit, connection->client );
+		metrics_connection_closed( app_state->metrics, connection->worker );
+		free( connection );
+		peer->data = NULL;
+	}
+}
+
+request_status_t receive_request( connection_t* connection, int peer_socket )
+{
+	for( ;; )
+	{
+		/* A pipelined request may already be buffered. */
+		connection->parse_result = http_parse_request( &connection->request, connection->buffer, connection->buffer_length );
+
+		switch( connection->parse_result )
+		{
+			case HTTP_PARSE_COMPLETE:
+				return REQUEST_COMPLETE;
+			case HTTP_PARSE_INVALID:
+			case HTTP_PARSE_TOO_LARGE:
+				return REQUEST_INVALID;
+			case HTTP_PARSE_INCOMPLETE:
+			default:
+				break;
+		}
+
+		if( connection->buffer_length >= sizeof(connection->buffer) )
+		{
+			// request headers are too large.
+			connection->parse_result = HTTP_PARSE_TOO_LARGE;
+			return REQUEST_INVALID;
+		}
+
+		ssize_t bytes_read = recv( peer_socket, connection->buffer + connection->buffer_length, sizeof(connection->buffer) - connection->buffer_length, 0 );
+
+		if( bytes_read > 0 )
+		{
+			connection->buffer_length += bytes_read;
+		}
+		else if( bytes_read == 0 )
+		{
+			// peer closed the connection.
+			return REQUEST_FAILED;
+		}
+		else if( errno == EINTR )
+		{
+			continue;
+		}
+		else
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK ? REQUEST_INCOMPLETE : REQUEST_FAILED;
+		}
+	}
+}
+
+/*
+ * Drops the request that was just answered, keeping any
+ * pipelined bytes that followed it, and resets the response.
+ */
+void next_request( host_this_state_t* app_state, connection_t* connection )
+{
+	size_t leftover = connection->buffer_length - connection->request.head_length;
+
+	memmove( connection->buffer, connection->buffer + connection->request.head_length, leftover );
+	connection->buffer_length = leftover;
+	connection->parse_result  = HTTP_PARSE_INCOMPLETE;
+	http_request_reset( &connection->request );
+
+	release_response( app_state, connection );
+	response_release( &connection->response );
+	arena_reset( &connection->arena );
+	connection->state = CONNECTION_READING_REQUEST;
+	connection->request_start   = 0;
+	connection->first_byte_sent = 0;
+	connection->waiting_since   = clock_us( );
+}
+
+/*
+ * Hands the request just answered (or abandoned) to the metrics
+ * and the access log. Must run before next_request() drops the
+ * request buffer.
+ */
+void record_request( host_this_state_t* app_state, connection_t* connection )
+{
+	const http_request_t* request = &connection->request;
+	const response_t* response    = &connection->response;
+	const http_slice_t none       = { .data = "", .length = 0 };
+	int64_t now = clock_us( );
+	int status  = 0;
+
+	/* The status code follows "HTTP/1.1 " on the status line. */
+	if( response->headers.count > 12 )
+	{
+		status = atoi( response->headers.data + 9 );
+	}
+
+	metrics_request( app_state->metrics, connection->worker, status, response->bytes_sent );
+
+	if( connection->first_byte_sent )
+	{
+		metrics_observe( app_state->metrics, connection->worker, METRICS_PHASE_TRANSFER, now - connection->first_byte_sent );
+	}
+
+	if( !app_state->access_log )
+	{
+		return;
+	}
+
+	access_log_entry_t entry = {
+		.peer          = connection->peer_address_str,
+		.method        = request->request_line ? request->method : none,
+		.target        = request->request_line ? request->target : none,
+		.version_major = request->version_major,
+		.version_minor = request->version_minor,
+		.referer       = none,
+		.user_agent    = none,
+		.status        = status,
+		.bytes         = response->bytes_sent,
+		.time          = connection->request_time,
+		.ttfb_us       = connection->first_byte_sent ? connection->first_byte_sent - connection->request_start : -1,
+		.duration_us   = now - connection->request_start,
+	};
+
+	if( connection->parse_result == HTTP_PARSE_COMPLETE )
+	{
+		const http_slice_t* referer    = http_request_header( request, "Referer" );
+		const http_slice_t* user_agent = http_request_header( request, "User-Agent" );
+
+		if( referer )    entry.referer = *referer;
+		if( user_agent ) entry.user_agent = *user_agent;
+	}
+
+	access_log_write( app_state->access_log, connection->worker, &entry );
+}
+
+int64_t clock_us( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Waits for the rest of a request. An idle keep-alive connection
+ * gets the keep-alive timeout; once a request has started, or on
+ * a new connection, the client has the header timeout to finish.
+ */
+server_connection_status_t wait_for_request( host_this_state_t* app_state, connection_t* connection, server_connection_t* peer )
+{
+	bool idle = connection->requests_served > 0 && connection->request_start == 0;
+	int timeout = idle ? app_state->keep_alive_timeout : app_state->header_timeout;
+	int64_t since = connection->request_start ? connection->request_start : connection->waiting_since;
+
+	return wait_until( peer, timeout > 0 ? since + (int64_t) timeout * 1000000 : 0, SERVER_CONNECTION_READ );
+}
+
+/*
+ * Waits for the client to make room for more of the response. The
+ * client is dropped once it has taken nothing for the send
+ * timeout, or once the response has taken longer than the send
+ * timeout plus a second for every SEND_MIN_RATE bytes sent, so a
+ * trickling client is caught too. Time held back by rate limits
+ * does not count against it.
+ */
+server_connection_status_t wait_for_send( host_this_state_t* app_state, connection_t* connection, server_connection_t* peer )
+{
+	int64_t deadline = 0;
+
+	if( connection->response.bytes_sent != connection->progress_bytes )
+	{
+		connection->progress_bytes = connection->response.bytes_sent;
+		connection->last_progress  = clock_us( );
+	}
+
+	if( app_state->send_timeout > 0 )
+	{
+		int64_t timeout = (int64_t) app_state->send_timeout * 1000000;
+		int64_t stalled = connection->last_progress + timeout;
+
+		deadline = connection->send_start + timeout + connection->throttled +
+		           connection->response.bytes_sent * 1000000 / SEND_MIN_RATE;
+
+		if( stalled < deadline )
+		{
+			deadline = stalled;
+		}
+	}
+
+	return wait_until( peer, deadline, SERVER_CONNECTION_WRITE );
+}
+
+/* Has the server close the peer if it is still waiting at the deadline (microseconds, 0 for never). */
+server_connection_status_t wait_until( server_connection_t* peer, int64_t deadline, server_connection_status_t status )
+{
+	peer->timeout = 0;
+
+	if( deadline > 0 )
+	{
+		int64_t remaining = deadline - clock_us( );
+
+		if( remaining <= 0 )
+		{
+			return SERVER_CONNECTION_CLOSE;
+		}
+
+		peer->timeout = remaining / 1000 + 1 > INT_MAX ? INT_MAX : (int) (remaining / 1000 + 1);
+	}
+
+	return status;
+}
+
+/* Lets go of everything the last response was sending from. */
+void release_response( host_this_state_t* app_state, connection_t* connection )
+{
+	if( connection->file_entry )
+	{
+		file_cache_release( app_state->file_cache, connection->file_entry );
+		connection->file_entry = NULL;
+	}
+	connection->file = -1;
+
+	if( connection->content )
+	{
+		content_cache_release( app_state->content_cache, connection->content );
+		connection->content = NULL;
+	}
+
+	if( connection->page )
+	{
+		listing_cache_release( app_state->listing_cache, connection->page );
+		connection->page = NULL;
+	}
+
+	listing_close( &connection->listing );
+	archive_destroy( &connection->archive );
+	progress_end( app_state->progress, connection->transfer );
+	connection->transfer = NULL;
+}
+
+/*
+ * HTTP/1.1 connections persist unless the client opts out;
+ * HTTP/1.0 clients have to ask. Requests carrying a body are
+ * never kept alive since the body is not consumed.
+ */
+bool request_keep_alive( host_this_state_t* app_state, connection_t* connection )
+{
+	const http_request_t* request = &connection->request;
+	const http_slice_t* value = NULL;
+	bool keep_alive = request->version_major > 1 || (request->version_major == 1 && request->version_minor >= 1);
+
+	if( app_state->keep_alive_timeout <= 0 || connection->requests_served >= app_state->keep_alive_requests )
+	{
+		return false;
+	}
+
+	if( (value = http_request_header( request, "Content-Length" )) && !http_slice_equals( *value, "0" ) )
+	{
+		return false;
+	}
+
+	if( http_request_header( request, "Transfer-Encoding" ) )
+	{
+		return false;
+	}
+
+	if( (value = http_request_header( request, "Connection" )) )
+	{
+		if( http_slice_contains( *value, "close" ) )
+		{
+			keep_alive = false;
+		}
+		else if( http_slice_contains( *value, "keep-alive" ) )
+		{
+			keep_alive = true;
+		}
+	}
+
+	return keep_alive;
+}
+
+void prepare_error( connection_t* connection, int status, const char* reason )
+{
+	textbuffer_t* headers_buffer = &connection->response.headers;
+
+	response_printf( &connection->response, "%d %s\n", status, reason );
+
+	textbuffer_printf( headers_buffer, "HTTP/1.1 %d %s\r\n", status, reason );
+	textbuffer_printf( headers_buffer, "Content-Type: text/plain\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Length: %ld\r\n", response_length( &connection->response ) );
+}
+
+bool prepare_response( host_this_state_t* app_state, connection_t* connection )
+{
+	const http_request_t* request = &connection->request;
+	char request_buffer[ MAX_PATH ] = { '\0' };
+	char* requested_file = NULL;
+	bool found = true;
+
+	if( connection->parse_result == HTTP_PARSE_TOO_LARGE )
+	{
+		prepare_error( connection, 431, "Request Header Fields Too Large" );
+		goto finish;
+	}
+	else if( connection->parse_result != HTTP_PARSE_COMPLETE )
+	{
+		prepare_error( connection, 400, "Bad Request" );
+		goto finish;
+	}
+
+	if( connection->overloaded )
+	{
+		/* Turned away before any work is done for it. */
+		connection->keep_alive = false;
+		prepare_error( connection, 503, "Service Unavailable" );
+		textbuffer_printf( &connection->response.headers, "Retry-After: %d\r\n", OVERLOAD_RETRY_AFTER );
+		goto finish;
+	}
+
+	bool head = http_slice_equals( request->method, "HEAD" );
+
+	if( !head && !http_slice_equals( request->method, "GET" ) )
+	{
+		prepare_error( connection, 405, "Method Not Allowed" );
+		textbuffer_printf( &connection->response.headers, "Allow: GET, HEAD\r\n" );
+		goto finish;
+	}
+
+	requested_file = get_requested_file( request, request_buffer, sizeof(request_buffer) );
+
+	if( !requested_file )
+	{
+		prepare_error( connection, 400, "Bad Request" );
+		goto finish;
+	}
+
+
+	memmove( requested_file, requested_file + 1, strlen(requested_file + 1) + 1 );
+
+
+	if( strcmp(requested_file, "favicon.ico" ) == 0 )
+	{
+		prepare_error( connection, 404, "Not Found" );
+		goto finish;
+	}
+
+	char* absolute_path = connection->absolute_path;
+	size_t absolute_path_size = sizeof(connection->absolute_path);
+
+	if( *requested_file == '\0' )
+	{
+		snprintf( absolute_path, absolute_path_size, "%s", app_state->path );
+	}
+	else
+	{
+		snprintf( absolute_path, absolute_path_size, "%s/%s", app_state->path, requested_file );
+	}
+	absolute_path[ absolute_path_size - 1 ] = '\0';
+
+	/* Hot files are found in the cache without touching the file system. */
+	struct stat path_stat;
+
+	if( app_state->metrics && strcmp( requested_file, "__metrics" ) == 0 )
+	{
+		prepare_metrics( app_state, connection );
+	}
+	else if( (connection->file_entry = file_cache_lookup( app_state->file_cache, absolute_path )) )
+	{
+		metrics_cache( app_state->metrics, connection->worker, METRICS_CACHE_FILE, true );
+		found = prepare_file( app_state, connection );
+	}
+	else if( stat( absolute_path, &path_stat ) < 0 )
+	{
+		found = false;
+	}
+	else if( S_ISDIR(path_stat.st_mode) )
+	{
+		prepare_directory_listing( app_state, connection );
+	}
+	else if( S_ISREG(path_stat.st_mode) )
+	{
+		metrics_cache( app_state->metrics, connection->worker, METRICS_CACHE_FILE, false );
+		found = prepare_file( app_state, connection );
+	}
+	else
+	{
+		found = false;
+	}
+
+	if( !found )
+	{
+		release_response( app_state, connection );
+		response_reset( &connection->response );
+		prepare_error( connection, 404, "Not Found" );
+	}
+
+	if( head )
+	{
+		/* Same headers, including Content-Length, but no body. */
+		response_clear_body( &connection->response );
+	}
+
+finish:
+	if( connection->keep_alive )
+	{
+		textbuffer_printf( &connection->response.headers, "Connection: keep-alive\r\n" );
+		textbuffer_printf( &connection->response.headers, "Keep-Alive: timeout=%d, max=%d\r\n", app_state->keep_alive_timeout, app_state->keep_alive_requests - connection->requests_served );
+	}
+	else
+	{
+		textbuffer_printf( &connection->response.headers, "Connection: close\r\n" );
+	}
+	textbuffer_printf( &connection->response.headers, "\r\n" );
+
+	return true;
+}
+
+void prepare_metrics( host_this_state_t* app_state, connection_t* connection )
+{
+	response_t* response = &connection->response;
+
+	if( !metrics_render( app_state->metrics, app_state->server, response ) )
+	{
+		response_clear_body( response );
+		prepare_error( connection, 500, "Internal Server Error" );
+		return;
+	}
+
+	textbuffer_printf( &response->headers, "HTTP/1.1 200 OK\r\n" );
+	textbuffer_printf( &response->headers, "Content-Type: text/plain; version=0.0.4\r\n" );
+	textbuffer_printf( &response->headers, "Content-Length: %ld\r\n", response_length( response ) );
+	textbuffer_printf( &response->headers, "Cache-Control: no-store\r\n" );
+}
+
+/*
+ * Conditional GET (RFC 7232): If-None-Match wins over
+ * If-Modified-Since when both are present.
+ */
+bool request_not_modified( const http_request_t* request, const validators_t* validators )
+{
+	const http_slice_t* value = NULL;
+	time_t since;
+
+	if( (value = http_request_header( request, "If-None-Match" )) )
+	{
+		return *validators->etag != '\0' && http_etag_matches( *value, validators->etag, false );
+	}
+
+	if( (value = http_request_header( request, "If-Modified-Since" )) )
+	{
+		return validators->last_modified > 0 && http_parse_date( *value, &since ) && validators->last_modified <= since;
+	}
+
+	return false;
+}
+
+/* A stale If-Range turns a range request into a full one. */
+bool request_range_applies( const http_request_t* request, const validators_t* validators )
+{
+	const http_slice_t* value = http_request_header( request, "If-Range" );
+	time_t date;
+
+	if( !value )
+	{
+		return true;
+	}
+
+	if( http_parse_date( *value, &date ) )
+	{
+		return date == validators->last_modified;
+	}
+
+	return *validators->etag != '\0' && http_etag_matches( *value, validators->etag, true );
+}
+
+void prepare_validators( host_this_state_t* app_state, connection_t* connection, const validators_t* validators )
+{
+	textbuffer_t* headers_buffer = &connection->response.headers;
+	char date[ HTTP_DATE_SIZE ];
+
+	if( *validators->etag != '\0' )
+	{
+		textbuffer_printf( headers_buffer, "ETag: %s\r\n", validators->etag );
+	}
+
+	if( validators->last_modified > 0 )
+	{
+		textbuffer_printf( headers_buffer, "Last-Modified: %s\r\n", http_format_date( validators->last_modified, date, sizeof(date) ) );
+	}
+
+	if( validators->vary )
+	{
+		textbuffer_printf( headers_buffer, "Vary: Accept-Encoding\r\n" );
+	}
+
+	textbuffer_printf( headers_buffer, "Cache-Control: %s\r\n", app_state->cache_control );
+}
+
+encoding_t request_encoding( host_this_state_t* app_state, const http_request_t* request )
+{
+	if( !app_state->compress )
+	{
+		return ENCODING_IDENTITY;
+	}
+
+	return encoding_negotiate( http_request_header( request, "Accept-Encoding" ), encoding_available( ) );
+}
+
+/* Each encoding of a resource gets its own entity tag. */
+void validators_encoded( validators_t* validators, encoding_t encoding )
+{
+	size_t length = strlen( validators->etag );
+
+	if( encoding != ENCODING_IDENTITY && length >= 2 )
+	{
+		snprintf( validators->etag + length - 1, sizeof(validators->etag) - (length - 1), "-%s\"", encoding_name( encoding ) );
+	}
+}
+
+void prepare_not_modified( host_this_state_t* app_state, connection_t* connection, const validators_t* validators )
+{
+	response_clear_body( &connection->response );
+	connection->response.headers.count = 0;
+
+	textbuffer_printf( &connection->response.headers, "HTTP/1.1 304 Not Modified\r\n" );
+	prepare_validators( app_state, connection, validators );
+}
+
+void prepare_directory_listing( host_this_state_t* app_state, connection_t* connection )
+{
+	const char* absolute_path = connection->absolute_path;
+	const http_request_t* request = &connection->request;
+	response_t* response = &connection->response;
+	textbuffer_t* headers_buffer = &response->headers;
+	listing_stream_t* listing = &connection->listing;
+	validators_t validators = { .etag = "", .last_modified = 0, .vary = app_state->compress };
+	encoding_t encoding = request_encoding( app_state, request );
+
+	if( app_state->verbose )
+	{
+		print_verbosef(connection->peer_address_str, "Sending directory contents for \"%s\"", absolute_path );
+	}
+
+	http_slice_t archive_format;
+
+	if( http_query_param( request->target, "archive", &archive_format ) )
+	{
+		prepare_archive( app_state, connection, archive_format );
+		return;
+	}
+
+	http_slice_t query;
+
+	if( app_state->search_index && http_query_param( request->target, "q", &query ) )
+	{
+		prepare_search( app_state, connection, query );
+		return;
+	}
+
+	/*
+	 * Chunked responses need HTTP/1.1; older clients get the whole
+	 * listing buffered. A streamed listing has no validators since
+	 * they are only known once it has been sent.
+	 */
+	bool streamed = app_state->stream_listing && request->version_major == 1 && request->version_minor >= 1;
+	int64_t page = 0;
+	bool paged = http_query_int64( request->target, "page", &page ) && page > 0;
+	uint64_t generation = 0;
+
+	/* Only whole buffered listings are cached; a hit never opens the directory. */
+	if( !streamed && !paged )
+	{
+		connection->page = listing_cache_acquire( app_state->listing_cache, absolute_path, &generation );
+		metrics_cache( app_state->metrics, connection->worker, METRICS_CACHE_LISTING, connection->page != NULL );
+	}
+	else
+	{
+		generation = listing_cache_generation( app_state->listing_cache, absolute_path );
+	}
+
+	if( !connection->page && !listing_open( listing, app_state, connection->worker, absolute_path, request, generation ) )
+	{
+		prepare_error( connection, 404, "Not Found" );
+		return;
+	}
+
+	if( streamed )
+	{
+		textbuffer_printf( headers_buffer, "HTTP/1.1 200 OK\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Type: text/html\r\n" );
+		textbuffer_printf( headers_buffer, "Transfer-Encoding: chunked\r\n" );
+
+		if( encoding != ENCODING_IDENTITY && response_encode( response, encoding ) )
+		{
+			textbuffer_printf( headers_buffer, "Content-Encoding: %s\r\n", encoding_name( encoding ) );
+		}
+
+		prepare_validators( app_state, connection, &validators );
+		response_stream( response, produce_directory_listing, listing );
+		return;
+	}
+
+	if( connection->page )
+	{
+		response_add_data( response, connection->page->data, connection->page->length );
+		snprintf( validators.etag, sizeof(validators.etag), "\"%016lx\"", connection->page->etag );
+		validators.last_modified = connection->page->last_modified;
+	}
+	else
+	{
+		while( produce_directory_listing( response, listing ) == RESPONSE_PRODUCED_MORE )
+		{
+		}
+
+		const char* body = response->body.data;
+		uint64_t etag = hash_bytes( body, response->body.count );
+
+		snprintf( validators.etag, sizeof(validators.etag), "\"%016lx\"", etag );
+		validators.last_modified = listing->last_modified;
+
+		if( listing->page == 0 )
+		{
+			listing_cache_insert( app_state->listing_cache, absolute_path, body, response->body.count, etag, listing->last_modified, generation );
+		}
+	}
+
+	listing_close( listing );
+	validators_encoded( &validators, encoding );
+
+	if( request_not_modified( request, &validators ) )
+	{
+		prepare_not_modified( app_state, connection, &validators );
+		return;
+	}
+
+	if( encoding != ENCODING_IDENTITY && !response_encode_body( response, encoding ) )
+	{
+		response_clear_body( response );
+		prepare_error( connection, 500, "Internal Server Error" );
+		return;
+	}
+
+	textbuffer_printf( headers_buffer, "HTTP/1.1 200 OK\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Type: text/html\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Length: %ld\r\n", response_length( response ) );
+
+	if( encoding != ENCODING_IDENTITY )
+	{
+		textbuffer_printf( headers_buffer, "Content-Encoding: %s\r\n", encoding_name( encoding ) );
+	}
+
+	prepare_validators( app_state, connection, &validators );
+}
+
+/*
+ * Streams the directory tree as one archive; the length is not
+ * known up front, so it is sent chunked.
+ */
+void prepare_archive( host_this_state_t* app_state, connection_t* connection, http_slice_t format_name )
+{
+	const http_request_t* request = &connection->request;
+	textbuffer_t* headers_buffer = &connection->response.headers;
+	validators_t validators = { .etag = "", .last_modified = 0, .vary = false };
+	archive_format_t format;
+
+	if( http_slice_equals( format_name, "zip" ) )
+	{
+		format = ARCHIVE_ZIP;
+	}
+	else if( http_slice_equals( format_name, "tar" ) )
+	{
+		format = ARCHIVE_TAR;
+	}
+	else
+	{
+		prepare_error( connection, 400, "Bad Request" );
+		return;
+	}
+
+	if( request->version_major < 1 || (request->version_major == 1 && request->version_minor < 1) )
+	{
+		prepare_error( connection, 505, "HTTP Version Not Supported" );
+		return;
+	}
+
+	const char* root_name = file_basename( connection->absolute_path );
+
+	if( *root_name == '\0' || strcmp( root_name, "." ) == 0 || strcmp( root_name, ".." ) == 0 )
+	{
+		root_name = "files";
+	}
+
+	connection->archive = archive_create( format, connection->absolute_path, root_name, &connection->arena );
+
+	if( !connection->archive )
+	{
+		prepare_error( connection, 404, "Not Found" );
+		return;
+	}
+
+	if( app_state->verbose )
+	{
+		print_verbosef(connection->peer_address_str, "Sending \"%s\" as %s", connection->absolute_path, archive_extension( format ) );
+	}
+
+	textbuffer_printf( headers_buffer, "HTTP/1.1 200 OK\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Type: %s\r\n", archive_content_type( format ) );
+	textbuffer_printf( headers_buffer, "Transfer-Encoding: chunked\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Disposition: attachment; filename=\"%s%s\"\r\n", root_name, archive_extension( format ) );
+	prepare_validators( app_state, connection, &validators );
+
+	response_stream( &connection->response, archive_produce, connection->archive );
+}
+
+bool listing_open( listing_stream_t* stream, host_this_state_t* app_state, int worker, const char* path, const http_request_t* request, uint64_t generation )
+{
+	stream->app_state = app_state;
+	stream->worker    = worker;
+	stream->enumerate_time = 0;
+	stream->render_time    = 0;
+	stream->path      = path;
+	stream->url_path  = path + strlen( app_state->path );
+	stream->url_path_length = strlen( stream->url_path );
+	stream->directory = opendir( path );
+	stream->started   = false;
+	stream->entries   = 0;
+	stream->first     = 0;
+	stream->last      = INT64_MAX;
+	stream->page      = 0;
+	stream->per_page  = LISTING_PER_PAGE;
+	stream->generation = generation;
+	stream->last_modified = 0;
+
+	if( http_query_int64( request->target, "page", &stream->page ) && stream->page > 0 )
+	{
+		http_query_int64( request->target, "per_page", &stream->per_page );
+
+		if( stream->per_page < 1 || stream->per_page > LISTING_MAX_PER_PAGE )
+		{
+			stream->per_page = LISTING_PER_PAGE;
+		}
+
+		if( stream->page > INT64_MAX / stream->per_page )
+		{
+			stream->page = INT64_MAX / stream->per_page;
+		}
+
+		stream->first = (stream->page - 1) * stream->per_page;
+		stream->last  = stream->first + stream->per_page;
+	}
+	else
+	{
+		stream->page = 0;
+	}
+
+	if( !stream->directory )
+	{
+		return false;
+	}
+
+	struct stat stats;
+
+	if( fstat( dirfd(stream->directory), &stats ) == 0 )
+	{
+		stream->last_modified = stats.st_mtime;
+	}
+
+	/* Start from the last seek mark before the page, rather than the first entry. */
+	long position;
+	int64_t skipped = stream->first > 0 ? listing_cache_seek( app_state->listing_cache, path, stream->first, &position ) : 0;
+
+	if( skipped > 0 )
+	{
+		seekdir( stream->directory, position );
+		stream->entries = skipped;
+	}
+
+	return true;
+}
+
+void listing_close( listing_stream_t* stream )
+{
+	if( stream->directory )
+	{
+		metrics_t* metrics = stream->app_state->metrics;
+
+		if( metrics && stream->started )
+		{
+			metrics_observe( metrics, stream->worker, METRICS_PHASE_ENUMERATE, stream->enumerate_time );
+			metrics_observe( metrics, stream->worker, METRICS_PHASE_RENDER, stream->render_time );
+		}
+
+		closedir( stream->directory );
+		stream->directory = NULL;
+	}
+}
+
+/*
+ * Queues the page head, then rows until about a chunk's worth
+ * is queued, then the foot once the directory (or the page) is
+ * exhausted. Only the page being shown is ever held in memory.
+ */
+response_produced_t produce_directory_listing( response_t* response, void* user_data )
+{
+	listing_stream_t* stream = (listing_stream_t*) user_data;
+	size_t limit = response->body.count + LISTING_CHUNK_SIZE;
+	bool timed = stream->app_state->metrics != NULL;
+	int64_t started = timed ? clock_us( ) : 0;
+	int64_t enumerated = 0; /* of this call, spent in readdir() and stat() */
+	int64_t skipped = 0;
+	bool more = true;
+
+	if( !stream->started )
+	{
+		render_listing_head( stream, response );
+		stream->started = true;
+	}
+
+	while( response->body.count < limit )
+	{
+		int64_t mark = timed ? clock_us( ) : 0;
+		struct dirent* entry = readdir( stream->directory );
+
+		if( timed )
+		{
+			enumerated += clock_us( ) - mark;
+		}
+
+		if( !entry )
+		{
+			render_listing_foot( stream, response, false );
+			more = false;
+			break;
+		}
+
+		if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 )
+		{
+			continue;
+		}
 
-		requested_file = position_of_space + 1;
-		char* requested_file_end = strrchr( buffer, ' ' );
+		int64_t index = stream->entries++;
 
-		if( requested_file && requested_file_end )
+		if( stream->entries % LISTING_MARK_INTERVAL == 0 )
 		{
-			*requested_file_end = '\0';
-			url_decode( requested_file );
-			//printf( "File: %s\n", requested_file );
+			listing_cache_mark( stream->app_state->listing_cache, stream->path, stream->entries, telldir( stream->directory ), stream->generation );
 		}
-#else
-		char* request_line = NULL;
-		size_t request_line_size = 0;
-		getline( &request_line, &request_line_size, request_stream );
-		printf( "Request: %s\n", request_line );
-#endif
+
+		if( index >= stream->last )
+		{
+			render_listing_foot( stream, response, true );
+			more = false;
+			break;
+		}
+
+		if( index < stream->first )
+		{
+			/* Skipped entries queue nothing, so they have a budget of their own. */
+			if( ++skipped >= LISTING_SKIP_BUDGET )
+			{
+				break;
+			}
+			continue;
+		}
+
+		if( index == stream->first )
+		{
+			response_append_literal( response,
+				"    <table class='pure-table pure-table-horizontal'>\n"
+				"         <tr><thead><th>Filename</th><th>Size</th></tr></thead><tbody>\n" );
+		}
+
+		const char* base_name = entry->d_name;
+		size_t base_name_length = strlen( base_name );
+		struct stat stats;
+		char file_size_str[ 32 ];
+
+		mark = timed ? clock_us( ) : 0;
+
+		if( fstatat( dirfd(stream->directory), base_name, &stats, 0 ) < 0 )
+		{
+			stats.st_size  = 0;
+			stats.st_mtime = 0;
+		}
+
+		if( timed )
+		{
+			enumerated += clock_us( ) - mark;
+		}
+
+		if( stats.st_mtime > stream->last_modified )
+		{
+			stream->last_modified = stats.st_mtime;
+		}
+
+		size_to_string( file_size_str, sizeof(file_size_str), stats.st_size );
+
+		/* Links are absolute so they work with or without a trailing slash. */
+		response_append_literal( response, "        <tr><td><a href='" );
+		response_append_url( response, stream->url_path, stream->url_path_length );
+		response_append_literal( response, "/" );
+		response_append_url( response, base_name, base_name_length );
+		response_append_literal( response, "' title='Download " );
+		response_append_html( response, base_name, base_name_length );
+		response_append_literal( response, "'>" );
+		response_append_html( response, base_name, base_name_length );
+		response_append_literal( response, "</a></td><td>" );
+		response_write( response, file_size_str, strlen(file_size_str) );
+		response_append_literal( response, "</td></tr>\n" );
+	}
+
+	if( timed )
+	{
+		stream->enumerate_time += enumerated;
+		stream->render_time    += clock_us( ) - started - enumerated;
 	}
 
-	return requested_file;
+	return more ? RESPONSE_PRODUCED_MORE : RESPONSE_PRODUCED_DONE;
 }
 
-static char* get_peer_address(char* buffer, size_t sz, struct sockaddr_storage* peer_address)
+void render_listing_head( listing_stream_t* stream, response_t* response )
 {
-	inet_ntop(peer_address->ss_family, peer_address, buffer, sz);
-	buffer[ sz - 1 ] = '\0';
-	return buffer;
+	host_this_state_t* app_state = stream->app_state;
+	const char* parent = strrchr( stream->url_path, '/' );
+	size_t parent_length = parent ? (size_t) (parent - stream->url_path) : 0;
+
+	response_append_literal( response,
+		"<!DOCTYPE html>\n"
+		"<html>\n"
+		"<header>\n"
+		"    <title> " );
+	response_append_html( response, app_state->title, strlen(app_state->title) );
+	response_append_literal( response, " </title>\n"
+		"    <link rel='stylesheet' href='http://yui.yahooapis.com/pure/0.6.0/pure-min.css'>\n"
+		"    <style>\n"
+		"    body {\n"
+		"        background: #ffffff;\n"
+		"        color: #333;\n"
+		"        font-family: Arial, Helvetica, sans-serif;\n"
+		"    }\n"
+		"     {\n"
+		"        width: 800px;\n"
+		"    }\n"
+		"    .content {\n"
+		"        background: #ffffff;\n"
+		"        color: #333;\n"
+		"        margin: auto;\n"
+		"        /* width: 1024px;*/\n"
+		"        /* border: 1px solid #333;*/\n"
+		"        padding: 10px;\n"
+		"    }\n"
+		"    .small {\n"
+		"        font-size: 0.7em;\n"
+		"    }\n"
+		"    </style>\n"
+		"</header>\n"
+		"<body>\n"
+		"<div class='content'>\n"
+		"    <h1> " );
+	response_append_html( response, app_state->title, strlen(app_state->title) );
+	response_append_literal( response, " </h1>\n"
+		"    <p><a href='" );
+	response_append_url( response, stream->url_path, parent_length );
+	response_append_literal( response, "/' title='Return to the parent directory'> Parent Directory </a></p>\n"
+		"    <p class='small'>Download this directory as <a href='?archive=zip'>zip</a> or <a href='?archive=tar'>tar</a>.</p>\n" );
+
+	if( app_state->search_index )
+	{
+		response_append_literal( response,
+			"    <form class='pure-form' method='get'><input type='search' name='q' placeholder='Search file names'> "
+			"<button type='submit' class='pure-button'>Search</button></form>\n" );
+	}
 }
 
-void on_connection( server_t* server, int peer_socket, struct sockaddr_storage* peer_address, void* user_data )
+void render_listing_foot( listing_stream_t* stream, response_t* response, bool has_next )
 {
-	host_this_state_t* app_state = (host_this_state_t*) user_data;
+	if( stream->entries > stream->first )
+	{
+		response_append_literal( response, "    </tbody></table>\n" );
+	}
+	else
+	{
+		response_append_literal( response, "    <p>No files in this path.</p>\n" );
+	}
 
-	if( server_socket(server) <= 0 )
+	if( stream->page > 1 || has_next )
+	{
+		response_append_literal( response, "    <p>" );
+		if( stream->page > 1 )
+		{
+			response_append_literal( response, "<a href='?page=" );
+			response_append_int( response, stream->page - 1 );
+			response_append_literal( response, "&amp;per_page=" );
+			response_append_int( response, stream->per_page );
+			response_append_literal( response, "'>Previous</a> " );
+		}
+		response_append_literal( response, "Page " );
+		response_append_int( response, stream->page );
+		if( has_next )
+		{
+			response_append_literal( response, " <a href='?page=" );
+			response_append_int( response, stream->page + 1 );
+			response_append_literal( response, "&amp;per_page=" );
+			response_append_int( response, stream->per_page );
+			response_append_literal( response, "'>Next</a>" );
+		}
+		response_append_literal( response, "</p>\n" );
+	}
+
+	render_page_foot( response );
+}
+
+void render_page_foot( response_t* response )
+{
+	response_append_literal( response,
+		"<p class='small'>Coded by Joe Marrero. <a href='http://www.manvscode.com/'>http://www.manvscode.com/</a></p>\n"
+		"</div>\n"
+		"</body>\n"
+		"</html>\n" );
+}
+
+/*
+ * Answers ?q= on a directory with everything under it whose name
+ * holds the query, looked up in the search index rather than by
+ * reading directories. Links are absolute, like a listing's.
+ */
+void prepare_search( host_this_state_t* app_state, connection_t* connection, http_slice_t query_param )
+{
+	const http_request_t* request = &connection->request;
+	response_t* response = &connection->response;
+	textbuffer_t* headers_buffer = &response->headers;
+	listing_stream_t* stream = &connection->listing;
+	validators_t validators = { .etag = "", .last_modified = 0, .vary = app_state->compress };
+	encoding_t encoding = request_encoding( app_state, request );
+	char query[ SEARCH_MAX_QUERY ];
+	char scope[ MAX_PATH ];
+
+	if( query_param.length >= sizeof(query) )
 	{
+		prepare_error( connection, 400, "Bad Request" );
 		return;
 	}
 
-	char peer_address_str[ 46 ];
-	get_peer_address(peer_address_str, sizeof(peer_address_str), peer_address);
+	memcpy( query, query_param.data, query_param.length );
+	query[ query_param.length ] = '\0';
+	url_decode( query );
+
+	/* Only what the head of a listing needs. */
+	stream->app_state       = app_state;
+	stream->path            = connection->absolute_path;
+	stream->url_path        = connection->absolute_path + strlen( app_state->path );
+	stream->url_path_length = strlen( stream->url_path );
+
+	/* The index names paths relative to the root, without outer slashes. */
+	const char* start = stream->url_path;
+	size_t length = stream->url_path_length;
+
+	while( length > 0 && *start == '/' )
+	{
+		start++;
+		length--;
+	}
+	while( length > 0 && start[ length - 1 ] == '/' )
+	{
+		length--;
+	}
+	snprintf( scope, sizeof(scope), "%.*s", (int) length, start );
 
 	if( app_state->verbose )
 	{
-		print_verbosef(peer_address_str, "Accepted connection.");
-		printf("\n");
+		print_verbosef(connection->peer_address_str, "Searching \"%s\" for \"%s\"", connection->absolute_path, query );
 	}
 
-	char request_buffer[ 512 ] = { '\0' };
-	char* requested_file = get_requested_file( peer_socket, request_buffer, sizeof(request_buffer) );
+	render_listing_head( stream, response );
+	response_append_literal( response, "    <h3>Names containing &quot;" );
+	response_append_html( response, query, strlen(query) );
+	response_append_literal( response, "&quot;</h3>\n" );
 
-	if( !requested_file )
+	search_render_t render = { .response = response, .rows = 0 };
+	size_t found = search_index_find( app_state->search_index, scope, query, SEARCH_MAX_RESULTS, render_search_result, &render );
+
+	if( found > 0 )
 	{
-		return;
+		response_append_literal( response, "    </tbody></table>\n" );
+	}
+	else
+	{
+		response_append_literal( response, "    <p>No matches.</p>\n" );
 	}
 
+	if( found >= SEARCH_MAX_RESULTS )
+	{
+		response_append_literal( response, "    <p class='small'>Showing the first " );
+		response_append_int( response, SEARCH_MAX_RESULTS );
+		response_append_literal( response, " matches.</p>\n" );
+	}
 
-	memmove( requested_file, requested_file + 1, strlen(requested_file + 1) + 1 );
+	if( !search_index_ready( app_state->search_index ) )
+	{
+		response_append_literal( response, "    <p class='small'>Still indexing; some files may be missing.</p>\n" );
+	}
 
+	render_page_foot( response );
 
-	if( strcmp(requested_file, "favicon.ico" ) == 0 )
+	if( encoding != ENCODING_IDENTITY && !response_encode_body( response, encoding ) )
 	{
+		response_clear_body( response );
+		prepare_error( connection, 500, "Internal Server Error" );
 		return;
 	}
 
-	char absolute_path[ 8 ];
+	textbuffer_printf( headers_buffer, "HTTP/1.1 200 OK\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Type: text/html\r\n" );
+	textbuffer_printf( headers_buffer, "Content-Length: %ld\r\n", response_length( response ) );
 
-	if( *requested_file == '\0' )
+	if( encoding != ENCODING_IDENTITY )
 	{
-		snprintf( absolute_path, sizeof(absolute_path), "%s", app_state->path );
+		textbuffer_printf( headers_buffer, "Content-Encoding: %s\r\n", encoding_name( encoding ) );
 	}
-	else
+
+	prepare_validators( app_state, connection, &validators );
+}
+
+/* Adds a row for one match; the table is opened with the first. */
+bool render_search_result( const char* path, bool directory, void* user_data )
+{
+	search_render_t* render = (search_render_t*) user_data;
+	response_t* response = render->response;
+	size_t length = strlen( path );
+
+	if( render->rows++ == 0 )
 	{
-		snprintf( absolute_path, sizeof(absolute_path), "%s/%s", app_state->path, requested_file );
+		response_append_literal( response,
+			"    <table class='pure-table pure-table-horizontal'>\n"
+			"         <tr><thead><th>Path</th></tr></thead><tbody>\n" );
 	}
-	absolute_path[ sizeof(absolute_path) - 1 ] = '\0';
 
-	if( is_directory( absolute_path ) )
+	/* Directories get a trailing slash, in the link and in the text. */
+	response_append_literal( response, "        <tr><td><a href='/" );
+	response_append_url( response, path, length );
+	if( directory ) response_append_literal( response, "/" );
+	response_append_literal( response, "'>" );
+	response_append_html( response, path, length );
+	if( directory ) response_append_literal( response, "/" );
+	response_append_literal( response, "</a></td></tr>\n" );
+
+	return true;
+}
+
+bool prepare_file( host_this_state_t* app_state, connection_t* connection )
+{
+	const char* absolute_path = connection->absolute_path;
+	response_t* response = &connection->response;
+	struct stat file_stat;
+
+	if( app_state->verbose )
 	{
-		if( app_state->verbose )
-		{
-			print_verbosef(peer_address_str, "Sending directory contents for \"%s\"", absolute_path );
-			printf("\n");
-		}
-
-		textbuffer_t body_buffer;
-
-		textbuffer_create( &body_buffer );
-		textbuffer_printf( &body_buffer, "<!DOCTYPE html>\n" );
-		textbuffer_printf( &body_buffer, "<html>\n" );
-		textbuffer_printf( &body_buffer, "<header>\n" );
-		textbuffer_printf( &body_buffer, "    <title> %s </title>\n", app_state->title );
-		textbuffer_printf( &body_buffer, "    <link rel='stylesheet' href='http://yui.yahooapis.com/pure/0.6.0/pure-min.css'>\n" );
-		textbuffer_printf( &body_buffer, "    <style>\n" );
-		textbuffer_printf( &body_buffer, "    body {\n" );
-		textbuffer_printf( &body_buffer, "        background: #ffffff;\n" );
-		textbuffer_printf( &body_buffer, "        color: #333;\n" );
-		textbuffer_printf( &body_buffer, "        font-family: Arial, Helvetica, sans-serif;\n" );
-		textbuffer_printf( &body_buffer, "    }\n" );
-		textbuffer_printf( &body_buffer, "     {\n" );
-		textbuffer_printf( &body_buffer, "        width: 800px;\n" );
-		textbuffer_printf( &body_buffer, "    }\n" );
-		textbuffer_printf( &body_buffer, "    .content {\n" );
-		textbuffer_printf( &body_buffer, "        background: #ffffff;\n" );
-		textbuffer_printf( &body_buffer, "        color: #333;\n" );
-		textbuffer_printf( &body_buffer, "        margin: auto;\n" );
-		textbuffer_printf( &body_buffer, "        /* width: 1024px;*/\n" );
-		textbuffer_printf( &body_buffer, "        /* border: 1px solid #333;*/\n" );
-		textbuffer_printf( &body_buffer, "        padding: 10px;\n" );
-		textbuffer_printf( &body_buffer, "    }\n" );
-		textbuffer_printf( &body_buffer, "    .small {\n" );
-		textbuffer_printf( &body_buffer, "        font-size: 0.7em;\n" );
-		textbuffer_printf( &body_buffer, "    }\n" );
-		textbuffer_printf( &body_buffer, "    </style>\n" );
-		textbuffer_printf( &body_buffer, "</header>\n" );
-		textbuffer_printf( &body_buffer, "<body>\n" );
-		textbuffer_printf( &body_buffer, "<div class='content'>\n" );
-		textbuffer_printf( &body_buffer, "    <h1> %s </h1>\n", app_state->title );
-		textbuffer_printf( &body_buffer, "    <p><a href='/' title='Return to the parent directory'> Parent Directory </a></p>\n" );
-
-		file_entry_t* files = NULL;
-		lc_vector_create( files, 1 );
-
-		directory_enumerate( absolute_path, false, ENUMERATE_ALL, process_directory_content, &files );
-
-		if( lc_vector_size(files) > 0 )
-		{
-			textbuffer_printf( &body_buffer, "    <table class='pure-table pure-table-horizontal'>\n" );
-			textbuffer_printf( &body_buffer, "         <tr><thead><th>Filename</th><th>Size</th></tr></thead><tbody>\n" );
-			char download_path[ MAX_PATH ];
-
-			for( int i = 0; i < lc_vector_size(files); i++ )
-			{
-				const file_entry_t* entry = &files[i];
-				const char* base_name     = file_basename( entry->path );
-				const char* file_size_str = size_in_best_unit( entry->size, true, 2 );
+		print_verbosef(connection->peer_address_str, "Requested file \"%s\" ", absolute_path );
+	}
 
-				if( *absolute_path != '\0' )
-				{
-					snprintf( download_path, sizeof(download_path), "%s/%s", absolute_path, base_name );
-				}
-				else
-				{
-					snprintf( download_path, sizeof(download_path), "%s", base_name );
-				}
-				download_path[ sizeof(download_path) - 1 ] = '\0';
+	if( !connection->file_entry )
+	{
+		connection->file_entry = file_cache_open( app_state->file_cache, absolute_path );
 
-				textbuffer_printf( &body_buffer, "        <tr><td><a href='%s' title='Download %s'>%s</a></td><td>%s</td></tr>\n", download_path, base_name, base_name, file_size_str );
-			}
-			textbuffer_printf( &body_buffer, "    </tbody></table>\n" );
-		}
-		else
+		if( !connection->file_entry )
 		{
-			textbuffer_printf( &body_buffer, "    <p>No files in this path.</p>\n" );
+			return false;
 		}
+	}
 
-		lc_vector_destroy( files );
+	connection->file = connection->file_entry->fd;
+	file_stat = connection->file_entry->stat;
 
-		textbuffer_printf( &body_buffer, "<p class='small'>Coded by Joe Marrero. <a href='http://www.manvscode.com/'>http://www.manvscode.com/</a></p>\n" );
-		textbuffer_printf( &body_buffer, "</div>\n" );
+	const char* filename = file_basename( absolute_path );
+	const http_request_t* request = &connection->request;
+	const http_slice_t* range_header = http_request_header( request, "Range" );
+	encoding_t encoding = ENCODING_IDENTITY;
+	bool precompressed = false;
+
+	if( app_state->precompressed )
+	{
+		file_entry_t* sibling = open_precompressed( app_state, connection, &encoding );
 
-		textbuffer_printf( &body_buffer, "</body>\n" );
-		textbuffer_printf( &body_buffer, "</html>\n" );
+		if( sibling )
+		{
+			/* Send the sibling as is, ranges included. */
+			file_cache_release( app_state->file_cache, connection->file_entry );
+			connection->file_entry = sibling;
+			connection->file       = sibling->fd;
+			file_stat              = sibling->stat;
+			precompressed = true;
+		}
+	}
 
-		int content_len = body_buffer.count;
+	bool compressible = app_state->compress && !precompressed && is_compressible( absolute_path ) && file_stat.st_size >= COMPRESS_MIN_SIZE;
 
-		textbuffer_t headers_buffer;
+	if( compressible && !range_header && request->version_major == 1 && request->version_minor >= 1 )
+	{
+		/* Ranges of a compressed stream are not supported; they get the file as is. */
+		encoding = request_encoding( app_state, request );
+	}
 
-		textbuffer_create( &headers_buffer );
-		textbuffer_printf( &headers_buffer, "HTTP/1.1 200 OK\r\n" );
-		textbuffer_printf( &headers_buffer, "Content-Type: text/html\r\n" );
-		textbuffer_printf( &headers_buffer, "Content-Length: %d\r\n", content_len );
-		textbuffer_printf( &headers_buffer, "Cache-Control: no-cache, no-store, must-revalidate\r\n" );
-		textbuffer_printf( &headers_buffer, "Pragma: no-cache\r\n" );
-		textbuffer_printf( &headers_buffer, "Expires: 0\r\n" );
-		textbuffer_printf( &headers_buffer, "\r\n" );
+	int64_t content_len = file_stat.st_size;
+	validators_t validators = { .last_modified = file_stat.st_mtime, .vary = precompressed || compressible };
 
-		send( peer_socket, lc_buffer_data(headers_buffer.buffer), headers_buffer.count, 0 );
-		send( peer_socket, lc_buffer_data(body_buffer.buffer), body_buffer.count, 0 );
+	/* A strong tag: any change to the file changes one of these. */
+	snprintf( validators.etag, sizeof(validators.etag), "\"%lx-%lx-%lx\"",
+	          (unsigned long) file_stat.st_ino,
+	          (unsigned long) file_stat.st_size,
+	          (unsigned long) (file_stat.st_mtim.tv_sec * 1000000000L + file_stat.st_mtim.tv_nsec) );
 
-		textbuffer_destroy( &body_buffer );
-		textbuffer_destroy( &headers_buffer );
+	if( !precompressed )
+	{
+		validators_encoded( &validators, encoding );
 	}
-	else if( file_exists(absolute_path) )
+
+	if( request_not_modified( request, &validators ) )
 	{
-		if( app_state->verbose )
+		prepare_not_modified( app_state, connection, &validators );
+		return true;
+	}
+
+	textbuffer_t* headers_buffer = &response->headers;
+
+	/* Whole, unencoded responses of small files can be answered from memory. */
+	bool cacheable = app_state->content_cache && !precompressed && encoding == ENCODING_IDENTITY && !range_header && content_len <= CONTENT_CACHE_MAX_FILE;
+
+	if( cacheable && (connection->content = content_cache_acquire( app_state->content_cache, absolute_path, &file_stat )) )
+	{
+		char* headers = textbuffer_reserve( headers_buffer, connection->content->headers_length );
+
+		if( headers )
 		{
-			print_verbosef(peer_address_str, "Requested file \"%s\" ", absolute_path );
-			printf("\n");
+			memcpy( headers, connection->content->headers, connection->content->headers_length );
+			headers_buffer->count += connection->content->headers_length;
+			response_add_data( response, connection->content->body, connection->content->body_length );
+			metrics_cache( app_state->metrics, connection->worker, METRICS_CACHE_CONTENT, true );
+			return true;
 		}
 
-		int64_t content_len = file_size( absolute_path );
-		const char* filename = file_basename( absolute_path );
+		content_cache_release( app_state->content_cache, connection->content );
+		connection->content = NULL;
+	}
+
+	if( encoding != ENCODING_IDENTITY && !precompressed && response_encode( response, encoding ) )
+	{
+		textbuffer_printf( headers_buffer, "HTTP/1.1 200 OK\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Type: application/octet-stream\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Encoding: %s\r\n", encoding_name( encoding ) );
+		textbuffer_printf( headers_buffer, "Transfer-Encoding: chunked\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Disposition: attachment; filename=\"%s\"\r\n", filename );
+		prepare_validators( app_state, connection, &validators );
+
+		connection->file_offset = 0;
+		connection->file_end    = content_len;
+		response_stream( response, produce_file, connection );
+		return true;
+	}
 
-		textbuffer_t headers_buffer;
-		textbuffer_create( &headers_buffer );
+	http_range_t ranges[ HTTP_MAX_RANGES ];
+	size_t ranges_count = 0;
+	http_range_result_t range_result = HTTP_RANGE_NONE;
 
-		textbuffer_printf( &headers_buffer, "HTTP/1.1 200 OK\r\n" );
-		textbuffer_printf( &headers_buffer, "Content-Type: application/octet-stream\r\n" );
-		textbuffer_printf( &headers_buffer, "Content-Disposition: attachment; filename=\"%s\"\r\n", filename );
-		textbuffer_printf( &headers_buffer, "Content-Length: %ld\r\n", content_len );
-		textbuffer_printf( &headers_buffer, "Cache-Control: no-cache, no-store, must-revalidate\r\n" );
-		textbuffer_printf( &headers_buffer, "Pragma: no-cache\r\n" );
-		textbuffer_printf( &headers_buffer, "Expires: 0\r\n" );
-		textbuffer_printf( &headers_buffer, "\r\n" );
+	if( range_header && request_range_applies( request, &validators ) )
+	{
+		range_result = http_parse_range( *range_header, content_len, ranges, HTTP_MAX_RANGES, &ranges_count );
+	}
 
-		send( peer_socket, lc_buffer_data(headers_buffer.buffer), headers_buffer.count, 0 );
+	if( range_result == HTTP_RANGE_UNSATISFIABLE )
+	{
+		textbuffer_printf( headers_buffer, "HTTP/1.1 416 Range Not Satisfiable\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Range: bytes */%ld\r\n", content_len );
+		textbuffer_printf( headers_buffer, "Content-Length: 0\r\n" );
+		return true;
+	}
 
-		textbuffer_destroy( &headers_buffer );
+	if( range_result == HTTP_RANGE_SATISFIABLE && ranges_count == 1 )
+	{
+		textbuffer_printf( headers_buffer, "HTTP/1.1 206 Partial Content\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Type: application/octet-stream\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Range: bytes %ld-%ld/%ld\r\n", ranges[0].first, ranges[0].last, content_len );
 
-		FILE* file = fopen( absolute_path, "rb" );
-		if( file )
+		response_add_file( response, connection->file, ranges[0].first, ranges[0].last - ranges[0].first + 1 );
+	}
+	else if( range_result == HTTP_RANGE_SATISFIABLE )
+	{
+		/*
+		 * Each part is a small text preamble followed by a slice of
+		 * the file, so the parts still go out with sendfile().
+		 */
+		char boundary[ 32 ];
+		snprintf( boundary, sizeof(boundary), "%016lx%08x", (unsigned long) file_stat.st_ino ^ (unsigned long) file_stat.st_mtime, (unsigned) rand() );
+
+		for( size_t i = 0; i < ranges_count; i++ )
 		{
-			unsigned char buffer[ 4096 ];
-			send_file_task_args_t args = {
-				.file = file,
-				.file_size = content_len,
-				.socket = peer_socket,
-				.buf = buffer,
-				.buf_size = sizeof(buffer),
-				.bytes_remaining = content_len,
-			};
+			response_printf( response, "\r\n--%s\r\n", boundary );
+			response_printf( response, "Content-Type: application/octet-stream\r\n" );
+			response_printf( response, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n", ranges[i].first, ranges[i].last, content_len );
+			response_add_file( response, connection->file, ranges[i].first, ranges[i].last - ranges[i].first + 1 );
+		}
+		response_printf( response, "\r\n--%s--\r\n", boundary );
+
+		textbuffer_printf( headers_buffer, "HTTP/1.1 206 Partial Content\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary );
+	}
+	else
+	{
+		textbuffer_printf( headers_buffer, "HTTP/1.1 200 OK\r\n" );
+		textbuffer_printf( headers_buffer, "Content-Type: application/octet-stream\r\n" );
 
-			print_verbose_prefix(peer_address_str);
+		response_add_file( response, connection->file, 0, content_len );
+	}
 
-			char description[512];
-			snprintf(description, sizeof(description), "Sending \"%s\"", absolute_path);
-			description[ sizeof(description) - 1 ] = '\0';
-			console_progress_indicator( stdout, description, PROGRESS_INDICATOR_STYLE_BLUE, send_file_task, &args );
+	textbuffer_printf( headers_buffer, "Content-Disposition: attachment; filename=\"%s\"\r\n", filename );
+	textbuffer_printf( headers_buffer, "Content-Length: %ld\r\n", response_length( response ) );
+	textbuffer_printf( headers_buffer, "Accept-Ranges: bytes\r\n" );
 
-			fclose( file );
-		}
+	if( precompressed )
+	{
+		textbuffer_printf( headers_buffer, "Content-Encoding: %s\r\n", encoding_name( encoding ) );
+	}
+
+	prepare_validators( app_state, connection, &validators );
+
+	/* Keep the file and its headers, then send the copy. */
+	if( cacheable && range_result == HTTP_RANGE_NONE )
+	{
+		const char* headers = headers_buffer->data;
+		connection->content = content_cache_insert( app_state->content_cache, absolute_path, &file_stat, connection->file, headers, headers_buffer->count );
+		metrics_cache( app_state->metrics, connection->worker, METRICS_CACHE_CONTENT, false );
 
+		if( connection->content )
+		{
+			response_clear_body( response );
+			response_add_data( response, connection->content->body, connection->content->body_length );
+		}
 	}
 
 	if( app_state->verbose )
 	{
-		print_verbosef(peer_address_str, "Closing connection." );
-		printf("\n");
+		print_verbosef(connection->peer_address_str, "Sending \"%s\"", absolute_path );
 	}
+
+	return true;
 }
 
-void process_directory_content( const char* path, void* args )
+/*
+ * Opens the best sibling of the file, e.g. "foo.txt.gz", that the
+ * client accepts. Only codings with a non-zero q-value are probed,
+ * best first, and missing siblings are remembered by the file
+ * cache. Siblings older than the file are stale and are skipped.
+ */
+file_entry_t* open_precompressed( host_this_state_t* app_state, connection_t* connection, encoding_t* encoding )
 {
-	file_entry_t** entries = (file_entry_t**) args;
-	char* path_copy = string_dup( path );
+	const http_slice_t* accept_encoding = http_request_header( &connection->request, "Accept-Encoding" );
+	unsigned int candidates = ENCODING_MASK(ENCODING_GZIP) | ENCODING_MASK(ENCODING_ZSTD) | ENCODING_MASK(ENCODING_BROTLI);
+	char sibling_path[ MAX_PATH ];
 
-	file_entry_t entry = {
-		.path = path_copy,
-		.size = file_size(path_copy)
-	};
-	lc_vector_push( *entries, entry );
+	*encoding = ENCODING_IDENTITY;
+
+	while( candidates )
+	{
+		encoding_t best = encoding_negotiate( accept_encoding, candidates );
+
+		if( best == ENCODING_IDENTITY )
+		{
+			break;
+		}
+
+		snprintf( sibling_path, sizeof(sibling_path), "%s%s", connection->absolute_path, encoding_extension( best ) );
+		file_entry_t* sibling = file_cache_probe( app_state->file_cache, sibling_path );
+
+		if( sibling && sibling->stat.st_mtime >= connection->file_entry->stat.st_mtime )
+		{
+			*encoding = best;
+			return sibling;
+		}
+		else if( sibling )
+		{
+			file_cache_release( app_state->file_cache, sibling );
+		}
+
+		candidates &= ~ENCODING_MASK(best);
+	}
+
+	return NULL;
+}
+
+/* Feeds the file to the encoder a chunk at a time. */
+response_produced_t produce_file( response_t* response, void* user_data )
+{
+	connection_t* connection = (connection_t*) user_data;
+	int64_t remaining = connection->file_end - connection->file_offset;
+	size_t wanted = remaining < ENCODE_CHUNK_SIZE ? (size_t) remaining : ENCODE_CHUNK_SIZE;
+
+	if( remaining <= 0 )
+	{
+		return RESPONSE_PRODUCED_DONE;
+	}
+
+	char* buffer = response_reserve( response, wanted );
+
+	if( !buffer )
+	{
+		return RESPONSE_PRODUCED_ERROR;
+	}
+
+	ssize_t result = pread( connection->file, buffer, wanted, connection->file_offset );
+
+	if( result <= 0 )
+	{
+		/* The file shrank or could not be read; the body cannot be finished. */
+		return RESPONSE_PRODUCED_ERROR;
+	}
+
+	response_commit( response, result );
+	connection->file_offset += result;
+
+	return connection->file_offset < connection->file_end ? RESPONSE_PRODUCED_MORE : RESPONSE_PRODUCED_DONE;
 }
 
-bool send_file_task( int* percent, void* data )
+/* Text formats that shrink well; anything else is sent as is. */
+bool is_compressible( const char* path )
 {
-	send_file_task_args_t* args = (send_file_task_args_t*) data;
-	bool isSending = !feof(args->file) && args->bytes_remaining > 0;
+	static const char* extensions[] = {
+		".txt", ".htm", ".html", ".css", ".js", ".json", ".xml", ".svg", ".csv",
+		".md", ".log", ".c", ".h", ".cpp", ".hpp", ".py", ".sh", ".ini", ".yml", ".yaml",
+	};
+	const char* extension = strrchr( path, '.' );
 
-	if( isSending )
+	if( !extension || strchr( extension, '/' ) )
 	{
-		size_t bytes_read = fread( args->buf, sizeof(char), args->buf_size, args->file );
-		ssize_t bytes_sent = 0;
+		return false;
+	}
 
-		while( bytes_read > 0 )
+	for( size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++ )
+	{
+		if( strcasecmp( extension, extensions[ i ] ) == 0 )
 		{
-			bytes_sent = send( args->socket, args->buf + bytes_sent, bytes_read, 0 );
-			bytes_read -= bytes_sent;
-			args->bytes_remaining -= bytes_sent;
+			return true;
 		}
 	}
 
-	*percent = 100 * (args->file_size - args->bytes_remaining) / args->file_size;
+	return false;
+}
+
+/* 64-bit FNV-1a */
+uint64_t hash_bytes( const char* data, size_t length )
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for( size_t i = 0; i < length; i++ )
+	{
+		hash ^= (unsigned char) data[ i ];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * A reentrant replacement for size_in_best_unit(), which
+ * formats into a shared buffer that workers would race on.
+ */
+char* size_to_string( char* buffer, size_t size, int64_t bytes )
+{
+	static const char* units[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+	const size_t units_count = sizeof(units) / sizeof(units[0]);
+	double value = (double) bytes;
+	size_t unit = 0;
 
-	fflush(stdout);
+	while( value >= 1024.0 && unit + 1 < units_count )
+	{
+		value /= 1024.0;
+		unit  += 1;
+	}
 
-	return isSending;
+	snprintf( buffer, size, "%.2f %s", value, units[ unit ] );
+	buffer[ size - 1 ] = '\0';
+	return buffer;
 }
 
 /* Convert an ASCII hex digit to the corresponding number between 0
@@ -0,0 +1,332 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "metrics.h"
+
+#define METRICS_STATUS_MIN  100
+#define METRICS_STATUS_MAX  599
+
+/* Upper bounds of the histogram buckets in microseconds; +Inf is implied. */
+static const int64_t METRICS_BUCKETS[] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+	50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+#define METRICS_BUCKETS_COUNT  (sizeof(METRICS_BUCKETS) / sizeof(METRICS_BUCKETS[0]))
+
+static const char* METRICS_PHASE_NAMES[ METRICS_PHASE_COUNT ] = { "parse", "enumerate", "render", "transfer" };
+static const char* METRICS_CACHE_NAMES[ METRICS_CACHE_COUNT ] = { "listing", "file", "content" };
+
+typedef _Atomic uint64_t metrics_counter_t;
+
+typedef struct metrics_histogram {
+	metrics_counter_t buckets[ METRICS_BUCKETS_COUNT + 1 ]; /* not cumulative */
+	metrics_counter_t sum; /* microseconds */
+} metrics_histogram_t;
+
+/* Aligned so that workers never write to the same cache line. */
+typedef struct metrics_worker {
+	_Alignas(64) metrics_counter_t connections_opened;
+	metrics_counter_t connections_closed;
+	metrics_counter_t bytes;
+	metrics_counter_t statuses[ METRICS_STATUS_MAX - METRICS_STATUS_MIN + 1 ];
+	metrics_counter_t cache_hits[ METRICS_CACHE_COUNT ];
+	metrics_counter_t cache_misses[ METRICS_CACHE_COUNT ];
+	metrics_histogram_t phases[ METRICS_PHASE_COUNT ];
+} metrics_worker_t;
+
+struct metrics {
+	metrics_worker_t* workers;
+	int workers_count;
+};
+
+static void     metrics_add   ( metrics_counter_t* counter, uint64_t amount );
+static uint64_t metrics_sum   ( const metrics_t* metrics, size_t offset );
+static uint64_t listen_overflows ( void );
+
+
+metrics_t* metrics_create( int workers )
+{
+	metrics_t* metrics = malloc( sizeof(metrics_t) );
+
+	if( metrics )
+	{
+		metrics->workers_count = workers;
+		metrics->workers       = aligned_alloc( _Alignof(metrics_worker_t), workers * sizeof(metrics_worker_t) );
+
+		if( !metrics->workers )
+		{
+			free( metrics );
+			return NULL;
+		}
+
+		memset( metrics->workers, 0, workers * sizeof(metrics_worker_t) );
+	}
+
+	return metrics;
+}
+
+void metrics_destroy( metrics_t** metrics )
+{
+	if( metrics && *metrics )
+	{
+		free( (*metrics)->workers );
+		free( *metrics );
+		*metrics = NULL;
+	}
+}
+
+void metrics_connection_opened( metrics_t* metrics, int worker )
+{
+	if( metrics )
+	{
+		metrics_add( &metrics->workers[ worker ].connections_opened, 1 );
+	}
+}
+
+void metrics_connection_closed( metrics_t* metrics, int worker )
+{
+	if( metrics )
+	{
+		metrics_add( &metrics->workers[ worker ].connections_closed, 1 );
+	}
+}
+
+void metrics_request( metrics_t* metrics, int worker, int status, int64_t bytes )
+{
+	if( metrics )
+	{
+		metrics_worker_t* w = &metrics->workers[ worker ];
+
+		if( status >= METRICS_STATUS_MIN && status <= METRICS_STATUS_MAX )
+		{
+			metrics_add( &w->statuses[ status - METRICS_STATUS_MIN ], 1 );
+		}
+
+		metrics_add( &w->bytes, bytes > 0 ? bytes : 0 );
+	}
+}
+
+void metrics_observe( metrics_t* metrics, int worker, metrics_phase_t phase, int64_t microseconds )
+{
+	if( metrics )
+	{
+		metrics_histogram_t* histogram = &metrics->workers[ worker ].phases[ phase ];
+		size_t bucket = 0;
+
+		if( microseconds < 0 )
+		{
+			microseconds = 0;
+		}
+
+		while( bucket < METRICS_BUCKETS_COUNT && microseconds > METRICS_BUCKETS[ bucket ] )
+		{
+			bucket++;
+		}
+
+		metrics_add( &histogram->buckets[ bucket ], 1 );
+		metrics_add( &histogram->sum, microseconds );
+	}
+}
+
+void metrics_cache( metrics_t* metrics, int worker, metrics_cache_t cache, bool hit )
+{
+	if( metrics )
+	{
+		metrics_worker_t* w = &metrics->workers[ worker ];
+		metrics_add( hit ? &w->cache_hits[ cache ] : &w->cache_misses[ cache ], 1 );
+	}
+}
+
+/*
+ * Renders every metric in the Prometheus text exposition format,
+ * merging the workers' slots as it goes.
+ */
+bool metrics_render( metrics_t* metrics, server_t* server, response_t* response )
+{
+	uint64_t opened = metrics_sum( metrics, offsetof(metrics_worker_t, connections_opened) );
+	uint64_t closed = metrics_sum( metrics, offsetof(metrics_worker_t, connections_closed) );
+	uint64_t accept_failures = 0;
+	uint64_t rejected = 0;
+	bool result = true;
+
+	result &= response_printf( response, "# HELP host_this_connections_active Connections currently open.\n" );
+	result &= response_printf( response, "# TYPE host_this_connections_active gauge\n" );
+	result &= response_printf( response, "host_this_connections_active %lu\n", opened - closed );
+	result &= response_printf( response, "# HELP host_this_connections_total Connections accepted.\n" );
+	result &= response_printf( response, "# TYPE host_this_connections_total counter\n" );
+	result &= response_printf( response, "host_this_connections_total %lu\n", opened );
+
+	result &= response_printf( response, "# HELP host_this_accept_queue_length Connections waiting to be accepted by a worker.\n" );
+	result &= response_printf( response, "# TYPE host_this_accept_queue_length gauge\n" );
+
+	for( int i = 0; i < server_workers( server ); i++ )
+	{
+		server_listen_stats_t stats;
+
+		if( server_listen_stats( server, i, &stats ) )
+		{
+			result &= response_printf( response, "host_this_accept_queue_length{worker=\"%d\",size=\"%u\"} %u\n", i, stats.queue_size, stats.queued );
+			accept_failures += stats.accept_failures;
+			rejected        += stats.rejected;
+		}
+	}
+
+	result &= response_printf( response, "# HELP host_this_accept_failures_total Failed calls to accept(), such as when out of descriptors.\n" );
+	result &= response_printf( response, "# TYPE host_this_accept_failures_total counter\n" );
+	result &= response_printf( response, "host_this_accept_failures_total %lu\n", accept_failures );
+	result &= response_printf( response, "# HELP host_this_connections_rejected_total Connections turned away with 503 because a connection limit was reached.\n" );
+	result &= response_printf( response, "# TYPE host_this_connections_rejected_total counter\n" );
+	result &= response_printf( response, "host_this_connections_rejected_total %lu\n", rejected );
+	result &= response_printf( response, "# HELP host_this_listen_overflows_total Connections dropped because an accept queue was full, across the whole host.\n" );
+	result &= response_printf( response, "# TYPE host_this_listen_overflows_total counter\n" );
+	result &= response_printf( response, "host_this_listen_overflows_total %lu\n", listen_overflows( ) );
+
+	result &= response_printf( response, "# HELP host_this_requests_total Requests answered, by status code.\n" );
+	result &= response_printf( response, "# TYPE host_this_requests_total counter\n" );
+
+	for( int status = METRICS_STATUS_MIN; status <= METRICS_STATUS_MAX; status++ )
+	{
+		uint64_t count = metrics_sum( metrics, offsetof(metrics_worker_t, statuses) + (status - METRICS_STATUS_MIN) * sizeof(metrics_counter_t) );
+
+		if( count > 0 )
+		{
+			result &= response_printf( response, "host_this_requests_total{status=\"%d\"} %lu\n", status, count );
+		}
+	}
+
+	result &= response_printf( response, "# HELP host_this_sent_bytes_total Response body bytes sent.\n" );
+	result &= response_printf( response, "# TYPE host_this_sent_bytes_total counter\n" );
+	result &= response_printf( response, "host_this_sent_bytes_total %lu\n", metrics_sum( metrics, offsetof(metrics_worker_t, bytes) ) );
+
+	result &= response_printf( response, "# HELP host_this_cache_lookups_total Cache lookups, by cache and result.\n" );
+	result &= response_printf( response, "# TYPE host_this_cache_lookups_total counter\n" );
+
+	for( int cache = 0; cache < METRICS_CACHE_COUNT; cache++ )
+	{
+		uint64_t hits   = metrics_sum( metrics, offsetof(metrics_worker_t, cache_hits) + cache * sizeof(metrics_counter_t) );
+		uint64_t misses = metrics_sum( metrics, offsetof(metrics_worker_t, cache_misses) + cache * sizeof(metrics_counter_t) );
+
+		result &= response_printf( response, "host_this_cache_lookups_total{cache=\"%s\",result=\"hit\"} %lu\n", METRICS_CACHE_NAMES[ cache ], hits );
+		result &= response_printf( response, "host_this_cache_lookups_total{cache=\"%s\",result=\"miss\"} %lu\n", METRICS_CACHE_NAMES[ cache ], misses );
+	}
+
+	result &= response_printf( response, "# HELP host_this_phase_duration_seconds Time spent in each phase of serving a request.\n" );
+	result &= response_printf( response, "# TYPE host_this_phase_duration_seconds histogram\n" );
+
+	for( int phase = 0; phase < METRICS_PHASE_COUNT; phase++ )
+	{
+		size_t histogram = offsetof(metrics_worker_t, phases) + phase * sizeof(metrics_histogram_t);
+		const char* name = METRICS_PHASE_NAMES[ phase ];
+		uint64_t count = 0;
+
+		for( size_t bucket = 0; bucket <= METRICS_BUCKETS_COUNT; bucket++ )
+		{
+			count += metrics_sum( metrics, histogram + offsetof(metrics_histogram_t, buckets) + bucket * sizeof(metrics_counter_t) );
+
+			if( bucket < METRICS_BUCKETS_COUNT )
+			{
+				result &= response_printf( response, "host_this_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n", name, METRICS_BUCKETS[ bucket ] / 1e6, count );
+			}
+			else
+			{
+				result &= response_printf( response, "host_this_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", name, count );
+			}
+		}
+
+		uint64_t sum = metrics_sum( metrics, histogram + offsetof(metrics_histogram_t, sum) );
+		result &= response_printf( response, "host_this_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n", name, sum / 1e6 );
+		result &= response_printf( response, "host_this_phase_duration_seconds_count{phase=\"%s\"} %lu\n", name, count );
+	}
+
+	return result;
+}
+
+/* Only the owning worker writes, so a load and a store suffice. */
+void metrics_add( metrics_counter_t* counter, uint64_t amount )
+{
+	atomic_store_explicit( counter, atomic_load_explicit( counter, memory_order_relaxed ) + amount, memory_order_relaxed );
+}
+
+/* Adds up the counter at the offset in every worker's slot. */
+uint64_t metrics_sum( const metrics_t* metrics, size_t offset )
+{
+	uint64_t total = 0;
+
+	for( int i = 0; i < metrics->workers_count; i++ )
+	{
+		metrics_counter_t* counter = (metrics_counter_t*) ((char*) &metrics->workers[ i ] + offset);
+		total += atomic_load_explicit( counter, memory_order_relaxed );
+	}
+
+	return total;
+}
+
+/*
+ * The kernel only counts accept queue overflows per host, as
+ * ListenOverflows in the TcpExt section of /proc/net/netstat.
+ */
+uint64_t listen_overflows( void )
+{
+	FILE* netstat = fopen( "/proc/net/netstat", "r" );
+	char names[ 4096 ];
+	char values[ 4096 ];
+	uint64_t overflows = 0;
+
+	if( !netstat )
+	{
+		return 0;
+	}
+
+	while( fgets( names, sizeof(names), netstat ) && fgets( values, sizeof(values), netstat ) )
+	{
+		if( strncmp( names, "TcpExt:", 7 ) != 0 )
+		{
+			continue;
+		}
+
+		char* name_state  = NULL;
+		char* value_state = NULL;
+		char* name  = strtok_r( names, " \n", &name_state );
+		char* value = strtok_r( values, " \n", &value_state );
+
+		while( name && value )
+		{
+			if( strcmp( name, "ListenOverflows" ) == 0 )
+			{
+				overflows = strtoull( value, NULL, 10 );
+				break;
+			}
+
+			name  = strtok_r( NULL, " \n", &name_state );
+			value = strtok_r( NULL, " \n", &value_state );
+		}
+		break;
+	}
+
+	fclose( netstat );
+	return overflows;
+}
@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "response.h"
+#include "server.h"
+
+/*
+ * Counters and latency histograms kept per worker. A worker only
+ * ever writes its own slot with plain relaxed stores, so recording
+ * takes no locks and no atomic read-modify-writes; the slots are
+ * summed when the metrics are scraped. All recording functions
+ * accept a NULL metrics, which is how they are turned off.
+ */
+typedef enum metrics_phase {
+	METRICS_PHASE_PARSE,     /* first byte of the request until its head is parsed */
+	METRICS_PHASE_ENUMERATE, /* reading a directory and stat'ing its entries */
+	METRICS_PHASE_RENDER,    /* formatting a listing */
+	METRICS_PHASE_TRANSFER,  /* first byte of the response until the last */
+	METRICS_PHASE_COUNT
+} metrics_phase_t;
+
+typedef enum metrics_cache {
+	METRICS_CACHE_LISTING,
+	METRICS_CACHE_FILE,
+	METRICS_CACHE_CONTENT,
+	METRICS_CACHE_COUNT
+} metrics_cache_t;
+
+struct metrics;
+typedef struct metrics metrics_t;
+
+metrics_t* metrics_create            ( int workers );
+void       metrics_destroy           ( metrics_t** metrics );
+void       metrics_connection_opened ( metrics_t* metrics, int worker );
+void       metrics_connection_closed ( metrics_t* metrics, int worker );
+void       metrics_request           ( metrics_t* metrics, int worker, int status, int64_t bytes );
+void       metrics_observe           ( metrics_t* metrics, int worker, metrics_phase_t phase, int64_t microseconds );
+void       metrics_cache             ( metrics_t* metrics, int worker, metrics_cache_t cache, bool hit );
+bool       metrics_render            ( metrics_t* metrics, server_t* server, response_t* response );
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,321 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "progress.h"
+
+#define PROGRESS_SLOTS      256  /* transfers tracked at once; the rest are not shown */
+#define PROGRESS_MAX_ROWS   8    /* transfers drawn; the rest are summarized */
+#define PROGRESS_SMOOTHING  0.3  /* weight of the newest rate sample */
+
+struct progress_transfer {
+	_Atomic int64_t sent;  /* the only field workers touch after progress_begin() */
+	int64_t total;         /* -1 when the length is not known */
+	bool in_use;
+	char peer[ 46 ];
+	char name[ 48 ];
+	/* reporter only */
+	int64_t sampled;
+	double rate;           /* bytes per second, smoothed */
+};
+
+/* A transfer as sampled for one redraw. */
+typedef struct progress_row {
+	char peer[ 46 ];
+	char name[ 48 ];
+	int64_t sent;
+	int64_t total;
+	double rate;
+} progress_row_t;
+
+struct progress {
+	pthread_t thread;
+	pthread_mutex_t lock;  /* guards slots being claimed and released */
+	pthread_cond_t stop_signal;
+	bool stop;
+	int refresh_ms;
+	int lines_drawn;       /* guarded by the stdout lock */
+	progress_transfer_t slots[ PROGRESS_SLOTS ];
+};
+
+static void* progress_run     ( void* data );
+static void  progress_draw    ( progress_t* progress, double elapsed );  /* called with the lock held */
+static char* progress_size    ( char* buffer, size_t size, double bytes );
+
+
+/* Returns NULL when stdout is not a terminal; there is nothing to draw on. */
+progress_t* progress_create( int refresh_ms )
+{
+	progress_t* progress = NULL;
+
+	if( !isatty( STDOUT_FILENO ) )
+	{
+		return NULL;
+	}
+
+	progress = calloc( 1, sizeof(progress_t) );
+
+	if( progress )
+	{
+		progress->refresh_ms = refresh_ms;
+		pthread_mutex_init( &progress->lock, NULL );
+		pthread_cond_init( &progress->stop_signal, NULL );
+
+		if( pthread_create( &progress->thread, NULL, progress_run, progress ) != 0 )
+		{
+			fprintf( stderr, "ERROR: Unable to start the progress reporter.\n" );
+			pthread_cond_destroy( &progress->stop_signal );
+			pthread_mutex_destroy( &progress->lock );
+			free( progress );
+			progress = NULL;
+		}
+	}
+
+	return progress;
+}
+
+void progress_destroy( progress_t** progress )
+{
+	if( progress && *progress )
+	{
+		progress_t* p = *progress;
+
+		pthread_mutex_lock( &p->lock );
+		p->stop = true;
+		pthread_cond_signal( &p->stop_signal );
+		pthread_mutex_unlock( &p->lock );
+		pthread_join( p->thread, NULL );
+
+		pthread_cond_destroy( &p->stop_signal );
+		pthread_mutex_destroy( &p->lock );
+		free( p );
+		*progress = NULL;
+	}
+}
+
+progress_transfer_t* progress_begin( progress_t* progress, const char* peer, const char* name, int64_t total )
+{
+	progress_transfer_t* transfer = NULL;
+
+	if( !progress )
+	{
+		return NULL;
+	}
+
+	pthread_mutex_lock( &progress->lock );
+
+	for( size_t i = 0; i < PROGRESS_SLOTS; i++ )
+	{
+		if( !progress->slots[ i ].in_use )
+		{
+			transfer = &progress->slots[ i ];
+			transfer->in_use  = true;
+			transfer->total   = total;
+			transfer->sampled = 0;
+			transfer->rate    = 0.0;
+			atomic_store_explicit( &transfer->sent, 0, memory_order_relaxed );
+			snprintf( transfer->peer, sizeof(transfer->peer), "%s", peer );
+			snprintf( transfer->name, sizeof(transfer->name), "%s", name );
+			break;
+		}
+	}
+
+	pthread_mutex_unlock( &progress->lock );
+	return transfer;
+}
+
+/* Called from the send path; never blocks. */
+void progress_update( progress_transfer_t* transfer, int64_t sent )
+{
+	if( transfer )
+	{
+		atomic_store_explicit( &transfer->sent, sent, memory_order_relaxed );
+	}
+}
+
+void progress_end( progress_t* progress, progress_transfer_t* transfer )
+{
+	if( progress && transfer )
+	{
+		pthread_mutex_lock( &progress->lock );
+		transfer->in_use = false;
+		pthread_mutex_unlock( &progress->lock );
+	}
+}
+
+/*
+ * Removes the dashboard from the terminal so other output can take
+ * its place; it is redrawn below on the next refresh. The caller
+ * must hold the stdout lock (flockfile).
+ */
+void progress_erase( progress_t* progress )
+{
+	if( progress && progress->lines_drawn > 0 )
+	{
+		printf( "\033[%dA\033[J", progress->lines_drawn );
+		progress->lines_drawn = 0;
+	}
+}
+
+void* progress_run( void* data )
+{
+	progress_t* progress = (progress_t*) data;
+	struct timespec deadline;
+	struct timespec last;
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &last );
+	pthread_mutex_lock( &progress->lock );
+
+	while( !progress->stop )
+	{
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_nsec += (long) progress->refresh_ms * 1000000L;
+		deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while( !progress->stop && pthread_cond_timedwait( &progress->stop_signal, &progress->lock, &deadline ) != ETIMEDOUT )
+		{
+		}
+
+		if( !progress->stop )
+		{
+			clock_gettime( CLOCK_MONOTONIC, &now );
+			progress_draw( progress, (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9 );
+			last = now;
+		}
+	}
+
+	pthread_mutex_unlock( &progress->lock );
+	return NULL;
+}
+
+/*
+ * Samples the counters with the lock held, then draws without it
+ * so a slow terminal never holds up progress_begin()/progress_end().
+ */
+void progress_draw( progress_t* progress, double elapsed )
+{
+	progress_row_t rows[ PROGRESS_MAX_ROWS ];
+	int rows_count = 0;
+	int active = 0;
+	double total_rate = 0.0;
+
+	for( size_t i = 0; i < PROGRESS_SLOTS; i++ )
+	{
+		progress_transfer_t* transfer = &progress->slots[ i ];
+
+		if( !transfer->in_use )
+		{
+			continue;
+		}
+
+		int64_t sent = atomic_load_explicit( &transfer->sent, memory_order_relaxed );
+		double sample = (sent - transfer->sampled) / elapsed;
+
+		transfer->rate    = transfer->sampled == 0 && transfer->rate == 0.0 ? sample : PROGRESS_SMOOTHING * sample + (1.0 - PROGRESS_SMOOTHING) * transfer->rate;
+		transfer->sampled = sent;
+		total_rate += transfer->rate;
+		active     += 1;
+
+		if( rows_count < PROGRESS_MAX_ROWS )
+		{
+			progress_row_t* row = &rows[ rows_count++ ];
+			memcpy( row->peer, transfer->peer, sizeof(row->peer) );
+			memcpy( row->name, transfer->name, sizeof(row->name) );
+			row->sent  = sent;
+			row->total = transfer->total;
+			row->rate  = transfer->rate;
+		}
+	}
+
+	pthread_mutex_unlock( &progress->lock );
+	flockfile( stdout );
+	progress_erase( progress );
+
+	for( int i = 0; i < rows_count; i++ )
+	{
+		const progress_row_t* row = &rows[ i ];
+		char sent_str[ 16 ];
+		char rate_str[ 16 ];
+
+		printf( "\033[2K %-22.22s %-32.32s %9s", row->peer, row->name, progress_size( sent_str, sizeof(sent_str), row->sent ) );
+
+		if( row->total > 0 )
+		{
+			printf( " %3d%%", (int) (100 * row->sent / row->total) );
+		}
+		else
+		{
+			printf( "     " );
+		}
+
+		printf( " %9s/s", progress_size( rate_str, sizeof(rate_str), row->rate ) );
+
+		if( row->total > 0 && row->rate >= 1.0 )
+		{
+			int64_t eta = (int64_t) ((row->total - row->sent) / row->rate);
+			printf( "  ETA %ld:%02ld", eta / 60, eta % 60 );
+		}
+
+		printf( "\n" );
+	}
+
+	if( active > 0 )
+	{
+		char rate_str[ 16 ];
+
+		printf( "\033[2K %d transfer%s", active, active == 1 ? "" : "s" );
+		if( active > rows_count )
+		{
+			printf( " (%d not shown)", active - rows_count );
+		}
+		printf( ", %s/s\n", progress_size( rate_str, sizeof(rate_str), total_rate ) );
+	}
+
+	progress->lines_drawn = rows_count + (active > 0 ? 1 : 0);
+	fflush( stdout );
+	funlockfile( stdout );
+	pthread_mutex_lock( &progress->lock );
+}
+
+char* progress_size( char* buffer, size_t size, double bytes )
+{
+	static const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+	size_t unit = 0;
+
+	while( bytes >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0]) )
+	{
+		bytes /= 1024.0;
+		unit  += 1;
+	}
+
+	snprintf( buffer, size, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[ unit ] );
+	return buffer;
+}
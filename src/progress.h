@@ -0,0 +1,47 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A terminal dashboard of the transfers in flight. Workers only
+ * store a byte count per transfer; a reporter thread samples the
+ * counts and redraws at a fixed rate, so a slow terminal never
+ * holds up a send. All functions accept a NULL progress, which
+ * is how headless mode turns reporting off.
+ */
+struct progress;
+typedef struct progress progress_t;
+
+struct progress_transfer;
+typedef struct progress_transfer progress_transfer_t;
+
+progress_t*          progress_create  ( int refresh_ms );
+void                 progress_destroy ( progress_t** progress );
+progress_transfer_t* progress_begin   ( progress_t* progress, const char* peer, const char* name, int64_t total );
+void                 progress_update  ( progress_transfer_t* transfer, int64_t sent );
+void                 progress_end     ( progress_t* progress, progress_transfer_t* transfer );
+void                 progress_erase   ( progress_t* progress );
+
+#endif /* __PROGRESS_H__ */
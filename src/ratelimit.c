@@ -0,0 +1,287 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <xtd/string.h>
+#include "ratelimit.h"
+
+#define RATELIMIT_CLIENT_BUCKETS  256
+#define RATELIMIT_BURST           10          /* a tenth of a second's worth of tokens */
+#define RATELIMIT_MIN_BURST       (16 * 1024)
+#define RATELIMIT_QUANTUM         (16 * 1024) /* smallest send worth waking up for */
+
+struct ratelimit_client {
+	char address[ 46 ];
+	size_t hash;
+	int connections;            /* sharing the bucket */
+	ratelimit_bucket_t bucket;
+	struct ratelimit_client* next;
+};
+
+struct ratelimit {
+	pthread_mutex_t lock;       /* guards the shared buckets and the clients */
+	ratelimit_bucket_t bucket;  /* for the whole server */
+	int64_t client_rate;
+	int64_t connection_rate;
+	int connections;
+	ratelimit_client_t* clients[ RATELIMIT_CLIENT_BUCKETS ];
+};
+
+static void    ratelimit_bucket_init   ( ratelimit_bucket_t* bucket, int64_t rate, int64_t now );
+static void    ratelimit_bucket_refill ( ratelimit_bucket_t* bucket, int64_t now );
+static int64_t ratelimit_bucket_allow  ( ratelimit_bucket_t* bucket, int sharers, int64_t* wait );
+static int64_t ratelimit_now           ( void );
+
+
+/* A rate of 0 leaves that level unlimited. */
+ratelimit_t* ratelimit_create( int64_t rate, int64_t client_rate, int64_t connection_rate )
+{
+	ratelimit_t* limiter = calloc( 1, sizeof(ratelimit_t) );
+
+	if( limiter )
+	{
+		pthread_mutex_init( &limiter->lock, NULL );
+		ratelimit_bucket_init( &limiter->bucket, rate, ratelimit_now() );
+		limiter->client_rate     = client_rate;
+		limiter->connection_rate = connection_rate;
+		limiter->connections     = 0;
+	}
+
+	return limiter;
+}
+
+void ratelimit_destroy( ratelimit_t** limiter )
+{
+	if( limiter && *limiter )
+	{
+		ratelimit_t* l = *limiter;
+
+		for( size_t i = 0; i < RATELIMIT_CLIENT_BUCKETS; i++ )
+		{
+			while( l->clients[ i ] )
+			{
+				ratelimit_client_t* client = l->clients[ i ];
+				l->clients[ i ] = client->next;
+				free( client );
+			}
+		}
+
+		pthread_mutex_destroy( &l->lock );
+		free( l );
+		*limiter = NULL;
+	}
+}
+
+/*
+ * Counts a new connection from address and sets up its own
+ * bucket. Connections from one address share a client, which
+ * lives until the last of them is closed.
+ */
+ratelimit_client_t* ratelimit_open( ratelimit_t* limiter, const char* address, ratelimit_bucket_t* connection )
+{
+	int64_t now = ratelimit_now();
+	size_t hash = string_hash( address );
+	ratelimit_client_t* client = NULL;
+
+	ratelimit_bucket_init( connection, limiter->connection_rate, now );
+
+	pthread_mutex_lock( &limiter->lock );
+	ratelimit_client_t** link = &limiter->clients[ hash % RATELIMIT_CLIENT_BUCKETS ];
+
+	for( client = *link; client; client = client->next )
+	{
+		if( client->hash == hash && strcmp( client->address, address ) == 0 )
+		{
+			break;
+		}
+	}
+
+	if( !client && (client = malloc( sizeof(ratelimit_client_t) )) )
+	{
+		snprintf( client->address, sizeof(client->address), "%s", address );
+		client->hash        = hash;
+		client->connections = 0;
+		ratelimit_bucket_init( &client->bucket, limiter->client_rate, now );
+		client->next = *link;
+		*link = client;
+	}
+
+	if( client )
+	{
+		client->connections += 1;
+		limiter->connections += 1;
+	}
+	pthread_mutex_unlock( &limiter->lock );
+
+	return client;
+}
+
+void ratelimit_close( ratelimit_t* limiter, ratelimit_client_t* client )
+{
+	if( !client )
+	{
+		return;
+	}
+
+	pthread_mutex_lock( &limiter->lock );
+	limiter->connections -= 1;
+
+	if( --client->connections == 0 )
+	{
+		ratelimit_client_t** link = &limiter->clients[ client->hash % RATELIMIT_CLIENT_BUCKETS ];
+
+		while( *link != client )
+		{
+			link = &(*link)->next;
+		}
+
+		*link = client->next;
+		free( client );
+	}
+	pthread_mutex_unlock( &limiter->lock );
+}
+
+/*
+ * How many bytes the connection may send now, or 0 when it must
+ * wait; delay is then set to the milliseconds until enough
+ * tokens will have built up. A shared bucket only hands each
+ * connection its share of a burst at a time.
+ */
+int64_t ratelimit_allow( ratelimit_t* limiter, ratelimit_client_t* client, ratelimit_bucket_t* connection, int* delay )
+{
+	int64_t now  = ratelimit_now();
+	int64_t wait = 0;
+	int64_t allowed;
+
+	ratelimit_bucket_refill( connection, now );
+	allowed = ratelimit_bucket_allow( connection, 1, &wait );
+
+	if( client && (limiter->bucket.rate > 0 || client->bucket.rate > 0) )
+	{
+		pthread_mutex_lock( &limiter->lock );
+		ratelimit_bucket_refill( &limiter->bucket, now );
+		ratelimit_bucket_refill( &client->bucket, now );
+
+		int64_t shared = ratelimit_bucket_allow( &limiter->bucket, limiter->connections, &wait );
+		int64_t own    = ratelimit_bucket_allow( &client->bucket, client->connections, &wait );
+		pthread_mutex_unlock( &limiter->lock );
+
+		allowed = shared < allowed ? shared : allowed;
+		allowed = own < allowed ? own : allowed;
+	}
+
+	if( wait > 0 )
+	{
+		*delay = (int) ((wait + 999) / 1000);
+		return 0;
+	}
+
+	*delay = 0;
+	return allowed;
+}
+
+/* Takes what was actually sent out of every bucket. */
+void ratelimit_spend( ratelimit_t* limiter, ratelimit_client_t* client, ratelimit_bucket_t* connection, int64_t bytes )
+{
+	if( bytes <= 0 )
+	{
+		return;
+	}
+
+	if( connection->rate > 0 )
+	{
+		connection->tokens -= bytes;
+	}
+
+	if( client && (limiter->bucket.rate > 0 || client->bucket.rate > 0) )
+	{
+		pthread_mutex_lock( &limiter->lock );
+		if( limiter->bucket.rate > 0 ) limiter->bucket.tokens -= bytes;
+		if( client->bucket.rate > 0 ) client->bucket.tokens -= bytes;
+		pthread_mutex_unlock( &limiter->lock );
+	}
+}
+
+void ratelimit_bucket_init( ratelimit_bucket_t* bucket, int64_t rate, int64_t now )
+{
+	bucket->rate    = rate > 0 ? rate : 0;
+	bucket->burst   = bucket->rate / RATELIMIT_BURST > RATELIMIT_MIN_BURST ? bucket->rate / RATELIMIT_BURST : RATELIMIT_MIN_BURST;
+	bucket->tokens  = bucket->burst;
+	bucket->updated = now;
+}
+
+void ratelimit_bucket_refill( ratelimit_bucket_t* bucket, int64_t now )
+{
+	int64_t added = bucket->rate * (now - bucket->updated) / 1000000;
+
+	/* Leave the clock alone until a whole token is due, or slow rates would never refill. */
+	if( added > 0 )
+	{
+		bucket->tokens  = bucket->tokens + added < bucket->burst ? bucket->tokens + added : bucket->burst;
+		bucket->updated = now;
+	}
+}
+
+/*
+ * What one of sharers may take from the bucket now. When less
+ * than a worthwhile send is available, wait is raised to the
+ * microseconds until there will be.
+ */
+int64_t ratelimit_bucket_allow( ratelimit_bucket_t* bucket, int sharers, int64_t* wait )
+{
+	if( bucket->rate <= 0 )
+	{
+		return INT64_MAX;
+	}
+
+	int64_t share  = bucket->burst / (sharers > 1 ? sharers : 1);
+	int64_t needed = share < RATELIMIT_QUANTUM ? share : RATELIMIT_QUANTUM;
+
+	if( needed < 1 )
+	{
+		needed = 1;
+	}
+
+	if( bucket->tokens < needed )
+	{
+		int64_t until = (needed - bucket->tokens) * 1000000 / bucket->rate + 1;
+
+		if( until > *wait )
+		{
+			*wait = until;
+		}
+		return 0;
+	}
+
+	return bucket->tokens < share ? bucket->tokens : (share > needed ? share : needed);
+}
+
+int64_t ratelimit_now( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
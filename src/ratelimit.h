@@ -0,0 +1,54 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Token buckets that cap the bytes sent per second by the whole
+ * server, by each client address and by each connection. A
+ * sender asks how much it may write now; the shared buckets are
+ * split between the connections drawing on them, so a fast
+ * client cannot take more than its share while others wait.
+ */
+struct ratelimit;
+typedef struct ratelimit ratelimit_t;
+
+struct ratelimit_client;
+typedef struct ratelimit_client ratelimit_client_t;
+
+typedef struct ratelimit_bucket {
+	int64_t rate;    /* bytes per second, or 0 for no limit */
+	int64_t burst;   /* most tokens that can build up */
+	int64_t tokens;  /* may go negative when a send overdraws */
+	int64_t updated; /* microseconds */
+} ratelimit_bucket_t;
+
+ratelimit_t*        ratelimit_create  ( int64_t rate, int64_t client_rate, int64_t connection_rate );
+void                ratelimit_destroy ( ratelimit_t** limiter );
+ratelimit_client_t* ratelimit_open    ( ratelimit_t* limiter, const char* address, ratelimit_bucket_t* connection );
+void                ratelimit_close   ( ratelimit_t* limiter, ratelimit_client_t* client );
+int64_t             ratelimit_allow   ( ratelimit_t* limiter, ratelimit_client_t* client, ratelimit_bucket_t* connection, int* delay );
+void                ratelimit_spend   ( ratelimit_t* limiter, ratelimit_client_t* client, ratelimit_bucket_t* connection, int64_t bytes );
+
+#endif /* __RATELIMIT_H__ */
@@ -0,0 +1,747 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <collections/vector.h>
+#include "response.h"
+
+/*
+ * Upper bound for a single sendfile()/splice() call. The
+ * socket is non-blocking, so a call only ever moves what
+ * fits in the send buffer; this just keeps counts sane.
+ */
+#define RESPONSE_FILE_CHUNK   (16 * 1024 * 1024)
+#define RESPONSE_PIPE_SIZE    (1024 * 1024)
+#define RESPONSE_MAX_IOVECS   16 /* memory gathered into one write */
+
+static void              response_queue_text  ( response_t* response, size_t offset );
+static response_status_t response_send_queued ( response_t* response, int socket );
+static bool              response_produce     ( response_t* response );
+static response_status_t response_send_memory ( response_t* response, int socket );
+static void              response_cork        ( response_t* response, int socket, bool cork );
+static size_t            response_allowance   ( const response_t* response, size_t wanted );
+static void              response_spend       ( response_t* response, size_t sent );
+static response_status_t response_send_file   ( response_t* response, response_segment_t* segment, int socket );
+static response_status_t response_splice_file ( response_t* response, response_segment_t* segment, int socket );
+
+
+/* Text is kept in the arena when one is given. */
+void response_create( response_t* response, arena_t* arena )
+{
+	textbuffer_create( &response->headers, arena );
+	textbuffer_create( &response->body, arena );
+	response->segments = NULL;
+	response->encoder  = NULL;
+	lc_vector_create( response->segments, 4 );
+	response->pipe[ 0 ] = -1;
+	response->pipe[ 1 ] = -1;
+	response_reset( response );
+}
+
+void response_destroy( response_t* response )
+{
+	if( response )
+	{
+		textbuffer_destroy( &response->headers );
+		textbuffer_destroy( &response->body );
+		lc_vector_destroy( response->segments );
+		encoder_destroy( &response->encoder );
+
+		if( response->pipe[ 0 ] >= 0 )
+		{
+			close( response->pipe[ 0 ] );
+			close( response->pipe[ 1 ] );
+			response->pipe[ 0 ] = -1;
+			response->pipe[ 1 ] = -1;
+		}
+	}
+}
+
+void response_reset( response_t* response )
+{
+	response->headers.count  = 0;
+	response->body.count     = 0;
+	response->headers_sent   = 0;
+	response->segment        = 0;
+	response->segment_sent   = 0;
+	response->bytes_sent     = 0;
+	response->use_splice     = false;
+	response->pipe_pending   = 0;
+	response->corked         = false;
+	response->producer       = NULL;
+	response->producer_data  = NULL;
+	response->encode         = false;
+	response->budget         = -1;
+	lc_vector_clear( response->segments );
+}
+
+/*
+ * Resets the response and drops its text, so that the arena
+ * holding it can be reset for the next request.
+ */
+void response_release( response_t* response )
+{
+	response_reset( response );
+	textbuffer_release( &response->headers );
+	textbuffer_release( &response->body );
+}
+
+bool response_printf( response_t* response, const char* format, ... )
+{
+	bool result = false;
+	va_list args;
+
+	va_start( args, format );
+	result = response_vprintf( response, format, args );
+	va_end( args );
+
+	return result;
+}
+
+bool response_vprintf( response_t* response, const char* format, va_list args )
+{
+	size_t offset = response->body.count;
+	bool result = textbuffer_vprintf( &response->body, format, args );
+
+	response_queue_text( response, offset );
+	return result;
+}
+
+/* Copies raw bytes into the body. */
+bool response_write( response_t* response, const void* data, size_t length )
+{
+	char* text = response_reserve( response, length );
+
+	if( !text )
+	{
+		return false;
+	}
+
+	memcpy( text, data, length );
+	response_commit( response, length );
+	return true;
+}
+
+bool response_append_int( response_t* response, int64_t value )
+{
+	size_t offset = response->body.count;
+	bool result = textbuffer_append_int( &response->body, value );
+
+	response_queue_text( response, offset );
+	return result;
+}
+
+/* Queues text escaped for HTML. */
+bool response_append_html( response_t* response, const char* text, size_t length )
+{
+	size_t offset = response->body.count;
+	bool result = textbuffer_append_html( &response->body, text, length );
+
+	response_queue_text( response, offset );
+	return result;
+}
+
+/* Queues a path percent-encoded for use in a link. */
+bool response_append_url( response_t* response, const char* text, size_t length )
+{
+	size_t offset = response->body.count;
+	bool result = textbuffer_append_url( &response->body, text, length );
+
+	response_queue_text( response, offset );
+	return result;
+}
+
+/*
+ * Room for length more bytes at the end of the body, e.g. to
+ * read() into; response_commit() queues what was written.
+ */
+char* response_reserve( response_t* response, size_t length )
+{
+	return textbuffer_reserve( &response->body, length );
+}
+
+void response_commit( response_t* response, size_t length )
+{
+	size_t offset = response->body.count;
+
+	response->body.count += length;
+	response_queue_text( response, offset );
+}
+
+/* Queues the body text written since offset. */
+void response_queue_text( response_t* response, size_t offset )
+{
+	int64_t length = response->body.count - offset;
+
+	if( length > 0 )
+	{
+		/* Consecutive text is kept in a single segment. */
+		size_t count = lc_vector_size( response->segments );
+		response_segment_t* last = count > 0 ? &response->segments[ count - 1 ] : NULL;
+
+		if( last && last->file < 0 && !last->data && last->offset + last->length == offset )
+		{
+			last->length += length;
+		}
+		else
+		{
+			response_segment_t segment = { .file = -1, .data = NULL, .offset = offset, .length = length };
+			lc_vector_push( response->segments, segment );
+		}
+	}
+}
+
+void response_add_data( response_t* response, const char* data, int64_t length )
+{
+	if( length > 0 )
+	{
+		response_segment_t segment = { .file = -1, .data = data, .offset = 0, .length = length };
+		lc_vector_push( response->segments, segment );
+	}
+}
+
+void response_add_file( response_t* response, int file, int64_t offset, int64_t length )
+{
+	if( length > 0 )
+	{
+		response_segment_t segment = { .file = file, .data = NULL, .offset = offset, .length = length };
+		lc_vector_push( response->segments, segment );
+	}
+}
+
+/*
+ * Sends the body with the chunked transfer coding, asking the
+ * producer for more each time the queue drains. The caller adds
+ * the "Transfer-Encoding: chunked" header and queues no body.
+ */
+void response_stream( response_t* response, response_producer_fxn_t producer, void* user_data )
+{
+	response->producer      = producer;
+	response->producer_data = user_data;
+}
+
+/*
+ * Compresses a streamed body. The producer must only queue text,
+ * and the caller adds the Content-Encoding header.
+ */
+bool response_encode( response_t* response, encoding_t encoding )
+{
+	if( response->encoder && encoder_encoding( response->encoder ) != encoding )
+	{
+		encoder_destroy( &response->encoder );
+	}
+
+	if( response->encoder )
+	{
+		response->encode = encoder_reset( response->encoder );
+	}
+	else
+	{
+		response->encoder = encoder_create( encoding );
+		response->encode  = response->encoder != NULL;
+	}
+
+	return response->encode;
+}
+
+/*
+ * Compresses the queued body in one go, for bodies that are
+ * sent with a Content-Length. It must not contain file ranges.
+ */
+bool response_encode_body( response_t* response, encoding_t encoding )
+{
+	size_t count = lc_vector_size( response->segments );
+	size_t encoded_length = 0;
+
+	if( !response_encode( response, encoding ) )
+	{
+		return false;
+	}
+
+	response->encode = false;
+
+	for( size_t i = 0; i < count || i == 0; i++ )
+	{
+		const response_segment_t* segment = i < count ? &response->segments[ i ] : NULL;
+		const char* memory = segment && segment->data ? segment->data : (const char*) response->body.data;
+
+		if( segment && segment->file >= 0 )
+		{
+			return false;
+		}
+
+		if( !encoder_encode( response->encoder, segment ? memory + segment->offset : "", segment ? segment->length : 0, i + 1 >= count ) )
+		{
+			return false;
+		}
+	}
+
+	const char* encoded = encoder_output( response->encoder, &encoded_length );
+
+	response->body.count = 0;
+	lc_vector_clear( response->segments );
+	response_add_data( response, encoded, encoded_length );
+	return true;
+}
+
+/* Drops the queued body but keeps the headers, e.g. for HEAD. */
+void response_clear_body( response_t* response )
+{
+	response->body.count = 0;
+	response->producer   = NULL;
+	lc_vector_clear( response->segments );
+}
+
+int64_t response_length( const response_t* response )
+{
+	int64_t length = 0;
+
+	for( size_t i = 0; i < lc_vector_size(response->segments); i++ )
+	{
+		length += response->segments[ i ].length;
+	}
+
+	return length;
+}
+
+response_status_t response_send( response_t* response, int socket )
+{
+	for( ;; )
+	{
+		response_status_t status = response_send_queued( response, socket );
+
+		if( status != RESPONSE_DONE || !response->producer )
+		{
+			if( status != RESPONSE_PENDING && response->corked )
+			{
+				/* Push out whatever the cork is holding. */
+				response_cork( response, socket, false );
+			}
+			return status;
+		}
+
+		if( !response_produce( response ) )
+		{
+			return RESPONSE_ERROR;
+		}
+
+		if( response->producer && response->body.count == 0 )
+		{
+			/* The producer worked without queueing anything yet; let others run. */
+			if( response->corked )
+			{
+				response_cork( response, socket, false );
+			}
+			return RESPONSE_LIMITED;
+		}
+	}
+}
+
+/*
+ * Headers and text segments go out together with one gathering
+ * write; file segments go out with sendfile().
+ */
+response_status_t response_send_queued( response_t* response, int socket )
+{
+	for( ;; )
+	{
+		bool headers_pending = response->headers_sent < response->headers.count;
+		response_status_t status;
+
+		if( !headers_pending && response->segment >= lc_vector_size(response->segments) )
+		{
+			return RESPONSE_DONE;
+		}
+
+		if( headers_pending || response->segments[ response->segment ].file < 0 )
+		{
+			status = response_send_memory( response, socket );
+		}
+		else
+		{
+			/*
+			 * sendfile() pushes out its last partial packet; when text
+			 * follows (multipart ranges, chunks) the cork joins them.
+			 */
+			if( !response->corked && (response->segment + 1 < lc_vector_size(response->segments) || response->producer) )
+			{
+				response_cork( response, socket, true );
+			}
+
+			status = response_send_file( response, &response->segments[ response->segment ], socket );
+
+			if( status == RESPONSE_DONE )
+			{
+				response->segment      += 1;
+				response->segment_sent  = 0;
+			}
+		}
+
+		if( status != RESPONSE_DONE )
+		{
+			return status;
+		}
+	}
+}
+
+/*
+ * Replaces the sent queue with the next chunk from the producer,
+ * followed by the last chunk once the producer is finished.
+ * False when the producer failed or the chunk could not be encoded.
+ */
+bool response_produce( response_t* response )
+{
+	response->body.count    = 0;
+	response->segment       = 0;
+	response->segment_sent  = 0;
+	lc_vector_clear( response->segments );
+
+	/* The chunk size is written over this placeholder once it is known. */
+	response_printf( response, "%08x\r\n", 0 );
+
+	int64_t header_length = response->body.count;
+	response_produced_t produced = response->producer( response, response->producer_data );
+	bool more = produced == RESPONSE_PRODUCED_MORE;
+
+	if( produced == RESPONSE_PRODUCED_ERROR )
+	{
+		/* No last chunk; the connection is dropped mid-body. */
+		response->producer = NULL;
+		return false;
+	}
+
+	if( response->encode )
+	{
+		/* Swap the produced text for its compressed form. */
+		const char* text = (const char*) response->body.data + header_length;
+		size_t encoded_length = 0;
+
+		encoder_discard( response->encoder );
+
+		if( !encoder_encode( response->encoder, text, response->body.count - header_length, !more ) )
+		{
+			return false;
+		}
+
+		const char* encoded = encoder_output( response->encoder, &encoded_length );
+
+		response->body.count = header_length;
+		lc_vector_clear( response->segments );
+		response_queue_text( response, 0 );
+		response_add_data( response, encoded, encoded_length );
+	}
+
+	int64_t length = response_length( response ) - header_length;
+
+	if( length > 0 )
+	{
+		char size[ 9 ];
+		snprintf( size, sizeof(size), "%08x", (unsigned int) length );
+		memcpy( response->body.data, size, 8 );
+		response_printf( response, "\r\n" );
+	}
+	else
+	{
+		response->body.count = 0;
+		lc_vector_clear( response->segments );
+	}
+
+	if( !more )
+	{
+		response_printf( response, "0\r\n\r\n" );
+		response->producer = NULL;
+	}
+
+	return true;
+}
+
+/*
+ * Writes what is left of the headers and the text segments that
+ * follow them, up to the next file segment, with one sendmsg().
+ * Returns RESPONSE_DONE once that write went out whole.
+ */
+response_status_t response_send_memory( response_t* response, int socket )
+{
+	struct iovec iovecs[ RESPONSE_MAX_IOVECS ];
+	size_t count = 0;
+	size_t segment = response->segment;
+	int64_t skip = response->segment_sent;
+
+	if( response->headers_sent < response->headers.count )
+	{
+		iovecs[ count++ ] = textbuffer_iovec( &response->headers, response->headers_sent );
+	}
+
+	while( count < RESPONSE_MAX_IOVECS && segment < lc_vector_size(response->segments) && response->segments[ segment ].file < 0 )
+	{
+		const response_segment_t* s = &response->segments[ segment ];
+		const char* memory = s->data ? s->data : (const char*) response->body.data;
+
+		if( s->length > skip )
+		{
+			iovecs[ count ].iov_base = (char*) memory + s->offset + skip;
+			iovecs[ count ].iov_len  = s->length - skip;
+			count += 1;
+		}
+
+		segment += 1;
+		skip = 0;
+	}
+
+	/* Hold back the tail when a file or another chunk follows straight away. */
+	bool more = segment < lc_vector_size(response->segments) || response->producer;
+	size_t total = 0;
+
+	for( size_t i = 0; i < count; i++ )
+	{
+		total += iovecs[ i ].iov_len;
+	}
+
+	if( response->budget == 0 )
+	{
+		return RESPONSE_LIMITED;
+	}
+	else if( response_allowance( response, total ) < total )
+	{
+		/* Trim the write to the budget; what is held back waits, so don't cork it. */
+		size_t allowed = response_allowance( response, total );
+
+		for( count = 0; allowed > 0; count++ )
+		{
+			if( iovecs[ count ].iov_len > allowed )
+			{
+				iovecs[ count ].iov_len = allowed;
+			}
+			allowed -= iovecs[ count ].iov_len;
+		}
+		more = false;
+	}
+
+	struct msghdr message = { .msg_iov = iovecs, .msg_iovlen = count };
+	ssize_t result;
+
+	do
+	{
+		result = sendmsg( socket, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0) );
+	} while( result < 0 && errno == EINTR );
+
+	if( result < 0 )
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK ? RESPONSE_PENDING : RESPONSE_ERROR;
+	}
+
+	response_spend( response, result );
+
+	/* Credit what was written to the headers, then to the segments in order. */
+	size_t written = result;
+	size_t headers_left = response->headers.count - response->headers_sent;
+	size_t to_headers = written < headers_left ? written : headers_left;
+
+	response->headers_sent += to_headers;
+	written -= to_headers;
+
+	while( response->segment < segment )
+	{
+		response_segment_t* s = &response->segments[ response->segment ];
+		int64_t left = s->length - response->segment_sent;
+		int64_t taken = (int64_t) written < left ? (int64_t) written : left;
+
+		response->segment_sent += taken;
+		response->bytes_sent   += taken;
+		written -= taken;
+
+		if( response->segment_sent < s->length )
+		{
+			break;
+		}
+
+		response->segment      += 1;
+		response->segment_sent  = 0;
+	}
+
+	return RESPONSE_DONE;
+}
+
+/* How much of wanted the budget lets through. */
+size_t response_allowance( const response_t* response, size_t wanted )
+{
+	return response->budget >= 0 && (uint64_t) response->budget < wanted ? (size_t) response->budget : wanted;
+}
+
+void response_spend( response_t* response, size_t sent )
+{
+	if( response->budget > 0 )
+	{
+		response->budget -= (int64_t) sent < response->budget ? (int64_t) sent : response->budget;
+	}
+}
+
+void response_cork( response_t* response, int socket, bool cork )
+{
+	int option_cork = cork ? 1 : 0;
+	setsockopt( socket, IPPROTO_TCP, TCP_CORK, &option_cork, sizeof(option_cork) );
+	response->corked = cork;
+}
+
+response_status_t response_send_file( response_t* response, response_segment_t* segment, int socket )
+{
+	while( !response->use_splice && response->segment_sent < segment->length )
+	{
+		int64_t remaining = segment->length - response->segment_sent;
+		size_t wanted = response_allowance( response, remaining < RESPONSE_FILE_CHUNK ? (size_t) remaining : RESPONSE_FILE_CHUNK );
+		off_t offset = segment->offset + response->segment_sent;
+
+		if( wanted == 0 )
+		{
+			return RESPONSE_LIMITED;
+		}
+
+		ssize_t result = sendfile( socket, segment->file, &offset, wanted );
+
+		if( result > 0 )
+		{
+			response->segment_sent += result;
+			response->bytes_sent   += result;
+			response_spend( response, result );
+		}
+		else if( result == 0 )
+		{
+			/* The file shrank since the headers were sent. */
+			return RESPONSE_ERROR;
+		}
+		else if( errno == EINTR )
+		{
+			continue;
+		}
+		else if( errno == EAGAIN || errno == EWOULDBLOCK )
+		{
+			return RESPONSE_PENDING;
+		}
+		else if( errno == EINVAL || errno == ENOSYS )
+		{
+			/* The file system cannot sendfile(); move the data through a pipe instead. */
+			response->use_splice = true;
+		}
+		else
+		{
+			return RESPONSE_ERROR;
+		}
+	}
+
+	if( response->segment_sent < segment->length )
+	{
+		return response_splice_file( response, segment, socket );
+	}
+
+	return RESPONSE_DONE;
+}
+
+response_status_t response_splice_file( response_t* response, response_segment_t* segment, int socket )
+{
+	if( response->pipe[ 0 ] < 0 )
+	{
+		if( pipe2( response->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+		{
+			return RESPONSE_ERROR;
+		}
+
+		fcntl( response->pipe[ 1 ], F_SETPIPE_SZ, RESPONSE_PIPE_SIZE );
+	}
+
+	while( response->segment_sent < segment->length )
+	{
+		int64_t unread = segment->length - response->segment_sent - response->pipe_pending;
+
+		if( unread > 0 )
+		{
+			/* Top up the pipe from the file. */
+			loff_t offset = segment->offset + response->segment_sent + response->pipe_pending;
+			size_t wanted = unread < RESPONSE_FILE_CHUNK ? (size_t) unread : RESPONSE_FILE_CHUNK;
+			ssize_t result = splice( segment->file, &offset, response->pipe[ 1 ], NULL, wanted, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+
+			if( result > 0 )
+			{
+				response->pipe_pending += result;
+			}
+			else if( result == 0 )
+			{
+				return RESPONSE_ERROR;
+			}
+			else if( errno == EINTR )
+			{
+				continue;
+			}
+			else if( errno != EAGAIN && errno != EWOULDBLOCK )
+			{
+				return RESPONSE_ERROR;
+			}
+			else if( response->pipe_pending == 0 )
+			{
+				return RESPONSE_ERROR;
+			}
+		}
+
+		bool more = response->segment_sent + (int64_t) response->pipe_pending < segment->length;
+		size_t wanted = response_allowance( response, response->pipe_pending );
+
+		if( wanted == 0 )
+		{
+			return RESPONSE_LIMITED;
+		}
+
+		ssize_t result = splice( response->pipe[ 0 ], NULL, socket, NULL, wanted, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : 0) );
+
+		if( result > 0 )
+		{
+			response->pipe_pending -= result;
+			response->segment_sent += result;
+			response->bytes_sent   += result;
+			response_spend( response, result );
+		}
+		else if( result < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		else if( result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+		{
+			return RESPONSE_PENDING;
+		}
+		else
+		{
+			return RESPONSE_ERROR;
+		}
+	}
+
+	return RESPONSE_DONE;
+}
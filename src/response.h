@@ -0,0 +1,114 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __RESPONSE_H__
+#define __RESPONSE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include "encoder.h"
+#include "textbuffer.h"
+
+/*
+ * A response is a block of headers followed by body segments
+ * that are either text held in the body buffer, memory owned
+ * by the caller (which must outlive the send) or a range of
+ * an open file. It is sent incrementally on a non-blocking
+ * socket so that one peer never stalls the event loop.
+ */
+typedef enum response_status {
+	RESPONSE_ERROR = 0, /* the peer went away or the file could not be read */
+	RESPONSE_PENDING,   /* the socket is full; call again when writable */
+	RESPONSE_DONE,      /* everything has been sent */
+	RESPONSE_LIMITED,   /* the budget ran out or the producer yielded; call again soon */
+} response_status_t;
+
+typedef struct response_segment {
+	int file;         /* -1 for text held in memory */
+	const char* data; /* memory owned by the caller, or NULL for the body buffer */
+	int64_t offset;   /* into the memory or the file */
+	int64_t length;
+} response_segment_t;
+
+typedef struct response response_t;
+
+/*
+ * What a producer reports after queueing part of a streamed body.
+ * On an error the body is left unterminated, so the client sees
+ * a truncated response rather than a complete but wrong one.
+ */
+typedef enum response_produced {
+	RESPONSE_PRODUCED_ERROR = 0, /* the body cannot be completed */
+	RESPONSE_PRODUCED_MORE,      /* call again once this part is sent */
+	RESPONSE_PRODUCED_DONE,      /* the body is complete */
+} response_produced_t;
+
+/*
+ * Queues more of a streamed body with response_printf() and
+ * friends. Called whenever everything queued has been sent.
+ */
+typedef response_produced_t (*response_producer_fxn_t)( response_t* response, void* user_data );
+
+struct response {
+	textbuffer_t headers;
+	textbuffer_t body;
+	response_segment_t* segments;
+	size_t headers_sent;
+	size_t segment;         /* index of the segment being sent */
+	int64_t segment_sent;   /* bytes of the current segment already sent */
+	int64_t bytes_sent;     /* body bytes sent so far */
+	bool use_splice;        /* sendfile() is not supported for the file */
+	int pipe[ 2 ];          /* splice() fallback, created on demand */
+	size_t pipe_pending;    /* file bytes sitting in the pipe */
+	bool corked;            /* TCP_CORK is set while file segments go out */
+	response_producer_fxn_t producer; /* streams the body in chunks, or NULL */
+	void* producer_data;
+	encoder_t* encoder;     /* kept between responses for reuse */
+	bool encode;            /* produced chunks go through the encoder */
+	int64_t budget;         /* bytes response_send() may still write, or -1 for no limit */
+};
+
+void              response_create   ( response_t* response, arena_t* arena );
+void              response_destroy  ( response_t* response );
+void              response_reset    ( response_t* response );
+void              response_release  ( response_t* response );
+bool              response_printf   ( response_t* response, const char* format, ... );
+bool              response_vprintf  ( response_t* response, const char* format, va_list args );
+bool              response_write    ( response_t* response, const void* data, size_t length );
+bool              response_append_int  ( response_t* response, int64_t value );
+bool              response_append_html ( response_t* response, const char* text, size_t length );
+bool              response_append_url  ( response_t* response, const char* text, size_t length );
+char*             response_reserve  ( response_t* response, size_t length );
+void              response_commit   ( response_t* response, size_t length );
+void              response_add_data ( response_t* response, const char* data, int64_t length );
+void              response_add_file ( response_t* response, int file, int64_t offset, int64_t length );
+void              response_stream   ( response_t* response, response_producer_fxn_t producer, void* user_data );
+bool              response_encode   ( response_t* response, encoding_t encoding );
+bool              response_encode_body ( response_t* response, encoding_t encoding );
+void              response_clear_body ( response_t* response );
+int64_t           response_length   ( const response_t* response );
+response_status_t response_send     ( response_t* response, int socket );
+
+/* Queues a string literal without printf() or strlen(). */
+#define response_append_literal( response, literal ) \
+	response_write( (response), "" literal, sizeof(literal) - 1 )
+
+#endif /* __RESPONSE_H__ */
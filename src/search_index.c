@@ -0,0 +1,896 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <collections/vector.h>
+#include "search_index.h"
+
+#define SEARCH_INDEX_BATCH    1024 /* entries added per hold of the lock */
+#define SEARCH_INDEX_COMPACT  4096 /* removed entries tolerated before compacting */
+#define SEARCH_INDEX_MAX_QUERY 256
+#define SEARCH_TRIGRAM_USED   (1u << 24) /* keeps the key of an empty slot at 0 */
+
+/* Entries of a directory are linked to it by id + 1, with 0 for none. */
+typedef struct search_entry {
+	char* path;     /* relative to the root; NULL once removed */
+	uint32_t hash;  /* of the path */
+	uint32_t name;  /* offset of the last component */
+	uint32_t parent;
+	uint32_t children;
+	uint32_t previous;
+	uint32_t next;
+	bool directory;
+} search_entry_t;
+
+typedef struct search_trigram {
+	uint32_t key;   /* trigram | SEARCH_TRIGRAM_USED, or 0 for an empty slot */
+	uint32_t* ids;  /* entries whose name holds it, ascending */
+} search_trigram_t;
+
+typedef struct search_found {
+	char* path;
+	bool directory;
+} search_found_t;
+
+struct search_index {
+	char* root;
+	size_t root_length;
+	watcher_t* watcher;
+	pthread_t thread;
+	bool running;             /* the thread is yet to be joined */
+	_Atomic bool ready;       /* the first walk is done */
+	bool watch_warned;
+
+	pthread_mutex_t work_lock;
+	pthread_cond_t work;
+	char** pending;           /* directories left to walk, relative to the root */
+	bool rescan;              /* events were lost; walk everything again */
+	bool stop;
+
+	pthread_rwlock_t lock;    /* guards everything below */
+	search_entry_t* entries;  /* indexed by id */
+	size_t removed;
+	uint32_t* paths;          /* entry id + 1 by path hash, 0 for an empty slot */
+	size_t paths_capacity;
+	size_t paths_count;
+	search_trigram_t* trigrams;
+	size_t trigrams_capacity;
+	size_t trigrams_count;
+};
+
+static void*             search_index_run        ( void* data );
+static void              search_index_walk       ( search_index_t* index, const char* directory );
+static void              search_index_queue      ( search_index_t* index, const char* directory );
+static void              search_index_on_change  ( const char* directory, const char* name, uint32_t mask, void* user_data );
+static void              search_index_add        ( search_index_t* index, const char* path, bool directory );
+static void              search_index_insert     ( search_index_t* index, char* path, uint32_t hash, bool directory );
+static void              search_index_link       ( search_index_t* index, uint32_t id );
+static void              search_index_remove     ( search_index_t* index, const char* path );
+static void              search_index_unlink     ( search_index_t* index, uint32_t id );
+static void              search_index_clear      ( search_index_t* index );
+static void              search_index_compact    ( search_index_t* index );
+static void              search_index_forget     ( search_index_t* index );
+static uint32_t*         search_index_find_path  ( search_index_t* index, const char* path, uint32_t hash );
+static search_trigram_t* search_index_trigram    ( search_index_t* index, uint32_t key, bool create );
+static bool              search_index_matches    ( const search_entry_t* entry, const char* scope, size_t scope_length, const char* query, size_t query_length );
+static uint32_t          search_index_hash       ( const char* data, size_t length );
+
+
+search_index_t* search_index_create( const char* root, watcher_t* watcher )
+{
+	search_index_t* index = calloc( 1, sizeof(search_index_t) );
+
+	if( index )
+	{
+		index->root              = strdup( root );
+		index->root_length       = strlen( root );
+		index->watcher           = watcher;
+		index->paths_capacity    = 1024;
+		index->paths             = calloc( index->paths_capacity, sizeof(uint32_t) );
+		index->trigrams_capacity = 1024;
+		index->trigrams          = calloc( index->trigrams_capacity, sizeof(search_trigram_t) );
+		atomic_init( &index->ready, false );
+
+		if( !index->root || !index->paths || !index->trigrams )
+		{
+			free( index->root );
+			free( index->paths );
+			free( index->trigrams );
+			free( index );
+			return NULL;
+		}
+
+		lc_vector_create( index->entries, 1024 );
+		lc_vector_create( index->pending, 16 );
+		lc_vector_push( index->pending, strdup( "" ) );
+		pthread_mutex_init( &index->work_lock, NULL );
+		pthread_cond_init( &index->work, NULL );
+		pthread_rwlock_init( &index->lock, NULL );
+
+		if( watcher )
+		{
+			watcher_subscribe( watcher, search_index_on_change, index );
+		}
+
+		index->running = pthread_create( &index->thread, NULL, search_index_run, index ) == 0;
+
+		if( !index->running )
+		{
+			fprintf( stderr, "ERROR: Unable to start indexing \"%s\".\n", root );
+		}
+	}
+
+	return index;
+}
+
+/*
+ * Stops the indexing thread. It adds watches as it walks, so it
+ * has to be stopped before the watcher is destroyed; the index
+ * itself must outlive the watcher, which still reports to it.
+ */
+void search_index_stop( search_index_t* index )
+{
+	if( index && index->running )
+	{
+		pthread_mutex_lock( &index->work_lock );
+		index->stop = true;
+		pthread_cond_signal( &index->work );
+		pthread_mutex_unlock( &index->work_lock );
+
+		pthread_join( index->thread, NULL );
+		index->running = false;
+	}
+}
+
+void search_index_destroy( search_index_t** index )
+{
+	if( index && *index )
+	{
+		search_index_t* s = *index;
+
+		search_index_stop( s );
+		search_index_clear( s );
+
+		for( size_t i = 0; i < lc_vector_size(s->pending); i++ )
+		{
+			free( s->pending[ i ] );
+		}
+
+		pthread_rwlock_destroy( &s->lock );
+		pthread_cond_destroy( &s->work );
+		pthread_mutex_destroy( &s->work_lock );
+		lc_vector_destroy( s->pending );
+		lc_vector_destroy( s->entries );
+		free( s->trigrams );
+		free( s->paths );
+		free( s->root );
+		free( s );
+		*index = NULL;
+	}
+}
+
+/* False while the tree is still being walked and results may be missing. */
+bool search_index_ready( search_index_t* index )
+{
+	return atomic_load( &index->ready );
+}
+
+/*
+ * Reports entries under scope (a directory relative to the root,
+ * "" for all) whose name holds the query, ignoring ASCII case,
+ * up to limit of them. Returns how many were reported.
+ */
+size_t search_index_find( search_index_t* index, const char* scope, const char* query, size_t limit, search_index_fxn_t callback, void* user_data )
+{
+	char lowered[ SEARCH_INDEX_MAX_QUERY ];
+	size_t query_length = strlen( query );
+	size_t scope_length = strlen( scope );
+	size_t found = 0;
+
+	if( query_length == 0 || query_length >= sizeof(lowered) || limit == 0 )
+	{
+		return 0;
+	}
+
+	for( size_t i = 0; i <= query_length; i++ )
+	{
+		lowered[ i ] = (char) tolower( (unsigned char) query[ i ] );
+	}
+
+	pthread_rwlock_rdlock( &index->lock );
+
+	if( query_length >= 3 )
+	{
+		/* Every trigram of the query is in a match; walk the rarest one's entries. */
+		search_trigram_t* rarest = NULL;
+
+		for( size_t i = 0; i + 2 < query_length; i++ )
+		{
+			uint32_t key = (uint32_t) (unsigned char) lowered[ i ] << 16 |
+			               (uint32_t) (unsigned char) lowered[ i + 1 ] << 8 |
+			               (uint32_t) (unsigned char) lowered[ i + 2 ];
+			search_trigram_t* trigram = search_index_trigram( index, key, false );
+
+			if( !trigram )
+			{
+				rarest = NULL;
+				break;
+			}
+			if( !rarest || lc_vector_size(trigram->ids) < lc_vector_size(rarest->ids) )
+			{
+				rarest = trigram;
+			}
+		}
+
+		for( size_t i = 0; rarest && i < lc_vector_size(rarest->ids) && found < limit; i++ )
+		{
+			const search_entry_t* entry = &index->entries[ rarest->ids[ i ] ];
+
+			if( search_index_matches( entry, scope, scope_length, lowered, query_length ) )
+			{
+				found += 1;
+
+				if( !callback( entry->path, entry->directory, user_data ) )
+				{
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		/* Too short for a trigram; such queries are rare enough to scan for. */
+		for( size_t i = 0; i < lc_vector_size(index->entries) && found < limit; i++ )
+		{
+			const search_entry_t* entry = &index->entries[ i ];
+
+			if( search_index_matches( entry, scope, scope_length, lowered, query_length ) )
+			{
+				found += 1;
+
+				if( !callback( entry->path, entry->directory, user_data ) )
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	pthread_rwlock_unlock( &index->lock );
+
+	return found;
+}
+
+void* search_index_run( void* data )
+{
+	search_index_t* index = (search_index_t*) data;
+
+	pthread_mutex_lock( &index->work_lock );
+
+	for( ;; )
+	{
+		while( !index->stop && !index->rescan && lc_vector_size(index->pending) == 0 )
+		{
+			pthread_cond_wait( &index->work, &index->work_lock );
+		}
+
+		if( index->stop )
+		{
+			break;
+		}
+
+		if( index->rescan )
+		{
+			index->rescan = false;
+
+			for( size_t i = 0; i < lc_vector_size(index->pending); i++ )
+			{
+				free( index->pending[ i ] );
+			}
+			lc_vector_clear( index->pending );
+			lc_vector_push( index->pending, strdup( "" ) );
+			atomic_store( &index->ready, false );
+
+			pthread_rwlock_wrlock( &index->lock );
+			search_index_clear( index );
+			pthread_rwlock_unlock( &index->lock );
+		}
+
+		char* directory = lc_vector_last(index->pending);
+		lc_vector_pop(index->pending);
+		pthread_mutex_unlock( &index->work_lock );
+
+		if( directory )
+		{
+			search_index_walk( index, directory );
+			free( directory );
+		}
+
+		pthread_mutex_lock( &index->work_lock );
+
+		if( lc_vector_size(index->pending) == 0 && !atomic_load( &index->ready ) )
+		{
+			atomic_store( &index->ready, true );
+		}
+	}
+
+	pthread_mutex_unlock( &index->work_lock );
+
+	return NULL;
+}
+
+/*
+ * Indexes what is in one directory and queues its subdirectories.
+ * The directory is watched before it is read, so nothing created
+ * in the meantime is missed. Symbolic links are not followed.
+ */
+void search_index_walk( search_index_t* index, const char* directory )
+{
+	char path[ PATH_MAX ];
+	search_found_t* batch;
+
+	if( snprintf( path, sizeof(path), "%s%s%s", index->root, *directory ? "/" : "", directory ) >= (int) sizeof(path) )
+	{
+		return;
+	}
+
+	if( index->watcher && !watcher_add( index->watcher, path ) && !index->watch_warned )
+	{
+		fprintf( stderr, "WARNING: Unable to watch \"%s\"; search results there may go stale (see fs.inotify.max_user_watches).\n", path );
+		index->watch_warned = true;
+	}
+
+	DIR* dir = opendir( path );
+
+	if( !dir )
+	{
+		return;
+	}
+
+	lc_vector_create( batch, 64 );
+
+	for( ;; )
+	{
+		struct dirent* entry = readdir( dir );
+
+		if( entry && (strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0) )
+		{
+			continue;
+		}
+
+		if( entry )
+		{
+			search_found_t found;
+			size_t length = strlen( directory ) + strlen( entry->d_name ) + 2;
+
+			found.path      = malloc( length );
+			found.directory = entry->d_type == DT_DIR;
+
+			if( !found.path )
+			{
+				continue;
+			}
+
+			snprintf( found.path, length, "%s%s%s", directory, *directory ? "/" : "", entry->d_name );
+
+			if( entry->d_type == DT_UNKNOWN )
+			{
+				struct stat stats;
+				found.directory = fstatat( dirfd(dir), entry->d_name, &stats, AT_SYMLINK_NOFOLLOW ) == 0 && S_ISDIR(stats.st_mode);
+			}
+
+			lc_vector_push( batch, found );
+		}
+
+		if( lc_vector_size(batch) > 0 && (!entry || lc_vector_size(batch) >= SEARCH_INDEX_BATCH) )
+		{
+			pthread_rwlock_wrlock( &index->lock );
+			for( size_t i = 0; i < lc_vector_size(batch); i++ )
+			{
+				search_index_add( index, batch[ i ].path, batch[ i ].directory );
+			}
+			pthread_rwlock_unlock( &index->lock );
+
+			for( size_t i = 0; i < lc_vector_size(batch); i++ )
+			{
+				if( batch[ i ].directory )
+				{
+					search_index_queue( index, batch[ i ].path );
+				}
+				free( batch[ i ].path );
+			}
+			lc_vector_clear( batch );
+		}
+
+		if( !entry )
+		{
+			break;
+		}
+	}
+
+	lc_vector_destroy( batch );
+	closedir( dir );
+}
+
+void search_index_queue( search_index_t* index, const char* directory )
+{
+	char* copy = strdup( directory );
+
+	if( copy )
+	{
+		pthread_mutex_lock( &index->work_lock );
+		lc_vector_push( index->pending, copy );
+		pthread_cond_signal( &index->work );
+		pthread_mutex_unlock( &index->work_lock );
+	}
+}
+
+void search_index_on_change( const char* directory, const char* name, uint32_t mask, void* user_data )
+{
+	search_index_t* index = (search_index_t*) user_data;
+	char path[ PATH_MAX ];
+
+	if( !directory )
+	{
+		/* Events were lost; only a fresh walk can be trusted. */
+		pthread_mutex_lock( &index->work_lock );
+		index->rescan = true;
+		pthread_cond_signal( &index->work );
+		pthread_mutex_unlock( &index->work_lock );
+		return;
+	}
+
+	if( !name || strncmp( directory, index->root, index->root_length ) != 0 )
+	{
+		return;
+	}
+
+	/* The watched name may be spelled with extra slashes. */
+	const char* relative = directory + index->root_length;
+	size_t length;
+
+	if( *relative != '\0' && *relative != '/' && index->root[ index->root_length - 1 ] != '/' )
+	{
+		return;
+	}
+
+	while( *relative == '/' )
+	{
+		relative++;
+	}
+
+	length = strlen( relative );
+
+	while( length > 0 && relative[ length - 1 ] == '/' )
+	{
+		length--;
+	}
+
+	if( snprintf( path, sizeof(path), "%.*s%s%s", (int) length, relative, length > 0 ? "/" : "", name ) >= (int) sizeof(path) )
+	{
+		return;
+	}
+
+	bool is_directory = (mask & IN_ISDIR) != 0;
+
+	if( mask & (IN_CREATE | IN_MOVED_TO) )
+	{
+		pthread_rwlock_wrlock( &index->lock );
+		search_index_add( index, path, is_directory );
+		pthread_rwlock_unlock( &index->lock );
+
+		if( is_directory )
+		{
+			/* It may have arrived with contents, if it was moved here. */
+			search_index_queue( index, path );
+		}
+	}
+	else if( mask & (IN_DELETE | IN_MOVED_FROM) )
+	{
+		pthread_rwlock_wrlock( &index->lock );
+		search_index_remove( index, path );
+		search_index_compact( index );
+		pthread_rwlock_unlock( &index->lock );
+	}
+}
+
+/* Adds a path unless it is already indexed. Call with the lock held for writing. */
+void search_index_add( search_index_t* index, const char* path, bool directory )
+{
+	uint32_t hash = search_index_hash( path, strlen( path ) );
+	uint32_t* slot = search_index_find_path( index, path, hash );
+
+	if( *slot )
+	{
+		index->entries[ *slot - 1 ].directory = directory;
+		return;
+	}
+
+	char* copy = strdup( path );
+
+	if( copy )
+	{
+		search_index_insert( index, copy, hash, directory );
+	}
+}
+
+/* Takes ownership of the path, which must not be indexed yet. */
+void search_index_insert( search_index_t* index, char* path, uint32_t hash, bool directory )
+{
+	if( (index->paths_count + 1) * 2 > index->paths_capacity )
+	{
+		/* Keep the table at most half full. */
+		size_t capacity = index->paths_capacity * 2;
+		uint32_t* paths = calloc( capacity, sizeof(uint32_t) );
+
+		if( !paths )
+		{
+			free( path );
+			return;
+		}
+
+		for( size_t i = 0; i < index->paths_capacity; i++ )
+		{
+			if( index->paths[ i ] )
+			{
+				size_t j = index->entries[ index->paths[ i ] - 1 ].hash & (capacity - 1);
+
+				while( paths[ j ] )
+				{
+					j = (j + 1) & (capacity - 1);
+				}
+				paths[ j ] = index->paths[ i ];
+			}
+		}
+
+		free( index->paths );
+		index->paths          = paths;
+		index->paths_capacity = capacity;
+	}
+
+	const char* slash = strrchr( path, '/' );
+	uint32_t id = (uint32_t) lc_vector_size(index->entries);
+	search_entry_t entry = {
+		.path      = path,
+		.hash      = hash,
+		.name      = slash ? (uint32_t) (slash + 1 - path) : 0,
+		.directory = directory
+	};
+
+	lc_vector_push( index->entries, entry );
+	*search_index_find_path( index, path, hash ) = id + 1;
+	index->paths_count += 1;
+	search_index_link( index, id );
+
+	const char* name = path + entry.name;
+	size_t name_length = strlen( name );
+
+	for( size_t i = 0; i + 2 < name_length; i++ )
+	{
+		uint32_t key = (uint32_t) tolower( (unsigned char) name[ i ] ) << 16 |
+		               (uint32_t) tolower( (unsigned char) name[ i + 1 ] ) << 8 |
+		               (uint32_t) tolower( (unsigned char) name[ i + 2 ] );
+		search_trigram_t* trigram = search_index_trigram( index, key, true );
+
+		/* A trigram repeated in the name is listed once. */
+		if( trigram && (lc_vector_size(trigram->ids) == 0 || lc_vector_last(trigram->ids) != id) )
+		{
+			lc_vector_push( trigram->ids, id );
+		}
+	}
+}
+
+/*
+ * Adds the entry to the children of its directory. Directories are
+ * indexed before what is in them, so the parent is already known.
+ */
+void search_index_link( search_index_t* index, uint32_t id )
+{
+	search_entry_t* entry = &index->entries[ id ];
+
+	if( entry->name == 0 )
+	{
+		return;
+	}
+
+	/* The parent's path is the entry's, up to the last slash. */
+	entry->path[ entry->name - 1 ] = '\0';
+	uint32_t parent = *search_index_find_path( index, entry->path, search_index_hash( entry->path, entry->name - 1 ) );
+	entry->path[ entry->name - 1 ] = '/';
+
+	if( parent )
+	{
+		search_entry_t* directory = &index->entries[ parent - 1 ];
+
+		entry->parent = parent;
+		entry->next   = directory->children;
+
+		if( directory->children )
+		{
+			index->entries[ directory->children - 1 ].previous = id + 1;
+		}
+		directory->children = id + 1;
+	}
+}
+
+/* Removes a path and everything under it, visiting only those entries. */
+void search_index_remove( search_index_t* index, const char* path )
+{
+	uint32_t* slot = search_index_find_path( index, path, search_index_hash( path, strlen( path ) ) );
+
+	if( !*slot )
+	{
+		return;
+	}
+
+	uint32_t top = *slot - 1;
+	uint32_t id  = top;
+
+	/* Depth first; unlinking a child makes its next sibling the first. */
+	for( ;; )
+	{
+		search_entry_t* entry = &index->entries[ id ];
+
+		if( entry->children )
+		{
+			id = entry->children - 1;
+			continue;
+		}
+
+		uint32_t parent = entry->parent;
+		search_index_unlink( index, id );
+
+		if( id == top )
+		{
+			break;
+		}
+		id = parent - 1;
+	}
+}
+
+/*
+ * Drops a childless entry from the path table and its directory,
+ * and leaves a hole in its place; trigram lists keep naming it
+ * until the next compaction.
+ */
+void search_index_unlink( search_index_t* index, uint32_t id )
+{
+	search_entry_t* entry = &index->entries[ id ];
+	uint32_t* slot = search_index_find_path( index, entry->path, entry->hash );
+	size_t mask = index->paths_capacity - 1;
+	size_t i = (size_t) (slot - index->paths);
+
+	index->paths[ i ] = 0;
+	index->paths_count -= 1;
+
+	/* Re-home the rest of the cluster so lookups do not stop early. */
+	for( i = (i + 1) & mask; index->paths[ i ]; i = (i + 1) & mask )
+	{
+		uint32_t moved = index->paths[ i ];
+		size_t j = index->entries[ moved - 1 ].hash & mask;
+
+		index->paths[ i ] = 0;
+		while( index->paths[ j ] )
+		{
+			j = (j + 1) & mask;
+		}
+		index->paths[ j ] = moved;
+	}
+
+	if( entry->previous )
+	{
+		index->entries[ entry->previous - 1 ].next = entry->next;
+	}
+	else if( entry->parent )
+	{
+		index->entries[ entry->parent - 1 ].children = entry->next;
+	}
+
+	if( entry->next )
+	{
+		index->entries[ entry->next - 1 ].previous = entry->previous;
+	}
+
+	free( entry->path );
+	entry->path = NULL;
+	index->removed += 1;
+}
+
+/* Empties the index. Call with the lock held for writing. */
+void search_index_clear( search_index_t* index )
+{
+	for( size_t i = 0; i < lc_vector_size(index->entries); i++ )
+	{
+		free( index->entries[ i ].path );
+	}
+	lc_vector_clear( index->entries );
+	search_index_forget( index );
+}
+
+/* Rebuilds the index without its holes once they outnumber the live entries. */
+void search_index_compact( search_index_t* index )
+{
+	size_t count = lc_vector_size(index->entries);
+
+	if( index->removed < SEARCH_INDEX_COMPACT || index->removed * 2 < count )
+	{
+		return;
+	}
+
+	/* The live paths move over to fresh entries; the old ones are only let go. */
+	search_entry_t* entries = index->entries;
+	lc_vector_create( index->entries, count - index->removed + 1 );
+	search_index_forget( index );
+
+	for( size_t i = 0; i < count; i++ )
+	{
+		if( entries[ i ].path )
+		{
+			search_index_insert( index, entries[ i ].path, entries[ i ].hash, entries[ i ].directory );
+		}
+	}
+
+	lc_vector_destroy( entries );
+}
+
+/* Empties the path table and the trigram lists, but not the entries. */
+void search_index_forget( search_index_t* index )
+{
+	for( size_t i = 0; i < index->trigrams_capacity; i++ )
+	{
+		if( index->trigrams[ i ].key )
+		{
+			lc_vector_destroy( index->trigrams[ i ].ids );
+			index->trigrams[ i ].key = 0;
+		}
+	}
+
+	memset( index->paths, 0, index->paths_capacity * sizeof(uint32_t) );
+	index->paths_count    = 0;
+	index->trigrams_count = 0;
+	index->removed        = 0;
+}
+
+/* The slot holding the path's entry, or the empty slot where it would go. */
+uint32_t* search_index_find_path( search_index_t* index, const char* path, uint32_t hash )
+{
+	size_t mask = index->paths_capacity - 1;
+	size_t i = hash & mask;
+
+	while( index->paths[ i ] && strcmp( index->entries[ index->paths[ i ] - 1 ].path, path ) != 0 )
+	{
+		i = (i + 1) & mask;
+	}
+
+	return &index->paths[ i ];
+}
+
+search_trigram_t* search_index_trigram( search_index_t* index, uint32_t key, bool create )
+{
+	if( create && (index->trigrams_count + 1) * 2 > index->trigrams_capacity )
+	{
+		size_t capacity = index->trigrams_capacity * 2;
+		search_trigram_t* trigrams = calloc( capacity, sizeof(search_trigram_t) );
+
+		if( !trigrams )
+		{
+			return NULL;
+		}
+
+		for( size_t i = 0; i < index->trigrams_capacity; i++ )
+		{
+			if( index->trigrams[ i ].key )
+			{
+				size_t j = (index->trigrams[ i ].key * 2654435761u) & (capacity - 1);
+
+				while( trigrams[ j ].key )
+				{
+					j = (j + 1) & (capacity - 1);
+				}
+				trigrams[ j ] = index->trigrams[ i ];
+			}
+		}
+
+		free( index->trigrams );
+		index->trigrams          = trigrams;
+		index->trigrams_capacity = capacity;
+	}
+
+	key |= SEARCH_TRIGRAM_USED;
+
+	size_t mask = index->trigrams_capacity - 1;
+	size_t i = (key * 2654435761u) & mask;
+
+	while( index->trigrams[ i ].key && index->trigrams[ i ].key != key )
+	{
+		i = (i + 1) & mask;
+	}
+
+	if( !index->trigrams[ i ].key )
+	{
+		if( !create )
+		{
+			return NULL;
+		}
+
+		index->trigrams[ i ].key = key;
+		lc_vector_create( index->trigrams[ i ].ids, 4 );
+		index->trigrams_count += 1;
+	}
+
+	return &index->trigrams[ i ];
+}
+
+bool search_index_matches( const search_entry_t* entry, const char* scope, size_t scope_length, const char* query, size_t query_length )
+{
+	if( !entry->path )
+	{
+		return false;
+	}
+
+	if( scope_length > 0 && (strncmp( entry->path, scope, scope_length ) != 0 || entry->path[ scope_length ] != '/') )
+	{
+		return false;
+	}
+
+	const char* name = entry->path + entry->name;
+	size_t name_length = strlen( name );
+
+	for( size_t i = 0; i + query_length <= name_length; i++ )
+	{
+		size_t j = 0;
+
+		while( j < query_length && tolower( (unsigned char) name[ i + j ] ) == (unsigned char) query[ j ] )
+		{
+			j++;
+		}
+
+		if( j == query_length )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint32_t search_index_hash( const char* data, size_t length )
+{
+	uint32_t hash = 2166136261u; /* FNV-1a */
+
+	for( size_t i = 0; i < length; i++ )
+	{
+		hash = (hash ^ (unsigned char) data[ i ]) * 16777619u;
+	}
+
+	return hash;
+}
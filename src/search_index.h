@@ -0,0 +1,48 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __SEARCH_INDEX_H__
+#define __SEARCH_INDEX_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "watcher.h"
+
+/*
+ * In-memory index of every path under a root, for searching by
+ * file name. Names are broken into trigrams, each listing the
+ * entries whose name holds it, so a query only looks at the
+ * entries under its rarest trigram. The tree is walked on a
+ * background thread and kept current through the watcher.
+ */
+struct search_index;
+typedef struct search_index search_index_t;
+
+/* Called with each match; return false to stop early. */
+typedef bool (*search_index_fxn_t)( const char* path, bool directory, void* user_data );
+
+search_index_t* search_index_create  ( const char* root, watcher_t* watcher );
+void            search_index_stop    ( search_index_t* index );
+void            search_index_destroy ( search_index_t** index );
+bool            search_index_ready   ( search_index_t* index );
+size_t          search_index_find    ( search_index_t* index, const char* scope, const char* query, size_t limit, search_index_fxn_t callback, void* user_data );
+
+#endif /* __SEARCH_INDEX_H__ */
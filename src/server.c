@@ -21,41 +21,161 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <collections/vector.h>
 #include "server.h"
+#include "uring.h"
 
-#define SERVER_NON_BLOCKING  0
+#define SERVER_MAX_EVENTS  256
+#define SERVER_RING_ENTRIES    256
+#define SERVER_ACCEPT_RETRY    100  /* milliseconds before accepting again after an error */
+#define SERVER_ADDRESS_BUCKETS 256
+#define SERVER_MAX_OVERLOADED  64   /* per worker; beyond this peers are closed unanswered */
+
+/*
+ * io_uring completions carry a pointer to the peer (or worker)
+ * with what the request was in the low bits.
+ */
+#define SERVER_TAG_PEER    0
+#define SERVER_TAG_ACCEPT  1
+#define SERVER_TAG_WAKEUP  2
+#define SERVER_TAG_IGNORE  3
+#define SERVER_TAG_MASK    3
+
+/*
+ * Each worker owns a listening socket bound with SO_REUSEPORT,
+ * an epoll instance and its own peers, so workers never share
+ * connection state and the kernel spreads accepts across them.
+ */
+typedef struct server_worker {
+	server_t* server;
+	int index;
+	pthread_t thread;
+	int socket;
+	int poll;   /* epoll instance driving every socket */
+	uring_t* ring;  /* used instead of epoll for the io_uring backend */
+	bool accept_multishot; /* cleared if the kernel predates it */
+	bool accept_armed;
+	int wakeup; /* eventfd used to interrupt the event loop */
+	server_connection_t** peers;
+	server_connection_t** retired; /* closed, until io_uring lets go of them */
+	int unpolled;                  /* retired peers whose poll removal is yet to be queued */
+	timer_wheel_t timers;          /* peer timeouts and delays, in milliseconds */
+	server_connection_fxn_t handle_connection;
+	server_close_fxn_t handle_close;
+	_Atomic uint64_t accept_failures; /* read by other threads */
+	_Atomic uint64_t rejected;
+	int overloaded;                   /* peers waiting to be turned away */
+} server_worker_t;
+
+/* Connections admitted from one client address, across workers. */
+typedef struct server_address {
+	int family;
+	uint8_t bytes[ 16 ];
+	int connections;
+	struct server_address* next;
+} server_address_t;
 
 struct server {
 	volatile bool running;
-	int socket;
 	bool use_ip4;
 	int connection_queue;
-	int* peers;
+	bool no_delay;    /* disable Nagle's algorithm on accepted peers */
+	server_io_backend_t io_backend;
+	int max_connections;   /* admitted at once, or 0 for no limit */
+	int max_per_address;
+	_Atomic int connections;
+	pthread_mutex_t addresses_lock;
+	server_address_t* addresses[ SERVER_ADDRESS_BUCKETS ];
+	int workers_count;
+	server_worker_t* workers;
 	void* user_data;
 };
 
-server_t* server_create( bool use_ip4, int connection_queue, void* user_data )
+static bool  server_worker_listen  ( server_t* server, server_worker_t* worker, const char* address_string, int port );
+static void  server_worker_close   ( server_worker_t* worker );
+static void* server_worker_run     ( void* data );
+static bool  server_wait_epoll     ( server_worker_t* worker, int timeout );
+static bool  server_wait_uring     ( server_worker_t* worker, int timeout );
+static void  server_arm_accept     ( server_worker_t* worker );
+static bool  server_arm_poll       ( server_worker_t* worker, int socket, void* data, uint64_t tag );
+static bool  server_remove_poll    ( server_worker_t* worker, server_connection_t* peer );
+static void  server_remove_polls   ( server_worker_t* worker );
+static void  server_free_retired   ( server_worker_t* worker, server_connection_t* peer );
+static void  server_accept_peers   ( server_worker_t* worker );
+static void  server_add_peer       ( server_worker_t* worker, int peer_socket, const struct sockaddr_storage* peer_address );
+static void  server_close_peer     ( server_worker_t* worker, server_connection_t* peer );
+static void  server_handle_peer    ( server_worker_t* worker, server_connection_t* peer );
+static int   server_next_timeout   ( server_worker_t* worker );
+static void  server_expire_timers  ( server_worker_t* worker );
+static bool  server_admit          ( server_t* server, const struct sockaddr_storage* address );
+static void  server_release        ( server_t* server, const struct sockaddr_storage* address );
+static server_address_t** server_find_address ( server_t* server, const struct sockaddr_storage* address, int* family, uint8_t* bytes );
+static int64_t server_now          ( void );
+
+server_t* server_create( bool use_ip4, int connection_queue, int workers, void* user_data )
 {
-	server_t* server = malloc( sizeof(server_t) );
+	server_t* server = calloc( 1, sizeof(server_t) );
 
 	if( server )
 	{
 		server->use_ip4          = use_ip4;
 		server->running          = false;
-		server->socket           = 0;
 		server->connection_queue = connection_queue;
+		server->no_delay         = true;
+		server->io_backend       = SERVER_IO_EPOLL;
+		server->max_connections  = 0;
+		server->max_per_address  = 0;
+		atomic_init( &server->connections, 0 );
+		pthread_mutex_init( &server->addresses_lock, NULL );
+		server->workers_count    = workers > 0 ? workers : 1;
 		server->user_data        = user_data;
-		server->peers            = NULL;
+		server->workers          = calloc( server->workers_count, sizeof(server_worker_t) );
+
+		if( !server->workers )
+		{
+			free( server );
+			return NULL;
+		}
+
+		for( int i = 0; i < server->workers_count; i++ )
+		{
+			server_worker_t* worker = &server->workers[ i ];
+			worker->server = server;
+			worker->index  = i;
+			worker->socket = 0;
+			worker->poll   = -1;
+			worker->ring   = NULL;
+			worker->wakeup = -1;
+			worker->peers  = NULL;
+			worker->retired = NULL;
+			worker->unpolled = 0;
+			atomic_init( &worker->accept_failures, 0 );
+			atomic_init( &worker->rejected, 0 );
+			worker->overloaded = 0;
 
-		lc_vector_create(server->peers, 1);
+			lc_vector_create(worker->peers, 1);
+			lc_vector_create(worker->retired, 1);
+			timer_wheel_init( &worker->timers, server_now() );
+		}
 	}
 
 	return server;
@@ -65,7 +185,22 @@ void server_destroy( server_t** server )
 {
 	if( server && *server )
 	{
-		lc_vector_destroy((*server)->peers);
+		for( int i = 0; i < (*server)->workers_count; i++ )
+		{
+			lc_vector_destroy((*server)->workers[ i ].peers);
+			lc_vector_destroy((*server)->workers[ i ].retired);
+		}
+		for( int i = 0; i < SERVER_ADDRESS_BUCKETS; i++ )
+		{
+			while( (*server)->addresses[ i ] )
+			{
+				server_address_t* address = (*server)->addresses[ i ];
+				(*server)->addresses[ i ] = address->next;
+				free( address );
+			}
+		}
+		pthread_mutex_destroy( &(*server)->addresses_lock );
+		free( (*server)->workers );
 		free( *server );
 		*server = NULL;
 	}
@@ -73,7 +208,75 @@ void server_destroy( server_t** server )
 
 int server_socket( server_t* server )
 {
-	return server ? server->socket : -1;
+	return server ? server->workers[ 0 ].socket : -1;
+}
+
+int server_workers( server_t* server )
+{
+	return server ? server->workers_count : 0;
+}
+
+/*
+ * Responses are written whole (headers gathered with the body, or
+ * held back with MSG_MORE), so Nagle's algorithm only delays the
+ * last segment of each response; it is off by default.
+ */
+void server_set_no_delay( server_t* server, bool no_delay )
+{
+	server->no_delay = no_delay;
+}
+
+/*
+ * Takes effect on server_start(), which falls back to epoll if
+ * the kernel cannot run the io_uring backend.
+ */
+void server_set_io_backend( server_t* server, server_io_backend_t backend )
+{
+	server->io_backend = backend;
+}
+
+server_io_backend_t server_io_backend( server_t* server )
+{
+	return server->io_backend;
+}
+
+/*
+ * Caps the peers served at once, in all and from one address;
+ * 0 leaves either unlimited. Peers over a limit are still handed
+ * to the connection handler, flagged as overloaded, so it can
+ * answer quickly and close rather than leave them queued.
+ */
+void server_set_limits( server_t* server, int max_connections, int max_per_address )
+{
+	server->max_connections = max_connections > 0 ? max_connections : 0;
+	server->max_per_address = max_per_address > 0 ? max_per_address : 0;
+}
+
+/* Safe to call from any thread while the server runs. */
+bool server_listen_stats( server_t* server, int worker, server_listen_stats_t* stats )
+{
+	if( !server || worker < 0 || worker >= server->workers_count )
+	{
+		return false;
+	}
+
+	server_worker_t* w = &server->workers[ worker ];
+	struct tcp_info info;
+	socklen_t info_size = sizeof(info);
+
+	stats->queued          = 0;
+	stats->queue_size      = 0;
+	stats->accept_failures = atomic_load_explicit( &w->accept_failures, memory_order_relaxed );
+	stats->rejected        = atomic_load_explicit( &w->rejected, memory_order_relaxed );
+
+	/* On a listener, tcpi_unacked and tcpi_sacked hold the accept queue. */
+	if( w->socket > 0 && getsockopt( w->socket, IPPROTO_TCP, TCP_INFO, &info, &info_size ) == 0 && info.tcpi_state == TCP_LISTEN )
+	{
+		stats->queued     = info.tcpi_unacked;
+		stats->queue_size = info.tcpi_sacked;
+	}
+
+	return true;
 }
 
 bool server_is_running( server_t* server )
@@ -84,159 +287,890 @@ bool server_is_running( server_t* server )
 bool server_start( server_t* server, const char* address_string, int port )
 {
 	server->running = false;
-	server->socket = socket( server->use_ip4 ? PF_INET : PF_INET6, SOCK_STREAM, 0 );
+
+	for( int i = 0; i < server->workers_count; i++ )
+	{
+		if( !server_worker_listen( server, &server->workers[ i ], address_string, port ) )
+		{
+			for( int j = 0; j < i; j++ )
+			{
+				server_worker_close( &server->workers[ j ] );
+			}
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool server_worker_listen( server_t* server, server_worker_t* worker, const char* address_string, int port )
+{
+	worker->socket = socket( server->use_ip4 ? PF_INET : PF_INET6, SOCK_STREAM, 0 );
 
 	if( !server->use_ip4 )
 	{
 		int option_ipv6_only = 0;
-		if( setsockopt( server->socket, IPPROTO_IPV6, IPV6_V6ONLY, &option_ipv6_only, sizeof(option_ipv6_only) ) < 0 )
+		if( setsockopt( worker->socket, IPPROTO_IPV6, IPV6_V6ONLY, &option_ipv6_only, sizeof(option_ipv6_only) ) < 0 )
 		{
 			fprintf( stderr, "ERROR: Unable to set socket option IPV6_V6ONLY.\n" );
 			perror( "Problem" );
-			close( server->socket );
-			server->socket = 0;
+			close( worker->socket );
+			worker->socket = 0;
 			return false;
 		}
 	}
 
 	int option_reuse_address = 1;
-	if( setsockopt( server->socket, SOL_SOCKET, SO_REUSEADDR, &option_reuse_address, sizeof(option_reuse_address) ) < 0 )
+	if( setsockopt( worker->socket, SOL_SOCKET, SO_REUSEADDR, &option_reuse_address, sizeof(option_reuse_address) ) < 0 )
 	{
 		fprintf( stderr, "ERROR: Unable to set socket option SO_REUSEADDR.\n" );
 		perror( "Problem" );
-		close( server->socket );
-		server->socket = 0;
+		close( worker->socket );
+		worker->socket = 0;
+		return false;
+	}
+
+	/*
+	 * Every worker binds its own listener to the same
+	 * port and the kernel balances accepts between them.
+	 */
+	int option_reuse_port = 1;
+	if( server->workers_count > 1 && setsockopt( worker->socket, SOL_SOCKET, SO_REUSEPORT, &option_reuse_port, sizeof(option_reuse_port) ) < 0 )
+	{
+		fprintf( stderr, "ERROR: Unable to set socket option SO_REUSEPORT.\n" );
+		perror( "Problem" );
+		close( worker->socket );
+		worker->socket = 0;
 		return false;
 	}
 
-	void* address = NULL;
+	struct sockaddr_storage address;
 	size_t address_size = 0;
 
+	memset( &address, 0, sizeof(address) );
+
 	if( server->use_ip4 )
 	{
-		struct sockaddr_in address4 = {
-			.sin_addr   = INADDR_ANY, // default to bind to all addresses
-			.sin_family = AF_INET,
-			.sin_port   = htons(port)
-		};
-		address = &address4;
-		address_size = sizeof(address4);
+		struct sockaddr_in* address4 = (struct sockaddr_in*) &address;
+		address4->sin_addr.s_addr = INADDR_ANY; // default to bind to all addresses
+		address4->sin_family      = AF_INET;
+		address4->sin_port        = htons(port);
+		address_size = sizeof(*address4);
 
-		if( address_string && inet_pton( AF_INET, address_string, &address4.sin_addr ) < 0 )
+		if( address_string && inet_pton( AF_INET, address_string, &address4->sin_addr ) < 0 )
 		{
 			fprintf( stderr, "ERROR: Unable to get address_string address.\n");
 			perror( "Problem" );
-			close( server->socket );
-			server->socket = 0;
+			close( worker->socket );
+			worker->socket = 0;
 			return false;
 		}
 	}
 	else
 	{
-		struct sockaddr_in6 address6 = {
-			.sin6_addr   = INADDR_ANY, // default to bind to all addresses
-			.sin6_family = AF_INET6,
-			.sin6_port   = htons(port)
-		};
-		address = &address6;
-		address_size = sizeof(address6);
+		struct sockaddr_in6* address6 = (struct sockaddr_in6*) &address;
+		address6->sin6_addr   = in6addr_any; // default to bind to all addresses
+		address6->sin6_family = AF_INET6;
+		address6->sin6_port   = htons(port);
+		address_size = sizeof(*address6);
 
-		if( address_string && inet_pton( AF_INET6, address_string, &address6.sin6_addr ) < 0 )
+		if( address_string && inet_pton( AF_INET6, address_string, &address6->sin6_addr ) < 0 )
 		{
 			fprintf( stderr, "ERROR: Unable to get address_string address.\n");
 			perror( "Problem" );
-			close( server->socket );
-			server->socket = 0;
+			close( worker->socket );
+			worker->socket = 0;
 			return false;
 		}
 	}
 
-#if SERVER_NON_BLOCKING
-	int status = fcntl(server->socket, F_SETFL, fcntl(server->socket, F_GETFL, 0) | O_NONBLOCK);
+	if( server->io_backend == SERVER_IO_URING )
+	{
+		worker->ring = uring_create( SERVER_RING_ENTRIES );
+		worker->accept_multishot = true;
+		worker->accept_armed     = false;
+
+		if( !worker->ring && worker->index == 0 )
+		{
+			fprintf( stderr, "WARNING: io_uring is not available; falling back to epoll.\n" );
+			server->io_backend = SERVER_IO_EPOLL;
+		}
+		else if( !worker->ring )
+		{
+			fprintf( stderr, "ERROR: Unable to create an io_uring instance.\n" );
+			close( worker->socket );
+			worker->socket = 0;
+			return false;
+		}
+	}
+
+	/* io_uring's accepts fail with EAGAIN instead of waiting on a non-blocking listener. */
+	int status = worker->ring ? 0 : fcntl(worker->socket, F_SETFL, fcntl(worker->socket, F_GETFL, 0) | O_NONBLOCK);
 	if (status == -1)
 	{
 		fprintf( stderr, "ERROR: Unable to set socket to be non-blocking.\n" );
 		perror( "Problem" );
+		close( worker->socket );
+		worker->socket = 0;
+		return false;
 	}
-#endif
 
-	if( bind( server->socket, (const struct sockaddr*) address, address_size ) < 0 )
+	if( bind( worker->socket, (const struct sockaddr*) &address, address_size ) < 0 )
 	{
 		fprintf( stderr, "ERROR: Unable to bind to %s:%d.\n", address_string, port );
 		perror( "Problem" );
-		close( server->socket );
-		server->socket = 0;
+		close( worker->socket );
+		worker->socket = 0;
 		return false;
 	}
 
-	if( listen( server->socket, server->connection_queue ) < 0 )
+	if( listen( worker->socket, server->connection_queue ) < 0 )
 	{
 		fprintf( stderr, "ERROR: Unable to listen.\n" );
 		perror( "Problem" );
-		close( server->socket );
-		server->socket = 0;
+		server_worker_close( worker );
+		return false;
+	}
+
+	worker->wakeup = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+	if( worker->ring )
+	{
+		if( worker->wakeup < 0 || !server_arm_poll( worker, worker->wakeup, worker, SERVER_TAG_WAKEUP ) )
+		{
+			fprintf( stderr, "ERROR: Unable to create the event loop.\n" );
+			perror( "Problem" );
+			server_worker_close( worker );
+			return false;
+		}
+
+		server_arm_accept( worker );
+		return true;
+	}
+
+	worker->poll = epoll_create1( EPOLL_CLOEXEC );
+
+	if( worker->poll < 0 || worker->wakeup < 0 )
+	{
+		fprintf( stderr, "ERROR: Unable to create the event loop.\n" );
+		perror( "Problem" );
+		server_worker_close( worker );
+		return false;
+	}
+
+	/*
+	 * The listening socket and the wake-up event are told
+	 * apart from peers by their tags in the event data.
+	 */
+	struct epoll_event listener_event = { .events = EPOLLIN | EPOLLET, .data.ptr = worker };
+	struct epoll_event wakeup_event   = { .events = EPOLLIN, .data.ptr = &worker->wakeup };
+
+	if( epoll_ctl( worker->poll, EPOLL_CTL_ADD, worker->socket, &listener_event ) < 0 ||
+	    epoll_ctl( worker->poll, EPOLL_CTL_ADD, worker->wakeup, &wakeup_event ) < 0 )
+	{
+		fprintf( stderr, "ERROR: Unable to register with the event loop.\n" );
+		perror( "Problem" );
+		server_worker_close( worker );
 		return false;
 	}
 
 	return true;
 }
 
+void server_worker_close( server_worker_t* worker )
+{
+	if( worker->socket > 0 ) close( worker->socket );
+	if( worker->poll >= 0 ) close( worker->poll );
+	if( worker->wakeup >= 0 ) close( worker->wakeup );
+	uring_destroy( &worker->ring );
+	worker->socket = -1;
+	worker->poll   = -1;
+	worker->wakeup = -1;
+}
+
+/*
+ * Safe to call from a signal handler; each worker notices
+ * the wake-up and tears its own peers down.
+ */
 void server_stop( server_t* server )
 {
 	server->running = false;
 
+	for( int i = 0; i < server->workers_count; i++ )
+	{
+		if( server->workers[ i ].wakeup >= 0 )
+		{
+			uint64_t one = 1;
+			ssize_t result = write( server->workers[ i ].wakeup, &one, sizeof(one) );
+			(void) result;
+		}
+	}
+}
 
-	for( int i = 0; i < lc_vector_size(server->peers); i++ )
+void server_run( server_t* server, server_connection_fxn_t handle_connection, server_close_fxn_t handle_close )
+{
+	server->running = true;
+
+	/*
+	 * Every worker gets its own thread with signals blocked, so
+	 * the handlers only ever run on the calling thread while it
+	 * waits here, never on a worker mid-request.
+	 */
+	sigset_t blocked;
+	sigset_t previous;
+	sigfillset( &blocked );
+	pthread_sigmask( SIG_BLOCK, &blocked, &previous );
+
+	for( int i = 0; i < server->workers_count; i++ )
 	{
-		close(server->peers[ i ]);
+		server_worker_t* worker = &server->workers[ i ];
+		worker->handle_connection = handle_connection;
+		worker->handle_close      = handle_close;
+
+		if( pthread_create( &worker->thread, NULL, server_worker_run, worker ) != 0 )
+		{
+			fprintf( stderr, "ERROR: Unable to start worker %d.\n", i );
+			server_worker_close( worker );
+		}
 	}
-	lc_vector_clear(server->peers);
 
+	pthread_sigmask( SIG_SETMASK, &previous, NULL );
 
-	close( server->socket );
-	server->socket = -1;
+	for( int i = 0; i < server->workers_count; i++ )
+	{
+		if( server->workers[ i ].poll >= 0 || server->workers[ i ].ring )
+		{
+			pthread_join( server->workers[ i ].thread, NULL );
+		}
+		server_worker_close( &server->workers[ i ] );
+	}
 }
 
-void server_run( server_t* server, server_connection_fxn_t handle_connection )
+void* server_worker_run( void* data )
 {
-	server->running = true;
+	server_worker_t* worker = (server_worker_t*) data;
+	server_t* server = worker->server;
 
 	while( server->running )
 	{
-		struct sockaddr_storage peer_address;
-		socklen_t peer_address_len = sizeof(peer_address);
+		int timeout = server_next_timeout( worker );
+
+		if( !(worker->ring ? server_wait_uring( worker, timeout ) : server_wait_epoll( worker, timeout )) )
+		{
+			break;
+		}
+
+		server_expire_timers( worker );
+	}
 
-		int peer_socket = accept( server->socket, (struct sockaddr *) &peer_address, &peer_address_len );
-#if SERVER_NON_BLOCKING
-		if( peer_socket == -1)
+	/* Drain whatever peers this worker still owns. */
+	while( lc_vector_size(worker->peers) > 0 )
+	{
+		server_close_peer( worker, lc_vector_last(worker->peers) );
+	}
+
+	/* Nothing else will complete; the ring is closed with the worker. */
+	while( lc_vector_size(worker->retired) > 0 )
+	{
+		free( lc_vector_last(worker->retired) );
+		lc_vector_pop(worker->retired);
+	}
+	worker->unpolled = 0;
+
+	return NULL;
+}
+
+/* Waits for epoll events and dispatches them; false on failure. */
+bool server_wait_epoll( server_worker_t* worker, int timeout )
+{
+	server_t* server = worker->server;
+	struct epoll_event events[ SERVER_MAX_EVENTS ];
+	int count = epoll_wait( worker->poll, events, SERVER_MAX_EVENTS, timeout );
+
+	if( count < 0 )
+	{
+		if( errno == EINTR )
+		{
+			return true;
+		}
+
+		fprintf( stderr, "ERROR: Unable to wait for events.\n" );
+		perror( "Problem" );
+		return false;
+	}
+
+	for( int i = 0; i < count && server->running; i++ )
+	{
+		void* tag = events[ i ].data.ptr;
+
+		if( tag == worker )
+		{
+			server_accept_peers( worker );
+		}
+		else if( tag == &worker->wakeup )
+		{
+			uint64_t value;
+			ssize_t result = read( worker->wakeup, &value, sizeof(value) );
+			(void) result;
+		}
+		else
 		{
-			if (errno == EAGAIN)
+			server_connection_t* peer = (server_connection_t*) tag;
+
+			if( events[ i ].events & (EPOLLERR | EPOLLHUP) )
+			{
+				server_close_peer( worker, peer );
+			}
+			else if( peer->waiting != SERVER_CONNECTION_DELAY )
 			{
-				printf("Waiting...\n");
+				server_handle_peer( worker, peer );
 			}
 		}
-		else
-#endif
+	}
+
+	return true;
+}
+
+/*
+ * Submits what was queued, waits for completions and dispatches
+ * them. Multishot requests stay armed across completions and are
+ * only re-armed once the kernel reports they have ended.
+ */
+bool server_wait_uring( server_worker_t* worker, int timeout )
+{
+	server_t* server = worker->server;
+	struct io_uring_cqe cqe;
+
+	if( !worker->accept_armed && (timeout < 0 || timeout > SERVER_ACCEPT_RETRY) )
+	{
+		timeout = SERVER_ACCEPT_RETRY;
+	}
+
+	if( worker->unpolled > 0 )
+	{
+		server_remove_polls( worker );
+	}
+
+	if( !uring_wait( worker->ring, timeout ) )
+	{
+		fprintf( stderr, "ERROR: Unable to wait for events.\n" );
+		perror( "Problem" );
+		return false;
+	}
+
+	while( server->running && uring_next( worker->ring, &cqe ) )
+	{
+		void* data = (void*) (uintptr_t) (cqe.user_data & ~(uint64_t) SERVER_TAG_MASK);
+		bool more  = cqe.flags & IORING_CQE_F_MORE;
+
+		switch( cqe.user_data & SERVER_TAG_MASK )
 		{
-			lc_vector_push( server->peers, peer_socket );
+			case SERVER_TAG_ACCEPT:
+				if( cqe.res >= 0 )
+				{
+					server_add_peer( worker, cqe.res, NULL );
+				}
+				else if( cqe.res == -EINVAL && worker->accept_multishot )
+				{
+					/* Multishot accepts arrived in 5.19; take them one at a time. */
+					worker->accept_multishot = false;
+				}
+				else if( cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED )
+				{
+					atomic_store_explicit( &worker->accept_failures, atomic_load_explicit( &worker->accept_failures, memory_order_relaxed ) + 1, memory_order_relaxed );
+					errno = -cqe.res;
+					perror( "Problem" );
+				}
 
-			handle_connection( server, peer_socket, &peer_address, server->user_data );
+				if( !more )
+				{
+					worker->accept_armed = false;
 
+					/* After a failure such as EMFILE, wait a little before trying again. */
+					if( cqe.res >= 0 || cqe.res == -EINVAL || cqe.res == -EAGAIN || cqe.res == -EINTR || cqe.res == -ECONNABORTED )
+					{
+						server_arm_accept( worker );
+					}
+				}
+				break;
 
-			for( int i = 0; i < lc_vector_size(server->peers); i++ )
+			case SERVER_TAG_WAKEUP:
 			{
-				if( server->peers[ i ] == peer_socket )
+				uint64_t value;
+				ssize_t result = read( worker->wakeup, &value, sizeof(value) );
+				(void) result;
+
+				if( !more )
 				{
-					server->peers[ i ] = lc_vector_last(server->peers);
-					lc_vector_pop(server->peers);
+					server_arm_poll( worker, worker->wakeup, worker, SERVER_TAG_WAKEUP );
+				}
+				break;
+			}
 
+			case SERVER_TAG_PEER:
+			{
+				server_connection_t* peer = (server_connection_t*) data;
+
+				if( !more )
+				{
+					peer->polled = false;
 				}
+
+				if( peer->socket < 0 )
+				{
+					/* Closed; once its poll is torn down nothing names it. */
+					if( !peer->polled )
+					{
+						server_free_retired( worker, peer );
+					}
+				}
+				else if( cqe.res < 0 || (cqe.res & (POLLERR | POLLHUP)) || (!more && !(peer->polled = server_arm_poll( worker, peer->socket, peer, SERVER_TAG_PEER ))) )
+				{
+					server_close_peer( worker, peer );
+				}
+				else if( peer->waiting != SERVER_CONNECTION_DELAY )
+				{
+					server_handle_peer( worker, peer );
+				}
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	if( !worker->accept_armed && server->running )
+	{
+		server_arm_accept( worker );
+	}
+
+	return true;
+}
+
+void server_arm_accept( server_worker_t* worker )
+{
+	struct io_uring_sqe* sqe = uring_sqe( worker->ring );
+
+	if( sqe )
+	{
+		sqe->opcode       = IORING_OP_ACCEPT;
+		sqe->fd           = worker->socket;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->ioprio       = worker->accept_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+		sqe->user_data    = (uint64_t) (uintptr_t) worker | SERVER_TAG_ACCEPT;
+		worker->accept_armed = true;
+	}
+}
+
+/* Edge-triggered like the epoll backend; completions name data. */
+bool server_arm_poll( server_worker_t* worker, int socket, void* data, uint64_t tag )
+{
+	struct io_uring_sqe* sqe = uring_sqe( worker->ring );
+
+	if( !sqe )
+	{
+		return false;
+	}
+
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = socket;
+	sqe->poll32_events = POLLIN | POLLOUT | POLLRDHUP;
+	sqe->len           = IORING_POLL_ADD_MULTI;
+	sqe->user_data     = (uint64_t) (uintptr_t) data | tag;
+	return true;
+}
+
+/* Queues the removal of a closed peer's poll; its last completion then frees the peer. */
+bool server_remove_poll( server_worker_t* worker, server_connection_t* peer )
+{
+	struct io_uring_sqe* sqe = uring_sqe( worker->ring );
+
+	if( !sqe )
+	{
+		return false;
+	}
+
+	sqe->opcode    = IORING_OP_POLL_REMOVE;
+	sqe->addr      = (uint64_t) (uintptr_t) peer | SERVER_TAG_PEER;
+	sqe->user_data = SERVER_TAG_IGNORE;
+	return true;
+}
+
+/* Queues the removals there was no room for when their peers closed. */
+void server_remove_polls( server_worker_t* worker )
+{
+	for( size_t i = 0; i < lc_vector_size(worker->retired) && worker->unpolled > 0; i++ )
+	{
+		server_connection_t* peer = worker->retired[ i ];
+
+		if( peer->unpolled && server_remove_poll( worker, peer ) )
+		{
+			peer->unpolled = false;
+			worker->unpolled -= 1;
+		}
+	}
+}
+
+void server_free_retired( server_worker_t* worker, server_connection_t* peer )
+{
+	server_connection_t* last = lc_vector_last(worker->retired);
+	worker->retired[ peer->peer_index ] = last;
+	last->peer_index = peer->peer_index;
+	lc_vector_pop(worker->retired);
+
+	if( peer->unpolled )
+	{
+		worker->unpolled -= 1;
+	}
+
+	free( peer );
+}
+
+void server_accept_peers( server_worker_t* worker )
+{
+	/*
+	 * The listener is edge-triggered, so keep
+	 * accepting until the queue is drained.
+	 */
+	for( ;; )
+	{
+		struct sockaddr_storage peer_address;
+		socklen_t peer_address_len = sizeof(peer_address);
+
+		int peer_socket = accept4( worker->socket, (struct sockaddr *) &peer_address, &peer_address_len, SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+		if( peer_socket < 0 )
+		{
+			if( errno == EINTR || errno == ECONNABORTED )
+			{
+				continue;
+			}
+			if( errno != EAGAIN && errno != EWOULDBLOCK )
+			{
+				atomic_store_explicit( &worker->accept_failures, atomic_load_explicit( &worker->accept_failures, memory_order_relaxed ) + 1, memory_order_relaxed );
+				perror( "Problem" );
 			}
+			break;
+		}
+
+		server_add_peer( worker, peer_socket, &peer_address );
+	}
+}
+
+/*
+ * Registers an accepted peer and gives the handler a first go at
+ * it. The address is looked up when the accept did not report it.
+ */
+void server_add_peer( server_worker_t* worker, int peer_socket, const struct sockaddr_storage* peer_address )
+{
+	server_t* server = worker->server;
+	server_connection_t* peer = malloc( sizeof(server_connection_t) );
+
+	if( !peer )
+	{
+		close( peer_socket );
+		return;
+	}
 
+	if( peer_address )
+	{
+		peer->address = *peer_address;
+	}
+	else
+	{
+		socklen_t peer_address_len = sizeof(peer->address);
+
+		if( getpeername( peer_socket, (struct sockaddr *) &peer->address, &peer_address_len ) < 0 )
+		{
+			memset( &peer->address, 0, sizeof(peer->address) );
+		}
+	}
+
+	peer->overloaded = !server_admit( server, &peer->address );
+
+	if( peer->overloaded )
+	{
+		atomic_store_explicit( &worker->rejected, atomic_load_explicit( &worker->rejected, memory_order_relaxed ) + 1, memory_order_relaxed );
+
+		/* Answering costs a little too; past a point just hang up. */
+		if( worker->overloaded >= SERVER_MAX_OVERLOADED )
+		{
 			close( peer_socket );
+			free( peer );
+			return;
 		}
+
+		worker->overloaded += 1;
+	}
+
+	if( server->no_delay )
+	{
+		int option_no_delay = 1;
+		setsockopt( peer_socket, IPPROTO_TCP, TCP_NODELAY, &option_no_delay, sizeof(option_no_delay) );
 	}
 
-	close( server->socket );
+	peer->socket     = peer_socket;
+	peer->data       = NULL;
+	peer->worker     = worker->index;
+	peer->peer_index = lc_vector_size(worker->peers);
+	peer->waiting    = SERVER_CONNECTION_READ;
+	peer->timeout    = 0;
+	peer->delay      = 0;
+	peer->polled     = false;
+	peer->unpolled   = false;
+	timer_wheel_entry_init( &peer->timer, peer );
+
+	struct epoll_event event = {
+		.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.ptr = peer
+	};
+
+	if( worker->ring ? !(peer->polled = server_arm_poll( worker, peer_socket, peer, SERVER_TAG_PEER ))
+	                 : epoll_ctl( worker->poll, EPOLL_CTL_ADD, peer_socket, &event ) < 0 )
+	{
+		if( peer->overloaded )
+		{
+			worker->overloaded -= 1;
+		}
+		else
+		{
+			server_release( server, &peer->address );
+		}
+
+		close( peer_socket );
+		free( peer );
+		return;
+	}
+
+	lc_vector_push( worker->peers, peer );
+	server_handle_peer( worker, peer );
 }
 
+void server_handle_peer( server_worker_t* worker, server_connection_t* peer )
+{
+	peer->waiting = worker->handle_connection( worker->server, peer, worker->server->user_data );
+
+	if( peer->waiting == SERVER_CONNECTION_CLOSE )
+	{
+		server_close_peer( worker, peer );
+	}
+	else if( peer->waiting == SERVER_CONNECTION_DELAY )
+	{
+		/* Events are ignored until the delay is up. */
+		timer_wheel_schedule( &worker->timers, &peer->timer, server_now() + (peer->delay > 0 ? peer->delay : 0) );
+	}
+	else if( peer->timeout > 0 )
+	{
+		timer_wheel_schedule( &worker->timers, &peer->timer, server_now() + peer->timeout );
+	}
+	else
+	{
+		timer_wheel_cancel( &worker->timers, &peer->timer );
+	}
+}
+
+/* How long the event loop may wait before a timer is due; -1 for no limit. */
+int server_next_timeout( server_worker_t* worker )
+{
+	int64_t next = timer_wheel_next( &worker->timers );
+
+	if( next < 0 )
+	{
+		return -1;
+	}
+
+	int64_t wait = next - server_now();
+	return wait <= 0 ? 0 : wait > INT_MAX ? INT_MAX : (int) wait;
+}
+
+/*
+ * Hands delayed peers whose time is up back to the handler and
+ * closes peers that kept it waiting past their timeout.
+ */
+void server_expire_timers( server_worker_t* worker )
+{
+	int64_t now = server_now();
+	timer_wheel_entry_t* entry;
+
+	while( (entry = timer_wheel_expire( &worker->timers, now )) )
+	{
+		server_connection_t* peer = (server_connection_t*) entry->data;
+
+		if( peer->waiting == SERVER_CONNECTION_DELAY )
+		{
+			peer->waiting = SERVER_CONNECTION_WRITE;
+			server_handle_peer( worker, peer );
+		}
+		else
+		{
+			server_close_peer( worker, peer );
+		}
+	}
+}
+
+void server_close_peer( server_worker_t* worker, server_connection_t* peer )
+{
+	if( worker->handle_close )
+	{
+		worker->handle_close( worker->server, peer, worker->server->user_data );
+	}
+
+	if( peer->overloaded )
+	{
+		worker->overloaded -= 1;
+	}
+	else
+	{
+		server_release( worker->server, &peer->address );
+	}
+
+	server_connection_t* last = lc_vector_last(worker->peers);
+	worker->peers[ peer->peer_index ] = last;
+	last->peer_index = peer->peer_index;
+	lc_vector_pop(worker->peers);
+
+	timer_wheel_cancel( &worker->timers, &peer->timer );
+
+	/* Closing the descriptor also removes it from the epoll set. */
+	close( peer->socket );
+	peer->socket = -1;
+
+	/*
+	 * An armed io_uring poll holds on to the socket and names the
+	 * peer, so the peer is kept until the poll's last completion.
+	 * A removal that doesn't fit in the ring is queued later.
+	 */
+	if( worker->ring && peer->polled )
+	{
+		peer->peer_index = lc_vector_size(worker->retired);
+		lc_vector_push( worker->retired, peer );
+
+		if( !server_remove_poll( worker, peer ) )
+		{
+			peer->unpolled = true;
+			worker->unpolled += 1;
+		}
+	}
+	else
+	{
+		free( peer );
+	}
+}
+
+/* Counts the peer against the limits, unless that would exceed one. */
+bool server_admit( server_t* server, const struct sockaddr_storage* address )
+{
+	if( server->max_connections > 0 &&
+	    atomic_fetch_add_explicit( &server->connections, 1, memory_order_relaxed ) >= server->max_connections )
+	{
+		atomic_fetch_sub_explicit( &server->connections, 1, memory_order_relaxed );
+		return false;
+	}
+
+	if( server->max_per_address > 0 )
+	{
+		int family;
+		uint8_t bytes[ 16 ];
+		bool admitted = false;
+
+		pthread_mutex_lock( &server->addresses_lock );
+		server_address_t** link = server_find_address( server, address, &family, bytes );
+
+		if( !*link && (*link = malloc( sizeof(server_address_t) )) )
+		{
+			(*link)->family      = family;
+			(*link)->connections = 0;
+			(*link)->next        = NULL;
+			memcpy( (*link)->bytes, bytes, sizeof(bytes) );
+		}
+
+		if( *link && (*link)->connections < server->max_per_address )
+		{
+			(*link)->connections += 1;
+			admitted = true;
+		}
+		pthread_mutex_unlock( &server->addresses_lock );
+
+		if( !admitted )
+		{
+			if( server->max_connections > 0 )
+			{
+				atomic_fetch_sub_explicit( &server->connections, 1, memory_order_relaxed );
+			}
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void server_release( server_t* server, const struct sockaddr_storage* address )
+{
+	if( server->max_connections > 0 )
+	{
+		atomic_fetch_sub_explicit( &server->connections, 1, memory_order_relaxed );
+	}
+
+	if( server->max_per_address > 0 )
+	{
+		int family;
+		uint8_t bytes[ 16 ];
+
+		pthread_mutex_lock( &server->addresses_lock );
+		server_address_t** link = server_find_address( server, address, &family, bytes );
+		server_address_t* entry = *link;
+
+		if( entry && --entry->connections == 0 )
+		{
+			*link = entry->next;
+			free( entry );
+		}
+		pthread_mutex_unlock( &server->addresses_lock );
+	}
+}
+
+/*
+ * The link that holds the entry for the address, or the empty
+ * link at the end of its chain. Call with the lock held.
+ */
+server_address_t** server_find_address( server_t* server, const struct sockaddr_storage* address, int* family, uint8_t* bytes )
+{
+	size_t length = 0;
+	uint32_t hash = 2166136261u; /* FNV-1a */
+
+	memset( bytes, 0, 16 );
+	*family = address->ss_family;
+
+	if( address->ss_family == AF_INET )
+	{
+		length = 4;
+		memcpy( bytes, &((const struct sockaddr_in*) address)->sin_addr, length );
+	}
+	else if( address->ss_family == AF_INET6 )
+	{
+		length = 16;
+		memcpy( bytes, &((const struct sockaddr_in6*) address)->sin6_addr, length );
+	}
+
+	for( size_t i = 0; i < length; i++ )
+	{
+		hash = (hash ^ bytes[ i ]) * 16777619u;
+	}
+
+	server_address_t** link = &server->addresses[ hash % SERVER_ADDRESS_BUCKETS ];
+
+	while( *link && ((*link)->family != *family || memcmp( (*link)->bytes, bytes, 16 ) != 0) )
+	{
+		link = &(*link)->next;
+	}
+
+	return link;
+}
+
+int64_t server_now( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -21,22 +21,81 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include "timer_wheel.h"
 
 struct server;
 typedef struct server server_t;
 
-typedef void (*server_connection_fxn_t)( server_t* server, int peer_socket, struct sockaddr_storage* peer_address, void* user_data );
+/*
+ * Connection handlers are resumable. They are invoked when a peer
+ * is accepted and then every time its socket becomes ready again,
+ * and they report what the connection is waiting on. A peer left
+ * waiting to read or write past its timeout is closed.
+ */
+typedef enum server_connection_status {
+	SERVER_CONNECTION_CLOSE = 0, /* handler is finished with the peer */
+	SERVER_CONNECTION_READ,      /* waiting for the peer to send more data */
+	SERVER_CONNECTION_WRITE,     /* waiting for room in the send buffer */
+	SERVER_CONNECTION_DELAY,     /* to be resumed after delay milliseconds */
+} server_connection_status_t;
+
+typedef struct server_connection {
+	int socket;
+	struct sockaddr_storage address;
+	void* data;        /* state owned by the connection handler */
+	int worker;        /* index of the worker that owns the peer */
+	size_t peer_index; /* position in the worker's peer table */
+	server_connection_status_t waiting; /* what the handler last asked for */
+	int timeout;                        /* set by the handler with READ or WRITE: milliseconds, or 0 for none */
+	int delay;                          /* set by the handler with SERVER_CONNECTION_DELAY */
+	timer_wheel_entry_t timer;          /* the timeout or the end of the delay */
+	bool overloaded;                    /* over a connection limit; to be turned away */
+	bool polled;                        /* io_uring: a poll naming the peer is armed */
+	bool unpolled;                      /* io_uring: closed, with the poll's removal yet to be queued */
+} server_connection_t;
+
+/*
+ * The state of a worker's listening socket. The queue figures
+ * come from TCP_INFO and are zero where it is not supported.
+ */
+typedef struct server_listen_stats {
+	uint32_t queued;          /* connections waiting to be accepted */
+	uint32_t queue_size;      /* backlog the kernel allows */
+	uint64_t accept_failures; /* accept() errors such as EMFILE */
+	uint64_t rejected;        /* peers turned away by a connection limit */
+} server_listen_stats_t;
+
+/*
+ * How workers wait on their sockets. With io_uring, accepts and
+ * readiness are delivered by multishot requests, so a busy worker
+ * makes one system call per loop instead of one per event.
+ */
+typedef enum server_io_backend {
+	SERVER_IO_EPOLL = 0,
+	SERVER_IO_URING,
+} server_io_backend_t;
+
+typedef server_connection_status_t (*server_connection_fxn_t)( server_t* server, server_connection_t* connection, void* user_data );
+typedef void (*server_close_fxn_t)( server_t* server, server_connection_t* connection, void* user_data );
 
-server_t* server_create     ( bool use_ip4, int connection_queue, void* user_data );
+server_t* server_create     ( bool use_ip4, int connection_queue, int workers, void* user_data );
 void      server_destroy    ( server_t** server );
 int       server_socket     ( server_t* server );
+int       server_workers    ( server_t* server );
+void      server_set_no_delay ( server_t* server, bool no_delay );
+void      server_set_io_backend ( server_t* server, server_io_backend_t backend );
+void      server_set_limits ( server_t* server, int max_connections, int max_per_address );
+server_io_backend_t server_io_backend ( server_t* server );
+bool      server_listen_stats ( server_t* server, int worker, server_listen_stats_t* stats );
 bool      server_is_running ( server_t* server );
 bool      server_start      ( server_t* server, const char* localhost, int port );
 void      server_stop       ( server_t* server );
-void      server_run        ( server_t* server, server_connection_fxn_t handle_connection );
+void      server_run        ( server_t* server, server_connection_fxn_t handle_connection, server_close_fxn_t handle_close );
 
 #endif /* __SERVER_H__ */
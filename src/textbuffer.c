@@ -22,25 +22,47 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdarg.h>
-#include <collections/buffer.h>
+#include <string.h>
 #ifdef __linux__
 # include <sys/types.h>
 #endif
 #include "textbuffer.h"
 
+#define TEXTBUFFER_INITIAL_SIZE  512
 
-void textbuffer_create( textbuffer_t* textbuffer )
+static bool textbuffer_grow( textbuffer_t* p_buffer, size_t size );
+
+
+void textbuffer_create( textbuffer_t* textbuffer, arena_t* arena )
 {
-	textbuffer->buffer = lc_buffer_create( 512, false );
-	textbuffer->count  = 0;
+	textbuffer->data  = NULL;
+	textbuffer->size  = 0;
+	textbuffer->count = 0;
+	textbuffer->arena = arena;
 }
 
 void textbuffer_destroy( textbuffer_t* textbuffer )
 {
 	if( textbuffer )
 	{
-		lc_buffer_destroy( &textbuffer->buffer );
+		textbuffer_release( textbuffer );
+	}
+}
+
+/*
+ * Empties the buffer and lets go of its storage; must be called
+ * before the arena it came from is reset.
+ */
+void textbuffer_release( textbuffer_t* textbuffer )
+{
+	if( !textbuffer->arena )
+	{
+		free( textbuffer->data );
 	}
+
+	textbuffer->data  = NULL;
+	textbuffer->size  = 0;
+	textbuffer->count = 0;
 }
 
 bool textbuffer_printf( textbuffer_t *p_buffer, const char *format, ... )
@@ -55,42 +77,200 @@ bool textbuffer_printf( textbuffer_t *p_buffer, const char *format, ... )
 	return result;
 }
 
-bool textbuffer_vprintf( textbuffer_t* p_buffer, const char *format, va_list args )
+/*
+ * Makes room for length more characters and returns where they
+ * go; the caller advances count by however many it writes.
+ */
+char* textbuffer_reserve( textbuffer_t* p_buffer, size_t length )
 {
-	bool result = false;
-	va_list args_copy;
-	va_copy(args_copy, args);
+	if( p_buffer->size < p_buffer->count + length + 1 && !textbuffer_grow( p_buffer, p_buffer->count + length + 1 ) )
+	{
+		return NULL;
+	}
 
-	const int GROWTH = 64;
+	return p_buffer->data + p_buffer->count;
+}
 
-retry:
+bool textbuffer_vprintf( textbuffer_t* p_buffer, const char *format, va_list args )
+{
+	for( ;; )
 	{
-		ssize_t size_remaining = lc_buffer_size(p_buffer->buffer) - p_buffer->count;
-		char* text = (char*) lc_buffer_data(p_buffer->buffer) + p_buffer->count;
-		ssize_t ret = vsnprintf( text, size_remaining, format, args );
-		text[ size_remaining - 1 ] = '\0';
+		char* text = textbuffer_reserve( p_buffer, 0 );
 
-		if( ret >= size_remaining )
+		if( !text )
 		{
-			// buffer is too small
-			if( lc_buffer_resize( &p_buffer->buffer, lc_buffer_size(p_buffer->buffer) + ret + GROWTH + 1 ) )
-			{
-				va_end( args );
-				va_copy( args, args_copy );
-				goto retry;
-			}
-			else
-			{
-				fprintf( stderr, "ERROR: Unable to resize buffer.\n" );
-				result = false;
-			}
+			return false;
 		}
-		else if( ret > 0 )
+
+		size_t size_remaining = p_buffer->size - p_buffer->count;
+		va_list args_copy;
+		va_copy( args_copy, args );
+		int ret = vsnprintf( text, size_remaining, format, args_copy );
+		va_end( args_copy );
+
+		if( ret < 0 )
+		{
+			return false;
+		}
+		else if( (size_t) ret < size_remaining )
 		{
 			p_buffer->count += ret;
+			return true;
+		}
+		else if( !textbuffer_reserve( p_buffer, ret ) )
+		{
+			return false;
 		}
 	}
-	va_end( args_copy );
+}
 
-	return result;
+/*
+ * The appenders below write straight into the buffer; they are
+ * much cheaper than textbuffer_printf() for the common case of
+ * fixed text interleaved with a few names and numbers.
+ */
+bool textbuffer_append( textbuffer_t* p_buffer, const char* text, size_t length )
+{
+	char* out = textbuffer_reserve( p_buffer, length );
+
+	if( !out )
+	{
+		return false;
+	}
+
+	memcpy( out, text, length );
+	p_buffer->count += length;
+	out[ length ] = '\0';
+	return true;
+}
+
+bool textbuffer_append_int( textbuffer_t* p_buffer, int64_t value )
+{
+	if( value < 0 )
+	{
+		return textbuffer_append_literal( p_buffer, "-" ) &&
+		       textbuffer_append_uint( p_buffer, -(uint64_t) value );
+	}
+
+	return textbuffer_append_uint( p_buffer, value );
+}
+
+bool textbuffer_append_uint( textbuffer_t* p_buffer, uint64_t value )
+{
+	char digits[ 20 ];
+	size_t count = sizeof(digits);
+
+	do
+	{
+		digits[ --count ] = '0' + value % 10;
+		value /= 10;
+	} while( value > 0 );
+
+	return textbuffer_append( p_buffer, digits + count, sizeof(digits) - count );
+}
+
+/* Escapes text for use in HTML content or a quoted attribute. */
+bool textbuffer_append_html( textbuffer_t* p_buffer, const char* text, size_t length )
+{
+	char* out = textbuffer_reserve( p_buffer, 6 * length ); /* "&quot;" is the longest */
+
+	if( !out )
+	{
+		return false;
+	}
+
+	char* start = out;
+
+	for( size_t i = 0; i < length; i++ )
+	{
+		switch( text[ i ] )
+		{
+			case '&':  memcpy( out, "&amp;", 5 );  out += 5; break;
+			case '<':  memcpy( out, "&lt;", 4 );   out += 4; break;
+			case '>':  memcpy( out, "&gt;", 4 );   out += 4; break;
+			case '"':  memcpy( out, "&quot;", 6 ); out += 6; break;
+			case '\'': memcpy( out, "&#39;", 5 );  out += 5; break;
+			default:   *out++ = text[ i ]; break;
+		}
+	}
+
+	p_buffer->count += out - start;
+	*out = '\0';
+	return true;
+}
+
+/*
+ * Percent-encodes everything but unreserved characters and '/',
+ * so a path can be used as a link.
+ */
+bool textbuffer_append_url( textbuffer_t* p_buffer, const char* text, size_t length )
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char* out = textbuffer_reserve( p_buffer, 3 * length );
+
+	if( !out )
+	{
+		return false;
+	}
+
+	char* start = out;
+
+	for( size_t i = 0; i < length; i++ )
+	{
+		unsigned char c = text[ i ];
+
+		if( (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		    c == '-' || c == '.' || c == '_' || c == '~' || c == '/' )
+		{
+			*out++ = c;
+		}
+		else
+		{
+			*out++ = '%';
+			*out++ = hex[ c >> 4 ];
+			*out++ = hex[ c & 0x0F ];
+		}
+	}
+
+	p_buffer->count += out - start;
+	*out = '\0';
+	return true;
+}
+
+/* The text from offset on, ready to hand to writev()/sendmsg(). */
+struct iovec textbuffer_iovec( const textbuffer_t* p_buffer, size_t offset )
+{
+	struct iovec iovec = { .iov_base = NULL, .iov_len = 0 };
+
+	if( offset < p_buffer->count )
+	{
+		iovec.iov_base = p_buffer->data + offset;
+		iovec.iov_len  = p_buffer->count - offset;
+	}
+
+	return iovec;
+}
+
+/* Doubles the storage until it holds size bytes. */
+bool textbuffer_grow( textbuffer_t* p_buffer, size_t size )
+{
+	size_t new_size = p_buffer->size ? 2 * p_buffer->size : TEXTBUFFER_INITIAL_SIZE;
+
+	while( new_size < size )
+	{
+		new_size *= 2;
+	}
+
+	char* data = p_buffer->arena ? arena_grow( p_buffer->arena, p_buffer->data, p_buffer->count, new_size )
+	                             : realloc( p_buffer->data, new_size );
+
+	if( !data )
+	{
+		fprintf( stderr, "ERROR: Unable to resize buffer.\n" );
+		return false;
+	}
+
+	p_buffer->data = data;
+	p_buffer->size = new_size;
+	return true;
 }
@@ -21,15 +21,39 @@
 #ifndef __TEXTBUFFER_H__
 #define __TEXTBUFFER_H__
 
-#include <collections/buffer.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "arena.h"
 
+/*
+ * Growable text. The storage comes from the arena when one is
+ * given (and goes away when the arena is reset), otherwise from
+ * malloc(); it is only allocated once something is written.
+ */
 typedef struct textbuffer {
-	lc_buffer_t* buffer;
+	char* data;
+	size_t size;
 	size_t count; /* characters written */
+	arena_t* arena;
 } textbuffer_t;
 
-void textbuffer_create( textbuffer_t* textbuffer );
+void textbuffer_create( textbuffer_t* textbuffer, arena_t* arena );
 void textbuffer_destroy( textbuffer_t* textbuffer );
+void textbuffer_release( textbuffer_t* textbuffer );
 bool textbuffer_printf( textbuffer_t *p_buffer, const char *format, ... );
 bool textbuffer_vprintf( textbuffer_t* p_buffer, const char *format, va_list ap );
+char* textbuffer_reserve( textbuffer_t* p_buffer, size_t length );
+bool textbuffer_append( textbuffer_t* p_buffer, const char* text, size_t length );
+bool textbuffer_append_int( textbuffer_t* p_buffer, int64_t value );
+bool textbuffer_append_uint( textbuffer_t* p_buffer, uint64_t value );
+bool textbuffer_append_html( textbuffer_t* p_buffer, const char* text, size_t length );
+bool textbuffer_append_url( textbuffer_t* p_buffer, const char* text, size_t length );
+struct iovec textbuffer_iovec( const textbuffer_t* p_buffer, size_t offset );
+
+/* Appends a string literal without measuring it at run time. */
+#define textbuffer_append_literal( p_buffer, literal ) \
+	textbuffer_append( (p_buffer), "" literal, sizeof(literal) - 1 )
 #endif /* __TEXTBUFFER_H__ */
@@ -0,0 +1,250 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE  ((int64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void timer_wheel_link    ( timer_wheel_entry_t* head, timer_wheel_entry_t* entry );
+static void timer_wheel_unlink  ( timer_wheel_entry_t* entry );
+static void timer_wheel_place   ( timer_wheel_t* wheel, timer_wheel_entry_t* entry );
+static void timer_wheel_cascade ( timer_wheel_t* wheel, int level );
+static bool timer_wheel_cascades( const timer_wheel_t* wheel, int64_t tick );
+
+void timer_wheel_init( timer_wheel_t* wheel, int64_t now )
+{
+	for( int level = 0; level < TIMER_WHEEL_LEVELS; level++ )
+	{
+		for( int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++ )
+		{
+			timer_wheel_entry_t* head = &wheel->slots[ level ][ slot ];
+			head->next = head;
+			head->prev = head;
+		}
+	}
+
+	wheel->expired.next = &wheel->expired;
+	wheel->expired.prev = &wheel->expired;
+	wheel->current      = now;
+	wheel->count        = 0;
+}
+
+void timer_wheel_entry_init( timer_wheel_entry_t* entry, void* data )
+{
+	entry->next    = NULL;
+	entry->prev    = NULL;
+	entry->expires = 0;
+	entry->data    = data;
+}
+
+/* Schedules the entry, moving it if it was already scheduled. */
+void timer_wheel_schedule( timer_wheel_t* wheel, timer_wheel_entry_t* entry, int64_t expires )
+{
+	timer_wheel_cancel( wheel, entry );
+	entry->expires = expires;
+	timer_wheel_place( wheel, entry );
+	wheel->count += 1;
+}
+
+void timer_wheel_cancel( timer_wheel_t* wheel, timer_wheel_entry_t* entry )
+{
+	if( entry->prev )
+	{
+		timer_wheel_unlink( entry );
+		wheel->count -= 1;
+	}
+}
+
+bool timer_wheel_pending( const timer_wheel_entry_t* entry )
+{
+	return entry->prev != NULL;
+}
+
+/*
+ * The tick by which the wheel should be looked at again, or -1
+ * when nothing is scheduled. It is exact for timers due within
+ * the next 64 ticks; otherwise it is where the next slot of an
+ * upper level comes down, which may turn out to hold nothing.
+ */
+int64_t timer_wheel_next( const timer_wheel_t* wheel )
+{
+	if( wheel->count == 0 )
+	{
+		return -1;
+	}
+
+	if( wheel->expired.next != &wheel->expired )
+	{
+		return wheel->current - 1;
+	}
+
+	for( int64_t tick = wheel->current; ; tick++ )
+	{
+		const timer_wheel_entry_t* head = &wheel->slots[ 0 ][ tick & TIMER_WHEEL_MASK ];
+
+		/* The current tick may bring timers down that are due within it. */
+		if( head->next != head || ((tick & TIMER_WHEEL_MASK) == 0 && (tick > wheel->current || timer_wheel_cascades( wheel, tick ))) )
+		{
+			return tick;
+		}
+	}
+}
+
+/*
+ * Hands out the next entry due by now, unscheduled, or NULL once
+ * there are none. Entries scheduled again while these are being
+ * handed out wait for at least the next tick.
+ */
+timer_wheel_entry_t* timer_wheel_expire( timer_wheel_t* wheel, int64_t now )
+{
+	while( wheel->expired.next == &wheel->expired && wheel->current <= now )
+	{
+		if( wheel->count == 0 )
+		{
+			wheel->current = now + 1;
+			break;
+		}
+
+		if( (wheel->current & TIMER_WHEEL_MASK) == 0 )
+		{
+			/* Bring down every upper level whose slot starts here, highest first. */
+			int top = 1;
+
+			while( top < TIMER_WHEEL_LEVELS - 1 && ((wheel->current >> (TIMER_WHEEL_BITS * top)) & TIMER_WHEEL_MASK) == 0 )
+			{
+				top++;
+			}
+
+			for( int level = top; level > 0; level-- )
+			{
+				timer_wheel_cascade( wheel, level );
+			}
+		}
+
+		timer_wheel_entry_t* head = &wheel->slots[ 0 ][ wheel->current & TIMER_WHEEL_MASK ];
+
+		if( head->next != head )
+		{
+			/* Splice the whole slot onto the expired list. */
+			wheel->expired.next       = head->next;
+			wheel->expired.prev       = head->prev;
+			head->next->prev          = &wheel->expired;
+			head->prev->next          = &wheel->expired;
+			head->next                = head;
+			head->prev                = head;
+		}
+
+		wheel->current += 1;
+	}
+
+	timer_wheel_entry_t* entry = wheel->expired.next;
+
+	if( entry == &wheel->expired )
+	{
+		return NULL;
+	}
+
+	timer_wheel_unlink( entry );
+	wheel->count -= 1;
+	return entry;
+}
+
+void timer_wheel_link( timer_wheel_entry_t* head, timer_wheel_entry_t* entry )
+{
+	entry->prev      = head->prev;
+	entry->next      = head;
+	head->prev->next = entry;
+	head->prev       = entry;
+}
+
+void timer_wheel_unlink( timer_wheel_entry_t* entry )
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next       = NULL;
+	entry->prev       = NULL;
+}
+
+/* Links the entry into the slot covering its expiry at the lowest level that reaches it. */
+void timer_wheel_place( timer_wheel_t* wheel, timer_wheel_entry_t* entry )
+{
+	int64_t expires = entry->expires;
+
+	if( expires < wheel->current )
+	{
+		expires = wheel->current;
+	}
+	else if( expires - wheel->current >= TIMER_WHEEL_RANGE )
+	{
+		expires = wheel->current + TIMER_WHEEL_RANGE - 1;
+	}
+
+	int64_t delta = expires - wheel->current;
+	int level = 0;
+
+	while( level < TIMER_WHEEL_LEVELS - 1 && delta >= (int64_t) 1 << (TIMER_WHEEL_BITS * (level + 1)) )
+	{
+		level++;
+	}
+
+	timer_wheel_link( &wheel->slots[ level ][ (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK ], entry );
+}
+
+/* Whether a slot of an upper level that comes down at the tick holds anything. */
+bool timer_wheel_cascades( const timer_wheel_t* wheel, int64_t tick )
+{
+	for( int level = 1; level < TIMER_WHEEL_LEVELS; level++ )
+	{
+		const timer_wheel_entry_t* head = &wheel->slots[ level ][ (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK ];
+
+		if( head->next != head )
+		{
+			return true;
+		}
+
+		if( level < TIMER_WHEEL_LEVELS - 1 && ((tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK) != 0 )
+		{
+			/* The levels above only come down when this one wraps. */
+			break;
+		}
+	}
+
+	return false;
+}
+
+/* Places again every entry in the level's slot that starts at the current tick. */
+void timer_wheel_cascade( timer_wheel_t* wheel, int level )
+{
+	timer_wheel_entry_t* head = &wheel->slots[ level ][ (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK ];
+	timer_wheel_entry_t* entry = head->next;
+
+	/* Detached first, since an entry may land in this same slot again. */
+	head->prev->next = NULL;
+	head->next       = head;
+	head->prev       = head;
+
+	while( entry && entry != head )
+	{
+		timer_wheel_entry_t* next = entry->next;
+		timer_wheel_place( wheel, entry );
+		entry = next;
+	}
+}
@@ -0,0 +1,62 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel. Each level has 64 slots, each slot
+ * 64 times wider than one on the level below, so scheduling and
+ * cancelling are O(1) and timers only move down a level when
+ * their slot comes around. Ticks are whatever unit the caller
+ * passes as the time; timers further out than 64^4 ticks wait
+ * on the last level and are placed again when they get there.
+ */
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct timer_wheel_entry {
+	struct timer_wheel_entry* next;
+	struct timer_wheel_entry* prev; /* NULL while not scheduled */
+	int64_t expires;
+	void* data;
+} timer_wheel_entry_t;
+
+typedef struct timer_wheel {
+	timer_wheel_entry_t slots[ TIMER_WHEEL_LEVELS ][ TIMER_WHEEL_SLOTS ]; /* list heads */
+	timer_wheel_entry_t expired; /* due, waiting to be handed out */
+	int64_t current;             /* next tick to look at */
+	size_t count;                /* scheduled, including expired */
+} timer_wheel_t;
+
+void                 timer_wheel_init       ( timer_wheel_t* wheel, int64_t now );
+void                 timer_wheel_entry_init ( timer_wheel_entry_t* entry, void* data );
+void                 timer_wheel_schedule   ( timer_wheel_t* wheel, timer_wheel_entry_t* entry, int64_t expires );
+void                 timer_wheel_cancel     ( timer_wheel_t* wheel, timer_wheel_entry_t* entry );
+bool                 timer_wheel_pending    ( const timer_wheel_entry_t* entry );
+int64_t              timer_wheel_next       ( const timer_wheel_t* wheel );
+timer_wheel_entry_t* timer_wheel_expire     ( timer_wheel_t* wheel, int64_t now );
+
+#endif /* __TIMER_WHEEL_H__ */
@@ -0,0 +1,226 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/*
+ * Besides a single mmap() of both rings, the server relies on
+ * waiting with a timeout (5.11) and multishot polls (5.13, which
+ * is when resource tags appeared).
+ */
+#define URING_REQUIRED_FEATURES  (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS)
+
+struct uring {
+	int fd;
+	void* rings;        /* submission and completion rings share a mapping */
+	size_t rings_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	/* submission ring */
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_queued;  /* tail not yet published to the kernel */
+	/* completion ring */
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+static int uring_enter( uring_t* ring, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* argument, size_t argument_size );
+static unsigned int uring_publish( uring_t* ring );
+static bool uring_submit( uring_t* ring );
+
+
+/* Returns NULL when the kernel lacks io_uring or a feature it needs. */
+uring_t* uring_create( unsigned int entries )
+{
+	uring_t* ring = calloc( 1, sizeof(uring_t) );
+
+	if( !ring )
+	{
+		return NULL;
+	}
+
+	struct io_uring_params params;
+	memset( &params, 0, sizeof(params) );
+	ring->fd    = syscall( __NR_io_uring_setup, entries, &params );
+	ring->rings = MAP_FAILED;
+	ring->sqes  = MAP_FAILED;
+
+	if( ring->fd < 0 || (params.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES )
+	{
+		uring_destroy( &ring );
+		return NULL;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->sqes_size  = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->rings = mmap( NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	ring->sqes  = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+
+	if( ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED )
+	{
+		uring_destroy( &ring );
+		return NULL;
+	}
+
+	char* rings = ring->rings;
+	ring->sq_head    = (unsigned int*) (rings + params.sq_off.head);
+	ring->sq_tail    = (unsigned int*) (rings + params.sq_off.tail);
+	ring->sq_array   = (unsigned int*) (rings + params.sq_off.array);
+	ring->sq_mask    = *(unsigned int*) (rings + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->cq_head    = (unsigned int*) (rings + params.cq_off.head);
+	ring->cq_tail    = (unsigned int*) (rings + params.cq_off.tail);
+	ring->cq_mask    = *(unsigned int*) (rings + params.cq_off.ring_mask);
+	ring->cqes       = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+
+	/* Slots map one to one onto entries, so the array never changes. */
+	for( unsigned int i = 0; i < ring->sq_entries; i++ )
+	{
+		ring->sq_array[ i ] = i;
+	}
+
+	return ring;
+}
+
+/* Closing the ring cancels whatever is still in flight. */
+void uring_destroy( uring_t** ring )
+{
+	if( ring && *ring )
+	{
+		uring_t* r = *ring;
+
+		if( r->sqes != MAP_FAILED ) munmap( r->sqes, r->sqes_size );
+		if( r->rings != MAP_FAILED ) munmap( r->rings, r->rings_size );
+		if( r->fd >= 0 ) close( r->fd );
+		free( r );
+		*ring = NULL;
+	}
+}
+
+/*
+ * A cleared entry to fill in. When the ring is full what is
+ * queued is submitted first; NULL only if that fails.
+ */
+struct io_uring_sqe* uring_sqe( uring_t* ring )
+{
+	unsigned int head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+	unsigned int tail = *ring->sq_tail + ring->sq_queued;
+
+	if( tail - head >= ring->sq_entries )
+	{
+		if( !uring_submit( ring ) )
+		{
+			return NULL;
+		}
+
+		head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+		tail = *ring->sq_tail;
+
+		if( tail - head >= ring->sq_entries )
+		{
+			return NULL;
+		}
+	}
+
+	struct io_uring_sqe* sqe = &ring->sqes[ tail & ring->sq_mask ];
+	memset( sqe, 0, sizeof(*sqe) );
+	ring->sq_queued += 1;
+	return sqe;
+}
+
+/*
+ * Submits what is queued and waits up to timeout milliseconds
+ * (-1 for ever) for a completion. A timeout or a signal is not
+ * an error; false means the ring itself failed.
+ */
+bool uring_wait( uring_t* ring, int timeout )
+{
+	struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+	struct io_uring_getevents_arg argument = {
+		.sigmask    = 0,
+		.sigmask_sz = _NSIG / 8,
+		.ts         = timeout >= 0 ? (uint64_t) (uintptr_t) &ts : 0,
+	};
+	unsigned int queued = uring_publish( ring );
+
+	if( uring_enter( ring, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &argument, sizeof(argument) ) < 0 )
+	{
+		return errno == ETIME || errno == EINTR || errno == EBUSY;
+	}
+
+	return true;
+}
+
+/* Copies out the next completion, if there is one. */
+bool uring_next( uring_t* ring, struct io_uring_cqe* cqe )
+{
+	unsigned int head = *ring->cq_head;
+
+	if( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+	{
+		return false;
+	}
+
+	*cqe = ring->cqes[ head & ring->cq_mask ];
+	__atomic_store_n( ring->cq_head, head + 1, __ATOMIC_RELEASE );
+	return true;
+}
+
+int uring_enter( uring_t* ring, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* argument, size_t argument_size )
+{
+	return syscall( __NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, argument, argument_size );
+}
+
+/* Makes the queued entries visible to the kernel; returns how many. */
+unsigned int uring_publish( uring_t* ring )
+{
+	unsigned int queued = ring->sq_queued;
+
+	__atomic_store_n( ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE );
+	ring->sq_queued = 0;
+	return queued;
+}
+
+bool uring_submit( uring_t* ring )
+{
+	unsigned int queued = uring_publish( ring );
+
+	return uring_enter( ring, queued, 0, 0, NULL, 0 ) >= 0 || errno == EBUSY;
+}
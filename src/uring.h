@@ -0,0 +1,43 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring instance driven with raw system calls.
+ * Entries are queued with uring_sqe() and go to the kernel in
+ * one batch on the next uring_wait(), which also collects the
+ * completions to be read back with uring_next().
+ */
+struct uring;
+typedef struct uring uring_t;
+
+uring_t*              uring_create  ( unsigned int entries );
+void                  uring_destroy ( uring_t** ring );
+struct io_uring_sqe*  uring_sqe     ( uring_t* ring );
+bool                  uring_wait    ( uring_t* ring, int timeout );
+bool                  uring_next    ( uring_t* ring, struct io_uring_cqe* cqe );
+
+#endif /* __URING_H__ */
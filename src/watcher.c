@@ -0,0 +1,373 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <collections/vector.h>
+#include "watcher.h"
+
+#define WATCHER_EVENTS  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+                         IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct watcher_subscriber {
+	watcher_fxn_t callback;
+	void* user_data;
+} watcher_subscriber_t;
+
+/*
+ * Watch descriptors are small integers handed out in
+ * increasing order, so they are looked up by open
+ * addressing on the descriptor itself.
+ */
+typedef struct watcher_watch {
+	int wd;         /* 0 marks an empty slot */
+	char* directory;
+} watcher_watch_t;
+
+struct watcher {
+	int inotify;
+	int wakeup;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	watcher_subscriber_t* subscribers;
+	watcher_watch_t* watches;
+	size_t watches_capacity;
+	size_t watches_count;
+};
+
+static void*            watcher_run     ( void* data );
+static void             watcher_notify  ( watcher_t* watcher, const char* directory, const char* name, uint32_t mask );
+static watcher_watch_t* watcher_find    ( watcher_t* watcher, int wd );
+static bool             watcher_insert  ( watcher_t* watcher, int wd, const char* directory );
+static void             watcher_remove  ( watcher_t* watcher, int wd );
+
+
+watcher_t* watcher_create( void )
+{
+	watcher_t* watcher = malloc( sizeof(watcher_t) );
+
+	if( watcher )
+	{
+		watcher->inotify          = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+		watcher->wakeup           = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		watcher->subscribers      = NULL;
+		watcher->watches_capacity = 64;
+		watcher->watches_count    = 0;
+		watcher->watches          = calloc( watcher->watches_capacity, sizeof(watcher_watch_t) );
+
+		if( watcher->inotify < 0 || watcher->wakeup < 0 || !watcher->watches )
+		{
+			if( watcher->inotify >= 0 ) close( watcher->inotify );
+			if( watcher->wakeup >= 0 ) close( watcher->wakeup );
+			free( watcher->watches );
+			free( watcher );
+			return NULL;
+		}
+
+		lc_vector_create( watcher->subscribers, 4 );
+		pthread_mutex_init( &watcher->lock, NULL );
+
+		if( pthread_create( &watcher->thread, NULL, watcher_run, watcher ) != 0 )
+		{
+			close( watcher->inotify );
+			close( watcher->wakeup );
+			pthread_mutex_destroy( &watcher->lock );
+			lc_vector_destroy( watcher->subscribers );
+			free( watcher->watches );
+			free( watcher );
+			return NULL;
+		}
+	}
+
+	return watcher;
+}
+
+void watcher_destroy( watcher_t** watcher )
+{
+	if( watcher && *watcher )
+	{
+		watcher_t* w = *watcher;
+		uint64_t one = 1;
+		ssize_t result = write( w->wakeup, &one, sizeof(one) );
+		(void) result;
+
+		pthread_join( w->thread, NULL );
+
+		for( size_t i = 0; i < w->watches_capacity; i++ )
+		{
+			free( w->watches[ i ].directory );
+		}
+
+		close( w->inotify );
+		close( w->wakeup );
+		pthread_mutex_destroy( &w->lock );
+		lc_vector_destroy( w->subscribers );
+		free( w->watches );
+		free( w );
+		*watcher = NULL;
+	}
+}
+
+/* Subscribers must be registered before the first watch is added. */
+bool watcher_subscribe( watcher_t* watcher, watcher_fxn_t callback, void* user_data )
+{
+	watcher_subscriber_t subscriber = { .callback = callback, .user_data = user_data };
+
+	pthread_mutex_lock( &watcher->lock );
+	lc_vector_push( watcher->subscribers, subscriber );
+	pthread_mutex_unlock( &watcher->lock );
+
+	return true;
+}
+
+/*
+ * Adding a directory that is already watched is cheap; the
+ * kernel hands back the existing watch descriptor.
+ */
+bool watcher_add( watcher_t* watcher, const char* directory )
+{
+	bool result = false;
+
+	pthread_mutex_lock( &watcher->lock );
+
+	int wd = inotify_add_watch( watcher->inotify, directory, WATCHER_EVENTS );
+
+	if( wd > 0 )
+	{
+		watcher_watch_t* watch = watcher_find( watcher, wd );
+
+		if( watch && strcmp( watch->directory, directory ) == 0 )
+		{
+			result = true;
+		}
+		else if( watch )
+		{
+			/* Same directory reached through another path; keep the newest name. */
+			char* copy = strdup( directory );
+
+			if( copy )
+			{
+				free( watch->directory );
+				watch->directory = copy;
+				result = true;
+			}
+		}
+		else
+		{
+			result = watcher_insert( watcher, wd, directory );
+		}
+	}
+
+	pthread_mutex_unlock( &watcher->lock );
+
+	return result;
+}
+
+void* watcher_run( void* data )
+{
+	watcher_t* watcher = (watcher_t*) data;
+	char buffer[ 64 * 1024 ] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	struct pollfd fds[ 2 ] = {
+		{ .fd = watcher->inotify, .events = POLLIN },
+		{ .fd = watcher->wakeup,  .events = POLLIN },
+	};
+
+	for( ;; )
+	{
+		if( poll( fds, 2, -1 ) < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			break;
+		}
+
+		if( fds[ 1 ].revents )
+		{
+			break;
+		}
+
+		ssize_t length = read( watcher->inotify, buffer, sizeof(buffer) );
+
+		if( length <= 0 )
+		{
+			continue;
+		}
+
+		for( char* p = buffer; p < buffer + length; )
+		{
+			const struct inotify_event* event = (const struct inotify_event*) p;
+			p += sizeof(struct inotify_event) + event->len;
+
+			if( event->mask & IN_Q_OVERFLOW )
+			{
+				watcher_notify( watcher, NULL, NULL, event->mask );
+				continue;
+			}
+
+			pthread_mutex_lock( &watcher->lock );
+			watcher_watch_t* watch = watcher_find( watcher, event->wd );
+			char* directory = watch ? strdup( watch->directory ) : NULL;
+
+			if( event->mask & IN_IGNORED )
+			{
+				/* The directory is gone or was unmounted. */
+				watcher_remove( watcher, event->wd );
+			}
+			pthread_mutex_unlock( &watcher->lock );
+
+			if( directory )
+			{
+				watcher_notify( watcher, directory, event->len > 0 ? event->name : NULL, event->mask );
+				free( directory );
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void watcher_notify( watcher_t* watcher, const char* directory, const char* name, uint32_t mask )
+{
+	for( size_t i = 0; i < lc_vector_size(watcher->subscribers); i++ )
+	{
+		watcher->subscribers[ i ].callback( directory, name, mask, watcher->subscribers[ i ].user_data );
+	}
+}
+
+watcher_watch_t* watcher_find( watcher_t* watcher, int wd )
+{
+	size_t mask = watcher->watches_capacity - 1;
+
+	for( size_t i = (size_t) wd & mask; watcher->watches[ i ].wd != 0; i = (i + 1) & mask )
+	{
+		if( watcher->watches[ i ].wd == wd )
+		{
+			return &watcher->watches[ i ];
+		}
+	}
+
+	return NULL;
+}
+
+bool watcher_insert( watcher_t* watcher, int wd, const char* directory )
+{
+	if( (watcher->watches_count + 1) * 2 > watcher->watches_capacity )
+	{
+		/* Keep the table at most half full. */
+		watcher_watch_t* old = watcher->watches;
+		size_t old_capacity = watcher->watches_capacity;
+		watcher_watch_t* watches = calloc( old_capacity * 2, sizeof(watcher_watch_t) );
+
+		if( !watches )
+		{
+			return false;
+		}
+
+		watcher->watches          = watches;
+		watcher->watches_capacity = old_capacity * 2;
+
+		for( size_t i = 0; i < old_capacity; i++ )
+		{
+			if( old[ i ].wd != 0 )
+			{
+				size_t mask = watcher->watches_capacity - 1;
+				size_t j = (size_t) old[ i ].wd & mask;
+
+				while( watches[ j ].wd != 0 )
+				{
+					j = (j + 1) & mask;
+				}
+
+				watches[ j ] = old[ i ];
+			}
+		}
+
+		free( old );
+	}
+
+	char* copy = strdup( directory );
+
+	if( !copy )
+	{
+		return false;
+	}
+
+	size_t mask = watcher->watches_capacity - 1;
+	size_t i = (size_t) wd & mask;
+
+	while( watcher->watches[ i ].wd != 0 )
+	{
+		i = (i + 1) & mask;
+	}
+
+	watcher->watches[ i ].wd        = wd;
+	watcher->watches[ i ].directory = copy;
+	watcher->watches_count += 1;
+
+	return true;
+}
+
+void watcher_remove( watcher_t* watcher, int wd )
+{
+	watcher_watch_t* watch = watcher_find( watcher, wd );
+
+	if( !watch )
+	{
+		return;
+	}
+
+	free( watch->directory );
+	watch->wd        = 0;
+	watch->directory = NULL;
+	watcher->watches_count -= 1;
+
+	/* Re-home the rest of the cluster so lookups do not stop early. */
+	size_t mask = watcher->watches_capacity - 1;
+	size_t i = ((size_t)(watch - watcher->watches) + 1) & mask;
+
+	while( watcher->watches[ i ].wd != 0 )
+	{
+		watcher_watch_t entry = watcher->watches[ i ];
+		watcher->watches[ i ].wd        = 0;
+		watcher->watches[ i ].directory = NULL;
+
+		size_t j = (size_t) entry.wd & mask;
+		while( watcher->watches[ j ].wd != 0 )
+		{
+			j = (j + 1) & mask;
+		}
+		watcher->watches[ j ] = entry;
+
+		i = (i + 1) & mask;
+	}
+}
@@ -0,0 +1,43 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __WATCHER_H__
+#define __WATCHER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Watches directories with inotify on a background thread and
+ * tells subscribers which directory changed. A NULL directory
+ * means events were lost and everything should be considered
+ * stale.
+ */
+struct watcher;
+typedef struct watcher watcher_t;
+
+typedef void (*watcher_fxn_t)( const char* directory, const char* name, uint32_t mask, void* user_data );
+
+watcher_t* watcher_create    ( void );
+void       watcher_destroy   ( watcher_t** watcher );
+bool       watcher_subscribe ( watcher_t* watcher, watcher_fxn_t callback, void* user_data );
+bool       watcher_add       ( watcher_t* watcher, const char* directory );
+
+#endif /* __WATCHER_H__ */
@@ -0,0 +1,118 @@
+/* Copyright (C) 2016 by Joseph A. Marrero, http://www.joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * Checks of the timer wheel: every timer is handed out at the tick
+ * it is due, and timer_wheel_next() never asks for a later wakeup
+ * than the earliest timer.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "../src/timer_wheel.h"
+
+#define CHECK(condition) \
+	do { if( !(condition) ) { fprintf( stderr, "FAILED: %s:%d: %s\n", __FILE__, __LINE__, #condition ); failures++; } } while( 0 )
+
+static int failures = 0;
+
+/* Runs the wheel the way a worker does, waking only when next() says to. */
+static void run_until_fired( timer_wheel_t* wheel, timer_wheel_entry_t* entry, int64_t limit )
+{
+	while( timer_wheel_pending( entry ) && wheel->current <= limit )
+	{
+		int64_t next = timer_wheel_next( wheel );
+
+		CHECK( next >= 0 );
+		CHECK( next <= entry->expires );
+
+		if( next < 0 || next > entry->expires )
+		{
+			return;
+		}
+
+		timer_wheel_entry_t* fired;
+
+		while( (fired = timer_wheel_expire( wheel, next )) )
+		{
+			CHECK( fired == entry );
+			CHECK( next == entry->expires );
+		}
+	}
+
+	CHECK( !timer_wheel_pending( entry ) );
+}
+
+/* A timer that cascades down at the current tick, right after an expire() ended on a slot boundary. */
+static void test_cascade_at_current( void )
+{
+	timer_wheel_t wheel;
+	timer_wheel_entry_t entry;
+
+	timer_wheel_init( &wheel, 27000 );
+	timer_wheel_entry_init( &entry, NULL );
+	timer_wheel_schedule( &wheel, &entry, 27622 );
+
+	CHECK( timer_wheel_expire( &wheel, 27583 ) == NULL );
+	CHECK( wheel.current == 27584 );
+	CHECK( timer_wheel_next( &wheel ) <= 27622 );
+
+	run_until_fired( &wheel, &entry, 27622 );
+}
+
+/* Every delay out to a few levels, starting from every offset within a slot. */
+static void test_delays( void )
+{
+	for( int64_t start = 0; start < 64; start += 9 )
+	{
+		for( int64_t delay = 0; delay < 300000; delay += delay < 300 ? 1 : 997 )
+		{
+			timer_wheel_t wheel;
+			timer_wheel_entry_t entry;
+
+			timer_wheel_init( &wheel, start );
+			timer_wheel_entry_init( &entry, NULL );
+			timer_wheel_schedule( &wheel, &entry, start + delay );
+			run_until_fired( &wheel, &entry, start + delay );
+
+			if( failures > 0 )
+			{
+				fprintf( stderr, "  start %ld, delay %ld\n", start, delay );
+				return;
+			}
+		}
+	}
+}
+
+int main( int argc, char* argv[] )
+{
+	test_cascade_at_current( );
+	test_delays( );
+
+	if( failures > 0 )
+	{
+		fprintf( stderr, "%d check(s) failed.\n", failures );
+		return 1;
+	}
+
+	printf( "timer_wheel: all checks passed.\n" );
+	return 0;
+}